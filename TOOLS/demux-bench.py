@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+
+"""
+Run mpv --demuxer-benchmark against synthetic files for the most important
+demuxers, and print a table of the results.
+
+Usage: demux-bench.py [--mpv=path] [--ffmpeg=path] [--dir=path] [--seeks=N]
+                      [--duration=seconds] [name...]
+
+The test files are generated with ffmpeg, and are kept in --dir (default: a
+directory in /tmp), so that repeated runs use the same files. If names are
+given, only the tests with these names are run (see TESTS below).
+
+Compare the output of two mpv builds to catch performance regressions in the
+demuxers. Note that the numbers include the time spent in the stream layer,
+so run it several times to get the file data into the OS disk cache.
+"""
+
+import os
+import re
+import subprocess
+import sys
+
+W, H = 320, 240
+
+AV_ARGS = ["-f", "lavfi", "-i", "testsrc=size=%dx%d:rate=25" % (W, H),
+           "-f", "lavfi", "-i", "sine=frequency=440",
+           "-c:v", "mpeg2video", "-g", "25", "-c:a", "mp2"]
+
+# name, file name, ffmpeg args to generate it (None: written by this script),
+# mpv args
+TESTS = [
+    ("mkv", "av.mkv", AV_ARGS, ["--demuxer=mkv"]),
+    ("lavf", "av.ts", AV_ARGS, ["--demuxer=lavf"]),
+    ("lavf-mkv", "av.mkv", AV_ARGS, ["--demuxer=lavf"]),
+    ("rawaudio", "audio.raw",
+        ["-f", "lavfi", "-i", "sine=frequency=440:sample_rate=44100",
+         "-ac", "2", "-f", "s16le"],
+        ["--demuxer=rawaudio"]),
+    ("rawvideo", "video.yuv",
+        ["-f", "lavfi", "-i", "testsrc=size=%dx%d:rate=25" % (W, H),
+         "-pix_fmt", "yuv420p", "-f", "rawvideo"],
+        ["--demuxer=rawvideo", "--demuxer-rawvideo-w=%d" % W,
+         "--demuxer-rawvideo-h=%d" % H]),
+    ("mf", "mf/%05d.png",
+        ["-f", "lavfi", "-i", "testsrc=size=%dx%d:rate=25" % (W, H)],
+        ["--mf-fps=25"]),
+    ("subreader", "subs.srt", None, ["--demuxer=subreader"]),
+]
+
+def parse_args(argv):
+    opts = {
+        "mpv": "mpv",
+        "ffmpeg": "ffmpeg",
+        "dir": "/tmp/mpv-demux-bench",
+        "seeks": "100",
+        "duration": "60",
+    }
+    names = []
+    for arg in argv:
+        m = re.match(r"--([a-z]+)=(.*)", arg)
+        if m and m.group(1) in opts:
+            opts[m.group(1)] = m.group(2)
+        elif arg.startswith("-"):
+            sys.exit(__doc__)
+        else:
+            names.append(arg)
+    return opts, names
+
+def write_srt(path, duration):
+    with open(path, "w") as f:
+        for n in range(duration * 2):
+            f.write("%d\n" % (n + 1))
+            for t in (n * 500, n * 500 + 400):
+                f.write("%02d:%02d:%02d,%03d" % (t // 3600000, t // 60000 % 60,
+                                                 t // 1000 % 60, t % 1000))
+                f.write(" --> " if t == n * 500 else "\n")
+            f.write("Subtitle line %d\n\n" % (n + 1))
+
+def generate(opts, name, filename, ffargs):
+    path = os.path.join(opts["dir"], filename)
+    if name == "mf":
+        if os.path.isdir(os.path.dirname(path)):
+            return
+        os.makedirs(os.path.dirname(path))
+    elif os.path.exists(path):
+        return
+    print("Generating %s..." % path, file=sys.stderr)
+    if ffargs is None:
+        write_srt(path, int(opts["duration"]))
+        return
+    cmd = [opts["ffmpeg"], "-loglevel", "error", "-y"] + ffargs
+    cmd += ["-t", opts["duration"], path]
+    subprocess.check_call(cmd)
+
+def run(opts, filename, mpvargs):
+    path = os.path.join(opts["dir"], filename)
+    if filename.startswith("mf/"):
+        path = "mf://" + os.path.join(opts["dir"], "mf", "*.png")
+    cmd = [opts["mpv"], "--no-config", "--demuxer-benchmark",
+           "--demuxer-benchmark-seeks=" + opts["seeks"]] + mpvargs + [path]
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                         universal_newlines=True).stdout
+    res = {}
+    m = re.search(r"Benchmark: (\d+) packets, (\d+) bytes in ([\d.]+) s: "
+                  r"(\d+) packets/s, ([\d.]+) MB/s, ([\d.]+) buffer", out)
+    if not m:
+        print(out, file=sys.stderr)
+        return None
+    res["packets/s"] = m.group(4)
+    res["MB/s"] = m.group(5)
+    res["mallocs/pkt"] = m.group(6)
+    m = re.search(r"demux_seek ([\d.]+) ms avg.*first packet ([\d.]+) ms avg",
+                  out)
+    res["seek ms"] = m.group(1) if m else "-"
+    res["1st pkt ms"] = m.group(2) if m else "-"
+    return res
+
+def main(argv):
+    opts, names = parse_args(argv)
+    os.makedirs(opts["dir"], exist_ok=True)
+    cols = ["packets/s", "MB/s", "mallocs/pkt", "seek ms", "1st pkt ms"]
+    print("%-10s" % "test" + "".join("%13s" % c for c in cols))
+    for name, filename, ffargs, mpvargs in TESTS:
+        if names and name not in names:
+            continue
+        generate(opts, name, filename, ffargs)
+        res = run(opts, filename, mpvargs)
+        if not res:
+            print("%-10s failed" % name)
+            continue
+        print("%-10s" % name + "".join("%13s" % res[c] for c in cols))
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
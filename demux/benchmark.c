@@ -0,0 +1,140 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "talloc.h"
+#include "common/common.h"
+#include "common/msg.h"
+#include "osdep/timer.h"
+
+#include "demux.h"
+#include "packet_pool.h"
+
+// Fixed seed, so that runs on the same file seek to the same positions.
+#define SEED 0x2545F491
+
+struct bench_read {
+    int64_t packets;
+    int64_t bytes;
+};
+
+static void count_packet(struct bench_read *r, struct demux_packet *pkt)
+{
+    r->packets++;
+    r->bytes += pkt->len;
+    talloc_free(pkt);
+}
+
+// Read packets from all streams until EOF. For each stream in turn, read one
+// packet (which makes the demuxer read until there is one), and then take all
+// packets that got queued meanwhile, so that the queues of badly interleaved
+// streams don't overflow.
+static void read_all(struct demuxer *demuxer, struct bench_read *r)
+{
+    bool active = true;
+    while (active) {
+        active = false;
+        for (int n = 0; n < demuxer->num_streams; n++) {
+            struct sh_stream *sh = demuxer->streams[n];
+            struct demux_packet *pkt = demux_read_packet(sh);
+            if (!pkt)
+                continue;
+            active = true;
+            count_packet(r, pkt);
+            while (demux_has_packet(sh))
+                count_packet(r, demux_read_packet(sh));
+        }
+    }
+}
+
+// Read the first packet after a seek. Returns false on EOF.
+static bool read_first(struct demuxer *demuxer)
+{
+    for (int n = 0; n < demuxer->num_streams; n++) {
+        struct demux_packet *pkt = demux_read_packet(demuxer->streams[n]);
+        if (pkt) {
+            talloc_free(pkt);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void bench_seeks(struct demuxer *demuxer, int num_seeks)
+{
+    double start = demuxer_get_start_time(demuxer);
+    double len = demuxer_get_time_length(demuxer);
+    if (!demuxer->seekable || len <= 0) {
+        MP_INFO(demuxer, "Benchmark: file is not seekable, skipping seeks.\n");
+        return;
+    }
+
+    uint32_t state = SEED;
+    double seek_total = 0, seek_max = 0, first_total = 0, first_max = 0;
+    int failed = 0;
+    for (int n = 0; n < num_seeks; n++) {
+        state = state * 1664525 + 1013904223;
+        double target = start + len * (state >> 8) / (double)(1 << 24);
+
+        double t0 = mp_time_sec();
+        demux_seek(demuxer, target, SEEK_ABSOLUTE);
+        double t1 = mp_time_sec();
+        if (!read_first(demuxer))
+            failed++;
+        double t2 = mp_time_sec();
+
+        seek_total += t1 - t0;
+        seek_max = MPMAX(seek_max, t1 - t0);
+        first_total += t2 - t0;
+        first_max = MPMAX(first_max, t2 - t0);
+    }
+
+    MP_INFO(demuxer, "Benchmark: %d seeks: demux_seek %.3f ms avg, %.3f ms "
+            "max; first packet %.3f ms avg, %.3f ms max; %d hit EOF.\n",
+            num_seeks, seek_total / num_seeks * 1e3, seek_max * 1e3,
+            first_total / num_seeks * 1e3, first_max * 1e3, failed);
+}
+
+// Select all streams, read all packets as fast as possible, and then perform
+// num_seeks seeks to pseudo-random positions. Results are printed with
+// MP_INFO. The demuxer thread must not be running.
+void demux_benchmark(struct demuxer *demuxer, int num_seeks)
+{
+    for (int n = 0; n < demuxer->num_streams; n++)
+        demuxer_select_track(demuxer, demuxer->streams[n], true);
+
+    MP_INFO(demuxer, "Benchmark: demuxer %s, %d streams.\n",
+            demuxer->desc->name, demuxer->num_streams);
+
+    struct bench_read r = {0};
+    uint64_t mallocs = demux_packet_pool_num_mallocs();
+    double t0 = mp_time_sec();
+    read_all(demuxer, &r);
+    double t = MPMAX(mp_time_sec() - t0, 1e-9);
+    mallocs = demux_packet_pool_num_mallocs() - mallocs;
+
+    MP_INFO(demuxer, "Benchmark: %"PRId64" packets, %"PRId64" bytes in %.3f s: "
+            "%.0f packets/s, %.2f MB/s, %.3f buffer mallocs/packet.\n",
+            r.packets, r.bytes, t, r.packets / t, r.bytes / t / 1e6,
+            r.packets ? mallocs / (double)r.packets : 0);
+
+    if (num_seeks > 0)
+        bench_seeks(demuxer, num_seeks);
+}
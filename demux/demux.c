@@ -24,6 +24,7 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <math.h>
 
@@ -41,6 +42,7 @@
 #include "demux.h"
 #include "stheader.h"
 #include "mf.h"
+#include "packet_pool.h"
 
 #include "audio/format.h"
 
@@ -94,11 +96,46 @@ struct demux_stream {
     int selected;          // user wants packets from this stream
     int eof;               // end of demuxed stream? (true if all buffer empty)
     int packs;            // number of packets in buffer
-    int bytes;            // total bytes of packets in buffer
+    int64_t bytes;        // total bytes of packets in buffer
     struct demux_packet *head;
     struct demux_packet *tail;
 };
 
+// State shared between the demuxer user and the demuxer thread. The packet
+// queues (struct demux_stream) are protected by the same lock.
+struct demux_internal {
+    pthread_mutex_t lock;
+    // Signaled when the thread has new work (requests, packets wanted), and
+    // when it made progress (packets added, requests executed, paused).
+    pthread_cond_t wakeup;
+    pthread_t thread;
+
+    // -- All the following fields are protected by lock.
+
+    bool threading;             // demuxer thread is running
+    bool thread_terminate;
+    int thread_request_pause;   // number of active demux_pause() calls
+    bool thread_paused;         // thread doesn't access the demuxer
+
+    bool eof;                   // last fill_buffer() call returned EOF
+    bool read_request;          // a reader is blocked waiting for a packet
+    int min_packs;              // read ahead until this many packets queued
+    int64_t max_bytes;          // limits for all packet queues together
+    int max_packs;
+
+    bool tracks_switched;       // DEMUXER_CTRL_SWITCHED_TRACKS pending
+    bool seeking;               // seek pending
+    float seek_pts;
+    int seek_flags;
+
+    // Values returned by demuxer_get_time_length() etc. while threading.
+    double time_length;
+    double start_time;
+
+    // Payload buffers of packets allocated with demuxer_new_packet().
+    struct demux_packet_pool *packet_pool;
+};
+
 static void add_stream_chapters(struct demuxer *demuxer);
 void demuxer_sort_chapters(demuxer_t *demuxer);
 
@@ -120,7 +157,7 @@ static void packet_destroy(void *ptr)
 {
     struct demux_packet *dp = ptr;
     talloc_free(dp->avpacket);
-    free(dp->allocation);
+    demux_packet_pool_free(dp->allocation);
 }
 
 static struct demux_packet *create_packet(size_t len)
@@ -143,10 +180,11 @@ static struct demux_packet *create_packet(size_t len)
     return dp;
 }
 
-struct demux_packet *new_demux_packet(size_t len)
+static struct demux_packet *alloc_packet(struct demux_packet_pool *pool,
+                                         size_t len)
 {
     struct demux_packet *dp = create_packet(len);
-    dp->buffer = malloc(len + MP_INPUT_BUFFER_PADDING_SIZE);
+    dp->buffer = demux_packet_pool_alloc(pool, len + MP_INPUT_BUFFER_PADDING_SIZE);
     if (!dp->buffer) {
         fprintf(stderr, "Memory allocation failure!\n");
         abort();
@@ -156,6 +194,67 @@ struct demux_packet *new_demux_packet(size_t len)
     return dp;
 }
 
+struct demux_packet *new_demux_packet(size_t len)
+{
+    return alloc_packet(NULL, len);
+}
+
+// Like new_demux_packet(), but recycle the packet memory.
+struct demux_packet *demuxer_new_packet(struct demuxer *demuxer, size_t len)
+{
+    return alloc_packet(demuxer->in->packet_pool, len);
+}
+
+struct demux_packet *demuxer_new_packet_from(struct demuxer *demuxer,
+                                             void *data, size_t len)
+{
+    struct demux_packet *dp = demuxer_new_packet(demuxer, len);
+    memcpy(dp->buffer, data, len);
+    return dp;
+}
+
+// Return a buffer with at least size bytes from the demuxer's packet pool. Free
+// it with demux_packet_pool_free(). Used with new_demux_packet_ref().
+void *demuxer_alloc_packet_buffer(struct demuxer *demuxer, size_t size)
+{
+    void *buf = demux_packet_pool_alloc(demuxer->in->packet_pool, size);
+    if (!buf) {
+        fprintf(stderr, "Memory allocation failure!\n");
+        abort();
+    }
+    return buf;
+}
+
+// Create a packet for len bytes at data, which must point into buf, without
+// copying. buf is a buffer returned by demuxer_alloc_packet_buffer(), and the
+// packet takes a new reference to it. At least MP_INPUT_BUFFER_PADDING_SIZE
+// bytes after the packet data must be allocated (but can be non-zero).
+struct demux_packet *new_demux_packet_ref(void *buf, void *data, size_t len)
+{
+    struct demux_packet *dp = create_packet(len);
+    demux_packet_pool_ref(buf);
+    dp->buffer = data;
+    dp->allocation = buf;
+    return dp;
+}
+
+// Read up to len bytes from the stream directly into a new packet. Returns
+// NULL if nothing could be read. Sets dp->pos to the stream position.
+struct demux_packet *demuxer_read_packet_data(struct demuxer *demuxer,
+                                              struct stream *s, size_t len)
+{
+    struct demux_packet *dp = demuxer_new_packet(demuxer, len);
+    dp->pos = stream_tell(s);
+    int r = stream_read(s, dp->buffer, len);
+    if (r <= 0) {
+        talloc_free(dp);
+        return NULL;
+    }
+    if ((size_t)r < len)
+        resize_demux_packet(dp, r);
+    return dp;
+}
+
 // data must already have suitable padding, and does not copy the data
 struct demux_packet *new_demux_packet_fromdata(void *data, size_t len)
 {
@@ -177,8 +276,9 @@ void resize_demux_packet(struct demux_packet *dp, size_t len)
         fprintf(stderr, "Attempt to realloc demux packet over 1 GB!\n");
         abort();
     }
-    assert(dp->allocation);
-    dp->buffer = realloc(dp->buffer, len + MP_INPUT_BUFFER_PADDING_SIZE);
+    assert(dp->allocation && dp->allocation == dp->buffer);
+    dp->buffer = demux_packet_pool_realloc(dp->buffer,
+                                           len + MP_INPUT_BUFFER_PADDING_SIZE);
     if (!dp->buffer) {
         fprintf(stderr, "Memory allocation failure!\n");
         abort();
@@ -273,11 +373,17 @@ void free_demuxer(demuxer_t *demuxer)
 {
     if (!demuxer)
         return;
+    struct demux_internal *in = demuxer->in;
+    demux_stop_thread(demuxer);
     if (demuxer->desc->close)
         demuxer->desc->close(demuxer);
     // free streams:
     for (int n = 0; n < demuxer->num_streams; n++)
         ds_free_packs(demuxer->streams[n]->ds);
+    pthread_cond_destroy(&in->wakeup);
+    pthread_mutex_destroy(&in->lock);
+    // Packets still owned by the player keep the pool alive.
+    demux_packet_pool_unref(in->packet_pool);
     talloc_free(demuxer);
 }
 
@@ -299,9 +405,9 @@ static int count_packs(struct demuxer *demux, enum stream_type type)
     return c;
 }
 
-static int count_bytes(struct demuxer *demux, enum stream_type type)
+static int64_t count_bytes(struct demuxer *demux, enum stream_type type)
 {
-    int c = 0;
+    int64_t c = 0;
     for (int n = 0; n < demux->num_streams; n++)
         c += demux->streams[n]->type == type ? demux->streams[n]->ds->bytes : 0;
     return c;
@@ -311,8 +417,9 @@ static int count_bytes(struct demuxer *demux, enum stream_type type)
 int demuxer_add_packet(demuxer_t *demuxer, struct sh_stream *stream,
                        demux_packet_t *dp)
 {
+    struct demux_internal *in = demuxer->in;
     struct demux_stream *ds = stream ? stream->ds : NULL;
-    if (!dp || !ds || !ds->selected) {
+    if (!dp || !ds) {
         talloc_free(dp);
         return 0;
     }
@@ -325,6 +432,15 @@ int demuxer_add_packet(demuxer_t *demuxer, struct sh_stream *stream,
         return 1;
     }
 
+    pthread_mutex_lock(&in->lock);
+    if (!ds->selected || in->seeking) {
+        // If a seek is pending, this packet was read from the old position.
+        bool seeking = in->seeking;
+        pthread_mutex_unlock(&in->lock);
+        talloc_free(dp);
+        return seeking;
+    }
+
     dp->stream = stream->index;
     dp->next = NULL;
 
@@ -358,29 +474,48 @@ int demuxer_add_packet(demuxer_t *demuxer, struct sh_stream *stream,
            "[packs: A=%d V=%d S=%d]\n", stream_type_name(stream->type),
            dp->len, dp->pts, dp->pos, count_packs(demuxer, STREAM_AUDIO),
            count_packs(demuxer, STREAM_VIDEO), count_packs(demuxer, STREAM_SUB));
+    pthread_cond_broadcast(&in->wakeup);
+    pthread_mutex_unlock(&in->lock);
     return 1;
 }
 
-static bool demux_check_queue_full(demuxer_t *demux)
+// Whether the packet queues of all streams together exceed the limits set
+// with --demuxer-queue-size and --demuxer-queue-packets. Reading ahead stops
+// when 3/4 of the limits are reached. The rest is reserved for reading packets
+// for a starved stream, i.e. a stream that has a reader waiting for a packet
+// while other streams have lots of data queued (badly interleaved files).
+// Called locked.
+static bool demux_check_queue_full(demuxer_t *demux, bool readahead)
 {
+    struct demux_internal *in = demux->in;
+    int64_t bytes = 0;
+    int packs = 0;
     for (int n = 0; n < demux->num_streams; n++) {
-        struct sh_stream *sh = demux->streams[n];
-        if (sh->ds->packs > MAX_PACKS || sh->ds->bytes > MAX_PACK_BYTES)
-            goto overflow;
+        bytes += demux->streams[n]->ds->bytes;
+        packs += demux->streams[n]->ds->packs;
     }
-    return false;
-
-overflow:
+    int64_t max_bytes = in->max_bytes;
+    int max_packs = in->max_packs;
+    if (readahead) {
+        max_bytes -= max_bytes / 4;
+        max_packs -= max_packs / 4;
+    }
+    if (bytes < max_bytes && packs < max_packs)
+        return false;
+    if (readahead)
+        return true;
 
     if (!demux->warned_queue_overflow) {
         MP_ERR(demux, "Too many packets in the demuxer "
-               "packet queue (video: %d packets in %d bytes, audio: %d "
-               "packets in %d bytes, sub: %d packets in %d bytes).\n",
+               "packet queue (video: %d packets in %"PRId64" bytes, audio: %d "
+               "packets in %"PRId64" bytes, sub: %d packets in %"PRId64" "
+               "bytes).\n",
                count_packs(demux, STREAM_VIDEO), count_bytes(demux, STREAM_VIDEO),
                count_packs(demux, STREAM_AUDIO), count_bytes(demux, STREAM_AUDIO),
                count_packs(demux, STREAM_SUB), count_bytes(demux, STREAM_SUB));
         MP_INFO(demux, "Maybe you are playing a non-"
-                "interleaved stream/file or the codec failed?\n");
+                "interleaved stream/file or the codec failed? If not, "
+                "try increasing --demuxer-queue-size.\n");
     }
     demux->warned_queue_overflow = true;
     return true;
@@ -395,22 +530,59 @@ static int demux_fill_buffer(demuxer_t *demux)
     return demux->desc->fill_buffer ? demux->desc->fill_buffer(demux) : 0;
 }
 
+// Whether the demuxer thread should read more packets. Called locked.
+static bool read_more(demuxer_t *demux)
+{
+    struct demux_internal *in = demux->in;
+    if (in->eof)
+        return false;
+    // A reader waiting in ds_get_packets() may use the full queue budget.
+    if (in->read_request)
+        return !demux_check_queue_full(demux, false);
+    if (demux_check_queue_full(demux, true))
+        return false;
+    bool selected = false;
+    int packs = 0;
+    for (int n = 0; n < demux->num_streams; n++) {
+        struct demux_stream *ds = demux->streams[n]->ds;
+        if (ds->selected) {
+            selected = true;
+            packs += ds->packs;
+        }
+    }
+    return selected && packs < in->min_packs;
+}
+
+// Called locked. Without demuxer thread, the lock is released while reading.
 static void ds_get_packets(struct sh_stream *sh)
 {
     struct demux_stream *ds = sh->ds;
     demuxer_t *demux = sh->demuxer;
+    struct demux_internal *in = demux->in;
     MP_TRACE(demux, "ds_get_packets (%s) called\n",
              stream_type_name(sh->type));
     while (1) {
         if (ds->head)
             return;
 
-        if (demux_check_queue_full(demux))
+        if (demux_check_queue_full(demux, false))
             break;
 
-        if (!demux_fill_buffer(demux))
-            break; // EOF
+        if (in->threading) {
+            if (in->eof && !in->seeking && !in->tracks_switched)
+                break;
+            in->read_request = true;
+            pthread_cond_broadcast(&in->wakeup);
+            pthread_cond_wait(&in->wakeup, &in->lock);
+        } else {
+            pthread_mutex_unlock(&in->lock);
+            int r = demux_fill_buffer(demux);
+            pthread_mutex_lock(&in->lock);
+            if (!r)
+                break; // EOF
+        }
     }
+    in->read_request = false;
     MP_VERBOSE(demux, "ds_get_packets: EOF reached (stream: %s)\n",
                stream_type_name(sh->type));
     ds->eof = 1;
@@ -422,9 +594,12 @@ static void ds_get_packets(struct sh_stream *sh)
 struct demux_packet *demux_read_packet(struct sh_stream *sh)
 {
     struct demux_stream *ds = sh ? sh->ds : NULL;
+    struct demux_packet *pkt = NULL;
     if (ds) {
+        struct demux_internal *in = sh->demuxer->in;
+        pthread_mutex_lock(&in->lock);
         ds_get_packets(sh);
-        struct demux_packet *pkt = ds->head;
+        pkt = ds->head;
         if (pkt) {
             ds->head = pkt->next;
             pkt->next = NULL;
@@ -436,10 +611,13 @@ struct demux_packet *demux_read_packet(struct sh_stream *sh)
             if (pkt->stream_pts != MP_NOPTS_VALUE)
                 sh->demuxer->stream_pts = pkt->stream_pts;
 
-            return pkt;
+            // Let the thread refill the queue.
+            if (in->threading)
+                pthread_cond_broadcast(&in->wakeup);
         }
+        pthread_mutex_unlock(&in->lock);
     }
-    return NULL;
+    return pkt;
 }
 
 // Return the pts of the next packet that demux_read_packet() would return.
@@ -447,18 +625,31 @@ struct demux_packet *demux_read_packet(struct sh_stream *sh)
 // packets from the queue.
 double demux_get_next_pts(struct sh_stream *sh)
 {
-    if (sh && sh->ds->selected) {
-        ds_get_packets(sh);
-        if (sh->ds->head)
-            return sh->ds->head->pts;
+    double res = MP_NOPTS_VALUE;
+    if (sh) {
+        struct demux_internal *in = sh->demuxer->in;
+        pthread_mutex_lock(&in->lock);
+        if (sh->ds->selected) {
+            ds_get_packets(sh);
+            if (sh->ds->head)
+                res = sh->ds->head->pts;
+        }
+        pthread_mutex_unlock(&in->lock);
     }
-    return MP_NOPTS_VALUE;
+    return res;
 }
 
 // Return whether a packet is queued. Never blocks, never forces any reads.
 bool demux_has_packet(struct sh_stream *sh)
 {
-    return sh && sh->ds->head;
+    bool has_packet = false;
+    if (sh) {
+        struct demux_internal *in = sh->demuxer->in;
+        pthread_mutex_lock(&in->lock);
+        has_packet = sh->ds->head;
+        pthread_mutex_unlock(&in->lock);
+    }
+    return has_packet;
 }
 
 // Same as demux_has_packet, but to be called internally by demuxers, as
@@ -468,10 +659,182 @@ bool demuxer_stream_has_packets_queued(struct demuxer *d, struct sh_stream *stre
     return demux_has_packet(stream);
 }
 
+// Return the number of packets and bytes queued for the stream.
+void demux_get_queue_size(struct sh_stream *sh, int *packets, int64_t *bytes)
+{
+    struct demux_internal *in = sh->demuxer->in;
+    pthread_mutex_lock(&in->lock);
+    *packets = sh->ds->packs;
+    *bytes = sh->ds->bytes;
+    pthread_mutex_unlock(&in->lock);
+}
+
 // Return whether EOF was returned with an earlier packet read.
 bool demux_stream_eof(struct sh_stream *sh)
 {
-    return !sh || sh->ds->eof;
+    bool eof = true;
+    if (sh) {
+        struct demux_internal *in = sh->demuxer->in;
+        pthread_mutex_lock(&in->lock);
+        eof = sh->ds->eof;
+        pthread_mutex_unlock(&in->lock);
+    }
+    return eof;
+}
+
+static int control_demuxer(demuxer_t *demuxer, int cmd, void *arg)
+{
+    if (demuxer->desc->control)
+        return demuxer->desc->control(demuxer, cmd, arg);
+
+    return DEMUXER_CTRL_NOTIMPL;
+}
+
+static double get_time_length(struct demuxer *demuxer)
+{
+    double len;
+    if (stream_control(demuxer->stream, STREAM_CTRL_GET_TIME_LENGTH, &len) > 0)
+        return len;
+    // <= 0 means DEMUXER_CTRL_NOTIMPL or DEMUXER_CTRL_DONTKNOW
+    if (control_demuxer(demuxer, DEMUXER_CTRL_GET_TIME_LENGTH, &len) > 0)
+        return len;
+    return -1;
+}
+
+static double get_start_time(struct demuxer *demuxer)
+{
+    double time;
+    if (stream_control(demuxer->stream, STREAM_CTRL_GET_START_TIME, &time) > 0)
+        return time;
+    if (control_demuxer(demuxer, DEMUXER_CTRL_GET_START_TIME, &time) > 0)
+        return time;
+    return 0;
+}
+
+static void execute_seek(demuxer_t *demuxer, float rel_seek_secs, int flags);
+
+static void *demux_thread(void *pctx)
+{
+    struct demuxer *demuxer = pctx;
+    struct demux_internal *in = demuxer->in;
+    pthread_mutex_lock(&in->lock);
+    while (!in->thread_terminate) {
+        in->thread_paused = in->thread_request_pause > 0;
+        if (in->thread_paused) {
+            pthread_cond_broadcast(&in->wakeup);
+            pthread_cond_wait(&in->wakeup, &in->lock);
+            continue;
+        }
+        if (in->tracks_switched) {
+            in->tracks_switched = false;
+            pthread_mutex_unlock(&in->lock);
+            control_demuxer(demuxer, DEMUXER_CTRL_SWITCHED_TRACKS, NULL);
+            pthread_mutex_lock(&in->lock);
+            continue;
+        }
+        if (in->seeking) {
+            float seek_pts = in->seek_pts;
+            int seek_flags = in->seek_flags;
+            in->seeking = false;
+            pthread_mutex_unlock(&in->lock);
+            execute_seek(demuxer, seek_pts, seek_flags);
+            double len = get_time_length(demuxer);
+            pthread_mutex_lock(&in->lock);
+            in->time_length = len;
+            pthread_cond_broadcast(&in->wakeup);
+            continue;
+        }
+        if (read_more(demuxer)) {
+            pthread_mutex_unlock(&in->lock);
+            bool eof = !demux_fill_buffer(demuxer);
+            pthread_mutex_lock(&in->lock);
+            // EOF at the position before a new request is irrelevant.
+            if (eof && !in->seeking && !in->tracks_switched)
+                in->eof = true;
+            pthread_cond_broadcast(&in->wakeup);
+            continue;
+        }
+        // Readers waiting for EOF or a full queue are blocked until here.
+        pthread_cond_broadcast(&in->wakeup);
+        pthread_cond_wait(&in->wakeup, &in->lock);
+    }
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+}
+
+// Start reading packets in a separate thread (if enabled with the
+// --demuxer-thread option). From then on, reading packets never blocks on
+// I/O, unless the packet queues are empty. Seeks and track switches are
+// passed to the thread, and other accesses to the demuxer implementation
+// are synchronized with demux_pause().
+void demux_start_thread(struct demuxer *demuxer)
+{
+    struct demux_internal *in = demuxer->in;
+    if (in->threading || !demuxer->opts->demuxer_thread ||
+        !demuxer->desc->fill_buffer)
+        return;
+    // DVD/BD streams are controlled by the player in too many ways.
+    if (stream_manages_timeline(demuxer->stream))
+        return;
+
+    in->time_length = get_time_length(demuxer);
+    in->start_time = get_start_time(demuxer);
+    in->min_packs = demuxer->opts->demuxer_min_packs;
+    in->thread_terminate = false;
+    in->threading = true;
+    if (pthread_create(&in->thread, NULL, demux_thread, demuxer)) {
+        MP_ERR(demuxer, "Failed to create demuxer thread.\n");
+        in->threading = false;
+    }
+}
+
+void demux_stop_thread(struct demuxer *demuxer)
+{
+    struct demux_internal *in = demuxer->in;
+    if (!in->threading)
+        return;
+
+    pthread_mutex_lock(&in->lock);
+    in->thread_terminate = true;
+    pthread_cond_broadcast(&in->wakeup);
+    pthread_mutex_unlock(&in->lock);
+    pthread_join(in->thread, NULL);
+    in->threading = false;
+    in->thread_terminate = false;
+
+    // Execute requests the thread didn't get to.
+    if (in->tracks_switched) {
+        in->tracks_switched = false;
+        control_demuxer(demuxer, DEMUXER_CTRL_SWITCHED_TRACKS, NULL);
+    }
+    if (in->seeking) {
+        in->seeking = false;
+        execute_seek(demuxer, in->seek_pts, in->seek_flags);
+    }
+}
+
+// Wait until the demuxer thread is not accessing the demuxer implementation
+// or the stream anymore, and keep it that way until demux_unpause(). This
+// might block until the thread finishes reading the current packet.
+void demux_pause(struct demuxer *demuxer)
+{
+    struct demux_internal *in = demuxer->in;
+    pthread_mutex_lock(&in->lock);
+    in->thread_request_pause++;
+    pthread_cond_broadcast(&in->wakeup);
+    while (in->threading && !in->thread_paused)
+        pthread_cond_wait(&in->wakeup, &in->lock);
+    pthread_mutex_unlock(&in->lock);
+}
+
+void demux_unpause(struct demuxer *demuxer)
+{
+    struct demux_internal *in = demuxer->in;
+    pthread_mutex_lock(&in->lock);
+    assert(in->thread_request_pause > 0);
+    in->thread_request_pause--;
+    pthread_cond_broadcast(&in->wakeup);
+    pthread_mutex_unlock(&in->lock);
 }
 
 // ====================================================================
@@ -597,7 +960,13 @@ static struct demuxer *open_given_type(struct mpv_global *global,
         .glog = log,
         .filename = talloc_strdup(demuxer, stream->url),
         .metadata = talloc_zero(demuxer, struct mp_tags),
+        .in = talloc_zero(demuxer, struct demux_internal),
     };
+    pthread_mutex_init(&demuxer->in->lock, NULL);
+    pthread_cond_init(&demuxer->in->wakeup, NULL);
+    demuxer->in->packet_pool = demux_packet_pool_create();
+    demuxer->in->max_bytes = demuxer->opts->demuxer_queue_size * 1024LL * 1024;
+    demuxer->in->max_packs = demuxer->opts->demuxer_queue_packets;
     demuxer->params = params; // temporary during open()
     stream_seek(stream, stream->start_pos);
 
@@ -694,15 +1063,26 @@ done:
     return demuxer;
 }
 
-void demux_flush(demuxer_t *demuxer)
+// Called locked.
+static void flush_locked(demuxer_t *demuxer)
 {
     for (int n = 0; n < demuxer->num_streams; n++)
         ds_free_packs(demuxer->streams[n]->ds);
     demuxer->warned_queue_overflow = false;
+    demuxer->in->eof = false;
+}
+
+void demux_flush(demuxer_t *demuxer)
+{
+    pthread_mutex_lock(&demuxer->in->lock);
+    flush_locked(demuxer);
+    pthread_mutex_unlock(&demuxer->in->lock);
 }
 
 int demux_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
 {
+    struct demux_internal *in = demuxer->in;
+
     if (!demuxer->seekable) {
         MP_WARN(demuxer, "Cannot seek in this file.\n");
         return 0;
@@ -711,9 +1091,35 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
     if (rel_seek_secs == MP_NOPTS_VALUE && (flags & SEEK_ABSOLUTE))
         return 0;
 
+    pthread_mutex_lock(&in->lock);
+
     // clear demux buffers:
-    demux_flush(demuxer);
+    flush_locked(demuxer);
+
+    if (in->threading) {
+        // Merge with a relative seek that wasn't executed yet.
+        if (in->seeking && !(flags & (SEEK_ABSOLUTE | SEEK_FACTOR)) &&
+            !(in->seek_flags & SEEK_FACTOR))
+        {
+            rel_seek_secs += in->seek_pts;
+            flags |= in->seek_flags & SEEK_ABSOLUTE;
+        }
+        in->seeking = true;
+        in->seek_pts = rel_seek_secs;
+        in->seek_flags = flags;
+        pthread_cond_broadcast(&in->wakeup);
+        pthread_mutex_unlock(&in->lock);
+        return 1;
+    }
 
+    pthread_mutex_unlock(&in->lock);
+
+    execute_seek(demuxer, rel_seek_secs, flags);
+    return 1;
+}
+
+static void execute_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
+{
     /* Note: this is for DVD and BD playback. The stream layer has to do these
      * seeks, and the demuxer has to react to DEMUXER_CTRL_RESYNC in order to
      * deal with the suddenly changing stream position.
@@ -741,16 +1147,14 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
 
         if (stream_control(demuxer->stream, STREAM_CTRL_SEEK_TO_TIME, &pts)
             != STREAM_UNSUPPORTED) {
-            demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
-            return 1;
+            control_demuxer(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+            return;
         }
     }
 
   dmx_seek:
     if (demuxer->desc->seek)
         demuxer->desc->seek(demuxer, rel_seek_secs, flags);
-
-    return 1;
 }
 
 static int demux_info_print(demuxer_t *demuxer)
@@ -781,6 +1185,7 @@ char *demux_info_get(demuxer_t *demuxer, const char *opt)
 
 bool demux_info_update(struct demuxer *demuxer)
 {
+    demux_pause(demuxer);
     struct mp_tags *tags = demuxer->metadata;
     // Take care of stream metadata as well
     char **meta;
@@ -801,20 +1206,35 @@ bool demux_info_update(struct demuxer *demuxer)
         talloc_free(demuxer->previous_metadata);
         demuxer->previous_metadata = data;
         demux_info_print(demuxer);
+        demux_unpause(demuxer);
         return true;
     } else {
         talloc_free(data);
+        demux_unpause(demuxer);
         return false;
     }
 }
 
 int demux_control(demuxer_t *demuxer, int cmd, void *arg)
 {
+    demux_pause(demuxer);
+    int r = control_demuxer(demuxer, cmd, arg);
+    demux_unpause(demuxer);
+    return r;
+}
 
-    if (demuxer->desc->control)
-        return demuxer->desc->control(demuxer, cmd, arg);
-
-    return DEMUXER_CTRL_NOTIMPL;
+// Same as stream_control(demuxer->stream, ...), but safe to use while the
+// demuxer thread is running.
+int demux_stream_control(struct demuxer *demuxer, int cmd, void *arg)
+{
+    // The cache is thread-safe, and never blocks on the actual stream.
+    bool pause = !demuxer->stream->uncached_stream;
+    if (pause)
+        demux_pause(demuxer);
+    int r = stream_control(demuxer->stream, cmd, arg);
+    if (pause)
+        demux_unpause(demuxer);
+    return r;
 }
 
 struct sh_stream *demuxer_stream_by_demuxer_id(struct demuxer *d,
@@ -843,12 +1263,22 @@ void demuxer_switch_track(struct demuxer *demuxer, enum stream_type type,
 void demuxer_select_track(struct demuxer *demuxer, struct sh_stream *stream,
                           bool selected)
 {
+    struct demux_internal *in = demuxer->in;
+    pthread_mutex_lock(&in->lock);
     // don't flush buffers if stream is already selected / unselected
-    if (stream->ds->selected != selected) {
+    bool update = stream->ds->selected != selected;
+    if (update) {
         stream->ds->selected = selected;
         ds_free_packs(stream->ds);
-        demux_control(demuxer, DEMUXER_CTRL_SWITCHED_TRACKS, NULL);
+        in->eof = false;
+        // The thread notifies the demuxer before reading the next packet.
+        in->tracks_switched = in->threading;
+        pthread_cond_broadcast(&in->wakeup);
     }
+    bool threading = in->threading;
+    pthread_mutex_unlock(&in->lock);
+    if (update && !threading)
+        control_demuxer(demuxer, DEMUXER_CTRL_SWITCHED_TRACKS, NULL);
 }
 
 void demuxer_enable_autoselect(struct demuxer *demuxer)
@@ -931,25 +1361,26 @@ static void add_stream_chapters(struct demuxer *demuxer)
     }
 }
 
+// With the demuxer thread, these return the values determined when the thread
+// was started (or, for the length, at the last seek), so they never block.
 double demuxer_get_time_length(struct demuxer *demuxer)
 {
-    double len;
-    if (stream_control(demuxer->stream, STREAM_CTRL_GET_TIME_LENGTH, &len) > 0)
-        return len;
-    // <= 0 means DEMUXER_CTRL_NOTIMPL or DEMUXER_CTRL_DONTKNOW
-    if (demux_control(demuxer, DEMUXER_CTRL_GET_TIME_LENGTH, &len) > 0)
-        return len;
-    return -1;
+    struct demux_internal *in = demuxer->in;
+    pthread_mutex_lock(&in->lock);
+    bool threading = in->threading;
+    double len = in->time_length;
+    pthread_mutex_unlock(&in->lock);
+    return threading ? len : get_time_length(demuxer);
 }
 
 double demuxer_get_start_time(struct demuxer *demuxer)
 {
-    double time;
-    if (stream_control(demuxer->stream, STREAM_CTRL_GET_START_TIME, &time) > 0)
-        return time;
-    if (demux_control(demuxer, DEMUXER_CTRL_GET_START_TIME, &time) > 0)
-        return time;
-    return 0;
+    struct demux_internal *in = demuxer->in;
+    pthread_mutex_lock(&in->lock);
+    bool threading = in->threading;
+    double time = in->start_time;
+    pthread_mutex_unlock(&in->lock);
+    return threading ? time : get_start_time(demuxer);
 }
 
 int demuxer_angles_count(demuxer_t *demuxer)
@@ -1027,14 +1458,17 @@ void demux_packet_list_seek(struct demux_packet **pkts, int num_pkts,
         ref_time += rel_seek_secs;
     }
 
-    // Could do binary search, but it's probably not worth the complexity.
-    int last_index = 0;
-    for (int n = 0; n < num_pkts; n++) {
-        if (pkts[n]->pts > ref_time)
-            break;
-        last_index = n;
+    // Find the last packet with pts <= ref_time (the list is sorted).
+    int lo = 0, hi = num_pkts;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (pkts[mid]->pts > ref_time) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
     }
-    *current = last_index;
+    *current = MPMAX(lo - 1, 0);
 }
 
 double demux_packet_list_duration(struct demux_packet **pkts, int num_pkts)
@@ -1056,3 +1490,28 @@ struct demux_packet *demux_packet_list_fill(struct demux_packet **pkts,
     *current += 1;
     return new;
 }
+
+#define MS_TS(f_ts) ((int)((f_ts) * 1000 + 0.5))
+
+// Remove an overlap or fill a gap between two adjacent subtitle packets. This
+// is done by adjusting the duration of the earlier packet. If the gap or
+// overlap is larger than the threshold, or if the durations are close to the
+// threshold, don't change the events.
+void demux_packet_fix_timing(struct demux_packet *cur, struct demux_packet *next)
+{
+    double threshold = 0.2;     // up to 200 ms overlaps or gaps are removed
+    double keep = threshold * 2;// don't change timings if durations are smaller
+    if (cur->pts != MP_NOPTS_VALUE && cur->duration > 0 &&
+        next->pts != MP_NOPTS_VALUE && next->duration > 0)
+    {
+        double end = cur->pts + cur->duration;
+        if (fabs(next->pts - end) <= threshold && cur->duration >= keep &&
+            next->duration >= keep)
+        {
+            // Conceptually: cur->duration = next->pts - cur->pts;
+            // But make sure the rounding and conversion to integers in
+            // sd_ass.c can't produce overlaps.
+            cur->duration = (MS_TS(next->pts) - MS_TS(cur->pts)) / 1000.0;
+        }
+    }
+}
@@ -33,9 +33,6 @@
 
 struct MPOpts;
 
-#define MAX_PACKS 4096
-#define MAX_PACK_BYTES 0x8000000  // 128 MiB
-
 enum demuxer_type {
     DEMUXER_TYPE_GENERIC = 0,
     DEMUXER_TYPE_TV,
@@ -204,6 +201,7 @@ typedef struct demuxer {
     char *previous_metadata;
 
     void *priv;   // demuxer-specific internal data
+    struct demux_internal *in; // internal to demux.c
     struct MPOpts *opts;
     struct mpv_global *global;
     struct mp_log *log, *glog;
@@ -219,6 +217,13 @@ struct demux_packet *new_demux_packet(size_t len);
 // data must already have suitable padding
 struct demux_packet *new_demux_packet_fromdata(void *data, size_t len);
 struct demux_packet *new_demux_packet_from(void *data, size_t len);
+struct demux_packet *demuxer_new_packet(struct demuxer *demuxer, size_t len);
+struct demux_packet *demuxer_new_packet_from(struct demuxer *demuxer,
+                                             void *data, size_t len);
+void *demuxer_alloc_packet_buffer(struct demuxer *demuxer, size_t size);
+struct demux_packet *new_demux_packet_ref(void *buf, void *data, size_t len);
+struct demux_packet *demuxer_read_packet_data(struct demuxer *demuxer,
+                                              struct stream *s, size_t len);
 void resize_demux_packet(struct demux_packet *dp, size_t len);
 void free_demux_packet(struct demux_packet *dp);
 struct demux_packet *demux_copy_packet(struct demux_packet *dp);
@@ -236,6 +241,7 @@ struct demux_packet *demux_read_packet(struct sh_stream *sh);
 double demux_get_next_pts(struct sh_stream *sh);
 bool demux_has_packet(struct sh_stream *sh);
 bool demux_stream_eof(struct sh_stream *sh);
+void demux_get_queue_size(struct sh_stream *sh, int *packets, int64_t *bytes);
 
 struct sh_stream *new_sh_stream(struct demuxer *demuxer, enum stream_type type);
 
@@ -250,6 +256,12 @@ char *demux_info_get(struct demuxer *demuxer, const char *opt);
 bool demux_info_update(struct demuxer *demuxer);
 
 int demux_control(struct demuxer *demuxer, int cmd, void *arg);
+int demux_stream_control(struct demuxer *demuxer, int cmd, void *arg);
+
+void demux_start_thread(struct demuxer *demuxer);
+void demux_stop_thread(struct demuxer *demuxer);
+void demux_pause(struct demuxer *demuxer);
+void demux_unpause(struct demuxer *demuxer);
 
 void demuxer_switch_track(struct demuxer *demuxer, enum stream_type type,
                           struct sh_stream *stream);
@@ -259,6 +271,8 @@ void demuxer_enable_autoselect(struct demuxer *demuxer);
 
 void demuxer_help(struct mp_log *log);
 
+void demux_benchmark(struct demuxer *demuxer, int num_seeks);
+
 int demuxer_add_attachment(struct demuxer *demuxer, struct bstr name,
                            struct bstr type, struct bstr data);
 int demuxer_add_chapter(struct demuxer *demuxer, struct bstr name,
@@ -286,9 +300,13 @@ void demux_packet_list_seek(struct demux_packet **pkts, int num_pkts,
 double demux_packet_list_duration(struct demux_packet **pkts, int num_pkts);
 struct demux_packet *demux_packet_list_fill(struct demux_packet **pkts,
                                             int num_pkts, int *current);
+void demux_packet_fix_timing(struct demux_packet *cur, struct demux_packet *next);
 
 bool demux_matroska_uid_cmp(struct matroska_segment_uid *a,
                             struct matroska_segment_uid *b);
+int demux_mkv_read_segment_uids(struct stream *s, struct mp_log *log,
+                                void *talloc_ctx,
+                                struct matroska_segment_uid **uids);
 
 const char *stream_type_name(enum stream_type type);
 
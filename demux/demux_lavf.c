@@ -24,7 +24,10 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "config.h"
 
@@ -33,6 +36,9 @@
 #include <libavutil/avutil.h>
 #include <libavutil/avstring.h>
 #include <libavutil/mathematics.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/intfloat.h>
+#include <libavutil/md5.h>
 #if HAVE_AVCODEC_REPLAYGAIN_SIDE_DATA
 # include <libavutil/replaygain.h>
 #endif
@@ -40,11 +46,14 @@
 #include "compat/libav.h"
 
 #include "options/options.h"
+#include "options/path.h"
 #include "common/msg.h"
 #include "common/tags.h"
 #include "common/av_opts.h"
 #include "common/av_common.h"
 #include "bstr/bstr.h"
+#include "osdep/timer.h"
+#include "osdep/io.h"
 
 #include "stream/stream.h"
 #include "demux.h"
@@ -56,9 +65,11 @@
 
 #define OPT_BASE_STRUCT struct MPOpts
 
-// Should correspond to IO_BUFFER_SIZE in libavformat/aviobuf.c (not public)
-// libavformat (almost) always reads data in blocks of this size.
-#define BIO_BUFFER_SIZE 32768
+// libavformat reads data in blocks of this size (IO_BUFFER_SIZE in
+// libavformat/aviobuf.c is only 32768). Larger blocks mean fewer calls into
+// the stream layer; reads return as soon as some data is available, so this
+// doesn't add latency.
+#define BIO_BUFFER_SIZE (128 * 1024)
 
 const m_option_t lavfdopts_conf[] = {
     OPT_INTRANGE("probesize", lavfdopts.probesize, 0, 32, INT_MAX),
@@ -72,11 +83,20 @@ const m_option_t lavfdopts_conf[] = {
     OPT_CHOICE("genpts-mode", lavfdopts.genptsmode, 0,
                ({"lavf", 1}, {"no", 0})),
     OPT_STRING("o", lavfdopts.avopt, 0),
+    OPT_FLAG("index", lavfdopts.index, 0),
+    OPT_STRING("index-dir", lavfdopts.index_dir, 0),
     {NULL, NULL, 0, 0, 0, 0, NULL}
 };
 
 #define MAX_PKT_QUEUE 50
 
+#define INDEX_ID_SIZE 32
+
+struct lavf_index_entry {
+    double pts;         // in seconds, same as demux_packet.pts
+    int64_t pos;        // byte position as used by libavformat
+};
+
 typedef struct lavf_priv {
     char *filename;
     const struct format_hack *format_hack;
@@ -88,6 +108,20 @@ typedef struct lavf_priv {
     int num_streams;
     int cur_program;
     char *mime_type;
+
+    // Statistics for mp_read()
+    int64_t read_calls;
+    int64_t read_bytes;
+    int64_t read_direct_bytes;  // read directly into the AVIO buffer
+    double read_time;
+
+    // Keyframe index (sorted by pts)
+    struct lavf_index_entry *index;
+    int num_index;
+    char *index_file;
+    uint8_t index_id[INDEX_ID_SIZE];
+    struct lavf_bg_index *bg_index;
+    bool index_byte_seek;       // use byte seeks, else libavformat's index
 } lavf_priv_t;
 
 struct format_hack {
@@ -116,10 +150,27 @@ static const char *format_blacklist[] = {
 static int mp_read(void *opaque, uint8_t *buf, int size)
 {
     struct demuxer *demuxer = opaque;
+    lavf_priv_t *priv = demuxer->priv;
     struct stream *stream = demuxer->stream;
     int ret;
 
-    ret = stream_read(stream, buf, size);
+    // If the stream's own buffer is empty, stream_read_partial() reads
+    // directly into libavformat's buffer (e.g. copying from the cache or the
+    // mapped file), instead of going through the stream buffer. Don't wait
+    // for more data than available - libavformat handles short reads.
+    bool direct = stream->buf_pos == stream->buf_len && !stream->sector_size &&
+                  size >= STREAM_BUFFER_SIZE;
+
+    MP_STATS(demuxer, "start read");
+    double start = mp_time_sec();
+    ret = stream_read_partial(stream, buf, size);
+    priv->read_time += mp_time_sec() - start;
+    MP_STATS(demuxer, "end read");
+
+    priv->read_calls++;
+    priv->read_bytes += ret;
+    if (direct)
+        priv->read_direct_bytes += ret;
 
     MP_DBG(demuxer, "%d=mp_read(%p, %p, %d), pos: %"PRId64", eof:%d\n",
            ret, stream, buf, size, stream_tell(stream), stream->eof);
@@ -587,6 +638,410 @@ static void update_metadata(demuxer_t *demuxer, AVPacket *pkt)
 #endif
 }
 
+/* Keyframe index for formats which can't seek by timestamp efficiently
+ * (--demuxer-lavf-index). It maps video keyframe timestamps to byte
+ * positions. For MPEG-PS/TS, which carry timestamps, these are used for byte
+ * seeks. Raw elementary streams don't, and libavformat can't restore the
+ * timestamps after a byte seek, so the entries are added to libavformat's own
+ * index instead, which makes its generic seek code use them. The file is
+ * scanned once by a background thread, using a separate stream and
+ * libavformat context, so playback is not affected.
+ *
+ * Index file layout (--demuxer-lavf-index-dir), all values little endian:
+ *   "mpvlavi1", id (INDEX_ID_SIZE bytes), uint32 count
+ *   count entries: double pts (as IEEE bits), uint64 byte position
+ * The id contains size and modification time of the file, and a hash of the
+ * URL and format name. The file name is the MD5 of the id.
+ */
+#define INDEX_FILE_MAGIC "mpvlavi1"
+#define INDEX_FILE_HEADER_SIZE (8 + INDEX_ID_SIZE + 4)
+#define INDEX_FILE_ENTRY_SIZE (8 + 8)
+
+// Formats for which libavformat seeks by guessing byte positions, or by
+// reading timestamps at guessed positions.
+static const char *const index_formats[] = {
+    "mpegts", "mpegtsraw", "mpeg", "mpegvideo", "h264", "hevc", "m4v",
+    "cavsvideo", "vc1", NULL
+};
+
+// Indexed formats with timestamps in the stream, which allow byte seeks.
+static const char *const byte_seek_formats[] = {
+    "mpegts", "mpegtsraw", "mpeg", NULL
+};
+
+// The timestamps of an indexed file must not go backwards by more than this.
+#define INDEX_MAX_PTS_JUMP 1.0
+
+struct lavf_bg_index {
+    struct mp_log *log;
+    struct stream *stream;
+    AVInputFormat *avif;
+    char *filename;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    bool cancel;        // protected by lock
+    bool done;          // protected by lock
+
+    // Owned by the thread until done is set.
+    bool success;
+    struct lavf_index_entry *entries;
+    int num_entries;
+};
+
+static bool bg_index_cancelled(struct lavf_bg_index *bg)
+{
+    pthread_mutex_lock(&bg->lock);
+    bool cancel = bg->cancel;
+    pthread_mutex_unlock(&bg->lock);
+    return cancel;
+}
+
+static int bg_index_interrupt(void *opaque)
+{
+    return bg_index_cancelled(opaque);
+}
+
+static int bg_index_read(void *opaque, uint8_t *buf, int size)
+{
+    struct lavf_bg_index *bg = opaque;
+    return stream_read_partial(bg->stream, buf, size);
+}
+
+// Like mp_seek().
+static int64_t bg_index_seek(void *opaque, int64_t pos, int whence)
+{
+    struct lavf_bg_index *bg = opaque;
+    struct stream *stream = bg->stream;
+    if (whence == SEEK_CUR)
+        pos += stream_tell(stream);
+    else if (whence == SEEK_END && stream->end_pos > 0)
+        pos += stream->end_pos;
+    else if (whence == SEEK_SET)
+        pos += stream->start_pos;
+    else if (whence == AVSEEK_SIZE && stream->end_pos > 0)
+        return stream->end_pos - stream->start_pos;
+    else
+        return -1;
+
+    if (pos < 0)
+        return -1;
+    int64_t current_pos = stream_tell(stream);
+    if (stream_seek(stream, pos) == 0) {
+        stream_seek(stream, current_pos);
+        return -1;
+    }
+    return pos - stream->start_pos;
+}
+
+static void *bg_index_thread(void *arg)
+{
+    struct lavf_bg_index *bg = arg;
+    AVFormatContext *avfc = avformat_alloc_context();
+    AVIOContext *pb = NULL;
+    bool opened = false, ok = false;
+
+    void *buffer = av_malloc(BIO_BUFFER_SIZE);
+    if (!avfc || !buffer)
+        goto done;
+    pb = avio_alloc_context(buffer, BIO_BUFFER_SIZE, 0, bg, bg_index_read,
+                            NULL, bg_index_seek);
+    if (!pb)
+        goto done;
+    buffer = NULL;
+    pb->seekable = AVIO_SEEKABLE_NORMAL;
+    avfc->pb = pb;
+    avfc->interrupt_callback = (AVIOInterruptCB){bg_index_interrupt, bg};
+
+    // Frees avfc on failure.
+    if (avformat_open_input(&avfc, bg->filename, bg->avif, NULL) < 0)
+        goto done;
+    opened = true;
+
+    // Use the first video stream only. Since there is no
+    // avformat_find_stream_info() call, streams may still be added while
+    // reading packets.
+    int video = -1;
+    int num_streams = 0;
+    double last_pts = MP_NOPTS_VALUE;
+    AVPacket pkt;
+    int r;
+    while ((r = av_read_frame(avfc, &pkt)) >= 0) {
+        for (; num_streams < avfc->nb_streams; num_streams++) {
+            AVStream *st = avfc->streams[num_streams];
+            if (video < 0 && st->codec->codec_type == AVMEDIA_TYPE_VIDEO)
+                video = num_streams;
+            st->discard = num_streams == video ? AVDISCARD_DEFAULT
+                                               : AVDISCARD_ALL;
+        }
+        AVStream *st = avfc->streams[pkt.stream_index];
+        int64_t ts = pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+        if (pkt.stream_index == video && (pkt.flags & AV_PKT_FLAG_KEY) &&
+            pkt.pos >= 0 && ts != AV_NOPTS_VALUE)
+        {
+            double pts = ts * av_q2d(st->time_base);
+            if (last_pts != MP_NOPTS_VALUE &&
+                pts < last_pts - INDEX_MAX_PTS_JUMP)
+            {
+                MP_VERBOSE(bg, "Timestamp discontinuity at %"PRId64", "
+                           "not indexing.\n", pkt.pos);
+                av_free_packet(&pkt);
+                goto done;
+            }
+            if (last_pts == MP_NOPTS_VALUE || pts > last_pts) {
+                struct lavf_index_entry e = {pts, pkt.pos};
+                MP_TARRAY_APPEND(bg, bg->entries, bg->num_entries, e);
+                last_pts = pts;
+            }
+        }
+        av_free_packet(&pkt);
+    }
+    ok = r == AVERROR_EOF && bg->num_entries > 0 && !bg_index_cancelled(bg);
+
+done:
+    if (opened) {
+        avformat_close_input(&avfc);
+    } else {
+        avformat_free_context(avfc);
+    }
+    if (pb)
+        av_freep(&pb->buffer);
+    av_free(pb);
+    av_free(buffer);
+
+    bg->success = ok;
+    pthread_mutex_lock(&bg->lock);
+    bg->done = true;
+    pthread_mutex_unlock(&bg->lock);
+    return NULL;
+}
+
+static void load_index_file(demuxer_t *demuxer)
+{
+    lavf_priv_t *priv = demuxer->priv;
+    FILE *f = fopen(priv->index_file, "rb");
+    if (!f)
+        return;
+    uint8_t hdr[INDEX_FILE_HEADER_SIZE];
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr, INDEX_FILE_MAGIC, 8) != 0 ||
+        memcmp(hdr + 8, priv->index_id, INDEX_ID_SIZE) != 0)
+    {
+        MP_WARN(demuxer, "Ignoring invalid index file '%s'.\n",
+                priv->index_file);
+        goto done;
+    }
+    uint32_t count = AV_RL32(hdr + 8 + INDEX_ID_SIZE);
+    for (uint32_t n = 0; n < count; n++) {
+        uint8_t e[INDEX_FILE_ENTRY_SIZE];
+        if (fread(e, sizeof(e), 1, f) != 1)
+            goto broken;
+        struct lavf_index_entry entry = {
+            .pts = av_int2double(AV_RL64(e)),
+            .pos = AV_RL64(e + 8),
+        };
+        if (!isfinite(entry.pts) || entry.pos < 0 ||
+            entry.pos >= demuxer->stream->end_pos ||
+            (priv->num_index &&
+             entry.pts <= priv->index[priv->num_index - 1].pts))
+            goto broken;
+        MP_TARRAY_APPEND(priv, priv->index, priv->num_index, entry);
+    }
+    MP_VERBOSE(demuxer, "Loaded %d index entries from '%s'.\n",
+               priv->num_index, priv->index_file);
+    goto done;
+broken:
+    MP_WARN(demuxer, "Broken index file '%s'.\n", priv->index_file);
+    priv->num_index = 0;
+done:
+    fclose(f);
+}
+
+static void save_index_file(demuxer_t *demuxer)
+{
+    lavf_priv_t *priv = demuxer->priv;
+    if (!priv->index_file || !priv->num_index)
+        return;
+    FILE *f = mp_open_file_atomic(priv->index_file);
+    if (!f) {
+        MP_ERR(demuxer, "Can't write index file '%s': %s\n",
+               priv->index_file, strerror(errno));
+        return;
+    }
+    uint8_t hdr[INDEX_FILE_HEADER_SIZE];
+    memcpy(hdr, INDEX_FILE_MAGIC, 8);
+    memcpy(hdr + 8, priv->index_id, INDEX_ID_SIZE);
+    AV_WL32(hdr + 8 + INDEX_ID_SIZE, priv->num_index);
+    bool ok = fwrite(hdr, sizeof(hdr), 1, f) == 1;
+    for (int n = 0; n < priv->num_index; n++) {
+        uint8_t e[INDEX_FILE_ENTRY_SIZE];
+        AV_WL64(e, av_double2int(priv->index[n].pts));
+        AV_WL64(e + 8, priv->index[n].pos);
+        ok &= fwrite(e, sizeof(e), 1, f) == 1;
+    }
+    if (!mp_commit_file_atomic(f, priv->index_file, ok)) {
+        MP_ERR(demuxer, "Can't write index file '%s'.\n", priv->index_file);
+    } else {
+        MP_VERBOSE(demuxer, "Wrote %d index entries to '%s'.\n",
+                   priv->num_index, priv->index_file);
+    }
+}
+
+// Add the index entries to the first video stream's libavformat index, if
+// seeking doesn't use byte seeks.
+static void apply_index(demuxer_t *demuxer)
+{
+    lavf_priv_t *priv = demuxer->priv;
+    if (priv->index_byte_seek || !priv->num_index)
+        return;
+    for (int n = 0; n < priv->avfc->nb_streams; n++) {
+        AVStream *st = priv->avfc->streams[n];
+        if (st->codec->codec_type != AVMEDIA_TYPE_VIDEO)
+            continue;
+        double tb = av_q2d(st->time_base);
+        for (int i = 0; i < priv->num_index; i++) {
+            struct lavf_index_entry *e = &priv->index[i];
+            av_add_index_entry(st, e->pos, llrint(e->pts / tb), 0, 0,
+                               AVINDEX_KEYFRAME);
+        }
+        return;
+    }
+}
+
+static void stop_bg_index(lavf_priv_t *priv)
+{
+    struct lavf_bg_index *bg = priv->bg_index;
+    if (!bg)
+        return;
+    pthread_mutex_lock(&bg->lock);
+    bg->cancel = true;
+    pthread_mutex_unlock(&bg->lock);
+    pthread_join(bg->thread, NULL);
+    pthread_mutex_destroy(&bg->lock);
+    free_stream(bg->stream);
+    talloc_free(bg);
+    priv->bg_index = NULL;
+}
+
+// Take over the index built by the background thread, if it's done.
+static void check_bg_index(demuxer_t *demuxer)
+{
+    lavf_priv_t *priv = demuxer->priv;
+    struct lavf_bg_index *bg = priv->bg_index;
+    if (!bg)
+        return;
+    pthread_mutex_lock(&bg->lock);
+    bool done = bg->done;
+    pthread_mutex_unlock(&bg->lock);
+    if (!done)
+        return;
+    if (bg->success) {
+        talloc_free(priv->index);
+        priv->index = talloc_steal(priv, bg->entries);
+        priv->num_index = bg->num_entries;
+        bg->entries = NULL;
+        MP_VERBOSE(demuxer, "Background index done (%d entries).\n",
+                   priv->num_index);
+        apply_index(demuxer);
+        save_index_file(demuxer);
+    } else {
+        MP_VERBOSE(demuxer, "Building the index failed.\n");
+    }
+    stop_bg_index(priv);
+}
+
+static void open_index(demuxer_t *demuxer)
+{
+    struct MPOpts *opts = demuxer->opts;
+    struct lavfdopts *lavfdopts = &opts->lavfdopts;
+    lavf_priv_t *priv = demuxer->priv;
+    struct stream *s = demuxer->stream;
+    bool use_dir = lavfdopts->index_dir && lavfdopts->index_dir[0];
+    int64_t mtime;
+
+    if (!lavfdopts->index && !use_dir)
+        return;
+    if (!priv->pb || !demuxer->seekable || stream_manages_timeline(s) ||
+        (priv->avif->flags & AVFMT_NO_BYTE_SEEK) || s->end_pos <= 0 ||
+        stream_control(s, STREAM_CTRL_GET_MTIME, &mtime) != STREAM_OK)
+        return;
+    bool supported = false;
+    for (int n = 0; index_formats[n]; n++)
+        supported |= matches_avinputformat_name(priv, index_formats[n]);
+    if (!supported)
+        return;
+    for (int n = 0; byte_seek_formats[n]; n++)
+        priv->index_byte_seek |=
+            matches_avinputformat_name(priv, byte_seek_formats[n]);
+
+    if (use_dir) {
+        uint8_t *id = priv->index_id;
+        AV_WL64(id, s->end_pos);
+        AV_WL64(id + 8, mtime);
+        char *name = talloc_asprintf(NULL, "%s\n%s", s->url, priv->avif->name);
+        av_md5_sum(id + 16, name, strlen(name));
+        talloc_free(name);
+
+        void *tmp = talloc_new(NULL);
+        char *dir = mp_get_user_path(tmp, demuxer->global,
+                                     lavfdopts->index_dir);
+        mp_path_ensure_dir(dir);
+        char *key = mp_path_hash_name(tmp, id, INDEX_ID_SIZE);
+        priv->index_file = talloc_asprintf(priv, "%s/%s.lavfidx", dir, key);
+        talloc_free(tmp);
+
+        load_index_file(demuxer);
+        apply_index(demuxer);
+    }
+
+    if (priv->num_index || !lavfdopts->index)
+        return;
+
+    struct stream *bs = stream_open(s->url, demuxer->global);
+    if (!bs)
+        return;
+    struct lavf_bg_index *bg = talloc_zero(NULL, struct lavf_bg_index);
+    *bg = (struct lavf_bg_index){
+        .log = demuxer->log,
+        .stream = bs,
+        .avif = priv->avif,
+        .filename = talloc_strdup(bg, priv->filename),
+    };
+    pthread_mutex_init(&bg->lock, NULL);
+    if (pthread_create(&bg->thread, NULL, bg_index_thread, bg)) {
+        pthread_mutex_destroy(&bg->lock);
+        free_stream(bs);
+        talloc_free(bg);
+        return;
+    }
+    MP_VERBOSE(demuxer, "Building index in the background.\n");
+    priv->bg_index = bg;
+}
+
+// Return the byte position of the keyframe to start playback from when
+// seeking to pts, or -1 if the index is not available.
+static int64_t index_lookup(demuxer_t *demuxer, double pts, bool backward)
+{
+    lavf_priv_t *priv = demuxer->priv;
+    if (!priv->index_byte_seek || !priv->num_index)
+        return -1;
+    // Find the first entry after pts.
+    int lo = 0, hi = priv->num_index;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (priv->index[mid].pts > pts) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    if (backward)
+        return priv->index[MPMAX(lo - 1, 0)].pos;
+    if (lo > 0 && priv->index[lo - 1].pts == pts)
+        lo--;
+    return lo < priv->num_index ? priv->index[lo].pos : -1;
+}
+
 static int demux_open_lavf(demuxer_t *demuxer, enum demux_check check)
 {
     struct MPOpts *opts = demuxer->opts;
@@ -739,6 +1194,8 @@ static int demux_open_lavf(demuxer_t *demuxer, enum demux_check check)
 
     demuxer->ts_resets_possible = priv->avif->flags & AVFMT_TS_DISCONT;
 
+    open_index(demuxer);
+
     return 0;
 }
 
@@ -754,7 +1211,10 @@ static int demux_lavf_fill_buffer(demuxer_t *demux)
     MP_DBG(demux, "demux_lavf_fill_buffer()\n");
 
     AVPacket *pkt = talloc(NULL, AVPacket);
-    if (av_read_frame(priv->avfc, pkt) < 0) {
+    MP_STATS(demux, "start read_packet");
+    int r = av_read_frame(priv->avfc, pkt);
+    MP_STATS(demux, "end read_packet");
+    if (r < 0) {
         talloc_free(pkt);
         return 0; // eof
     }
@@ -836,6 +1296,14 @@ static void demux_seek_lavf(demuxer_t *demuxer, float rel_seek_secs, int flags)
         }
     } else {
         priv->last_pts += rel_seek_secs * AV_TIME_BASE;
+
+        check_bg_index(demuxer);
+        double pts = priv->last_pts / (double)AV_TIME_BASE;
+        int64_t pos = index_lookup(demuxer, pts,
+                                   avsflags & AVSEEK_FLAG_BACKWARD);
+        if (pos >= 0 &&
+            av_seek_frame(priv->avfc, -1, pos, AVSEEK_FLAG_BYTE) >= 0)
+            return;
     }
 
     if (!priv->avfc->iformat->read_seek2) {
@@ -989,6 +1457,14 @@ static void demux_close_lavf(demuxer_t *demuxer)
 {
     lavf_priv_t *priv = demuxer->priv;
     if (priv) {
+        if (priv->read_calls) {
+            MP_VERBOSE(demuxer, "Read %"PRId64" bytes in %"PRId64" calls "
+                       "(%"PRId64" bytes directly, %.3f s).\n",
+                       priv->read_bytes, priv->read_calls,
+                       priv->read_direct_bytes, priv->read_time);
+        }
+        check_bg_index(demuxer);
+        stop_bg_index(priv);
         if (priv->avfc) {
             av_freep(&priv->avfc->key);
             avformat_close_input(&priv->avfc);
@@ -18,7 +18,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -36,6 +38,212 @@
 
 #define MF_MAX_FILE_SIZE (1024 * 1024 * 256)
 
+// Read the whole file into a new packet. If the file size is known, the data
+// is read directly into the packet.
+static struct demux_packet *read_file(struct demuxer *demuxer,
+                                      struct stream *stream)
+{
+    stream_seek(stream, 0);
+    if (stream->end_pos > 0 && stream->end_pos <= MF_MAX_FILE_SIZE)
+        return demuxer_read_packet_data(demuxer, stream, stream->end_pos);
+
+    struct demux_packet *dp = NULL;
+    bstr data = stream_read_complete(stream, NULL, MF_MAX_FILE_SIZE);
+    if (data.len)
+        dp = demuxer_new_packet_from(demuxer, data.start, data.len);
+    talloc_free(data.start);
+    return dp;
+}
+
+static struct demux_packet *read_frame(struct demuxer *demuxer, int frame)
+{
+    mf_t *mf = demuxer->priv;
+    struct stream *entry_stream = NULL;
+    if (mf->streams)
+        entry_stream = mf->streams[frame];
+    struct stream *stream = entry_stream;
+    if (!stream) {
+        char *filename = mf->names[frame];
+        if (filename)
+            stream = stream_open(filename, demuxer->global);
+    }
+
+    struct demux_packet *dp = NULL;
+    if (stream)
+        dp = read_file(demuxer, stream);
+
+    if (stream && stream != entry_stream)
+        free_stream(stream);
+    return dp;
+}
+
+// Files are read by a pool of worker threads (--mf=prefetch). The next N
+// frames after the current one are opened and read concurrently, which hides
+// the latency of opening files on network filesystems.
+struct mf_prefetch {
+    struct demuxer *demuxer;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // signaled if a frame was queued, or on quit
+    pthread_cond_t done;    // signaled if a frame was read
+    bool quit;
+
+    pthread_t *threads;
+    int num_threads;
+
+    struct mf_slot {
+        enum {
+            SLOT_FREE,
+            SLOT_QUEUED,        // waiting for a worker to pick it up
+            SLOT_READING,       // a worker is reading it
+            SLOT_DONE,          // packet (or NULL on error) available
+        } state;
+        int frame;
+        struct demux_packet *dp;
+    } *slots;
+    int num_slots;
+};
+
+static void *prefetch_thread(void *arg)
+{
+    struct mf_prefetch *pf = arg;
+    pthread_mutex_lock(&pf->lock);
+    while (!pf->quit) {
+        // Read the frame that is needed first.
+        struct mf_slot *s = NULL;
+        for (int n = 0; n < pf->num_slots; n++) {
+            struct mf_slot *c = &pf->slots[n];
+            if (c->state == SLOT_QUEUED && (!s || c->frame < s->frame))
+                s = c;
+        }
+        if (!s) {
+            pthread_cond_wait(&pf->work, &pf->lock);
+            continue;
+        }
+        s->state = SLOT_READING;
+        int frame = s->frame;
+        pthread_mutex_unlock(&pf->lock);
+
+        struct demux_packet *dp = read_frame(pf->demuxer, frame);
+
+        pthread_mutex_lock(&pf->lock);
+        s->dp = dp;
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&pf->done);
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+static struct mf_slot *find_slot(struct mf_prefetch *pf, int frame)
+{
+    for (int n = 0; n < pf->num_slots; n++) {
+        struct mf_slot *s = &pf->slots[n];
+        if (s->state != SLOT_FREE && s->frame == frame)
+            return s;
+    }
+    return NULL;
+}
+
+// Queue the frames in [start, start + num_slots). Slots holding frames
+// outside of this range are recycled, unless they're being read.
+static void schedule(struct mf_prefetch *pf, int start)
+{
+    mf_t *mf = pf->demuxer->priv;
+    int end = MPMIN(start + pf->num_slots, mf->nr_of_files);
+    bool queued = false;
+    for (int frame = start; frame < end; frame++) {
+        if (find_slot(pf, frame))
+            continue;
+        struct mf_slot *s = NULL;
+        for (int n = 0; n < pf->num_slots; n++) {
+            struct mf_slot *c = &pf->slots[n];
+            if (c->state == SLOT_FREE ||
+                (c->state != SLOT_READING && (c->frame < start || c->frame >= end)))
+            {
+                s = c;
+                break;
+            }
+        }
+        if (!s)
+            break;
+        talloc_free(s->dp);
+        *s = (struct mf_slot){
+            .state = SLOT_QUEUED,
+            .frame = frame,
+        };
+        queued = true;
+    }
+    if (queued)
+        pthread_cond_broadcast(&pf->work);
+}
+
+static struct demux_packet *prefetch_read(struct mf_prefetch *pf, int frame)
+{
+    pthread_mutex_lock(&pf->lock);
+    struct mf_slot *s;
+    while (1) {
+        schedule(pf, frame);
+        s = find_slot(pf, frame);
+        if (s && s->state == SLOT_DONE)
+            break;
+        // Either the frame is being read, or all slots are still busy with
+        // frames before a seek.
+        pthread_cond_wait(&pf->done, &pf->lock);
+    }
+    struct demux_packet *dp = s->dp;
+    *s = (struct mf_slot){ .state = SLOT_FREE };
+    schedule(pf, frame + 1);
+    pthread_mutex_unlock(&pf->lock);
+    return dp;
+}
+
+static void prefetch_destroy(struct mf_prefetch *pf)
+{
+    if (!pf)
+        return;
+    pthread_mutex_lock(&pf->lock);
+    pf->quit = true;
+    pthread_cond_broadcast(&pf->work);
+    pthread_mutex_unlock(&pf->lock);
+    for (int n = 0; n < pf->num_threads; n++)
+        pthread_join(pf->threads[n], NULL);
+    for (int n = 0; n < pf->num_slots; n++)
+        talloc_free(pf->slots[n].dp);
+    pthread_cond_destroy(&pf->done);
+    pthread_cond_destroy(&pf->work);
+    pthread_mutex_destroy(&pf->lock);
+    talloc_free(pf);
+}
+
+static struct mf_prefetch *prefetch_create(struct demuxer *demuxer, int num)
+{
+    struct mf_prefetch *pf = talloc_zero(NULL, struct mf_prefetch);
+    pf->demuxer = demuxer;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->work, NULL);
+    pthread_cond_init(&pf->done, NULL);
+
+    pf->num_slots = num;
+    pf->slots = talloc_zero_array(pf, struct mf_slot, pf->num_slots);
+
+    pf->threads = talloc_array(pf, pthread_t, num);
+    for (int n = 0; n < num; n++) {
+        if (pthread_create(&pf->threads[n], NULL, prefetch_thread, pf))
+            break;
+        pf->num_threads++;
+    }
+    if (!pf->num_threads) {
+        MP_ERR(demuxer, "Failed to create prefetch threads.\n");
+        prefetch_destroy(pf);
+        return NULL;
+    }
+    MP_VERBOSE(demuxer, "Prefetching %d files.\n", pf->num_slots);
+    return pf;
+}
+
+// Seeking only sets the next frame; frames that were already prefetched
+// for the new position are kept.
 static void demux_seek_mf(demuxer_t *demuxer, float rel_seek_secs, int flags)
 {
     mf_t *mf = demuxer->priv;
@@ -61,32 +269,18 @@ static int demux_mf_fill_buffer(demuxer_t *demuxer)
     if (mf->curr_frame >= mf->nr_of_files)
         return 0;
 
-    struct stream *entry_stream = NULL;
-    if (mf->streams)
-        entry_stream = mf->streams[mf->curr_frame];
-    struct stream *stream = entry_stream;
-    if (!stream) {
-        char *filename = mf->names[mf->curr_frame];
-        if (filename)
-            stream = stream_open(filename, demuxer->global);
+    struct demux_packet *dp;
+    if (mf->prefetch) {
+        dp = prefetch_read(mf->prefetch, mf->curr_frame);
+    } else {
+        dp = read_frame(demuxer, mf->curr_frame);
     }
-
-    if (stream) {
-        stream_seek(stream, 0);
-        bstr data = stream_read_complete(stream, NULL, MF_MAX_FILE_SIZE);
-        if (data.len) {
-            demux_packet_t *dp = new_demux_packet(data.len);
-            memcpy(dp->buffer, data.start, data.len);
-            dp->pts = mf->curr_frame / mf->sh->fps;
-            dp->keyframe = true;
-            demuxer_add_packet(demuxer, demuxer->streams[0], dp);
-        }
-        talloc_free(data.start);
+    if (dp) {
+        dp->pts = mf->curr_frame / mf->sh->fps;
+        dp->keyframe = true;
+        demuxer_add_packet(demuxer, demuxer->streams[0], dp);
     }
 
-    if (stream && stream != entry_stream)
-        free_stream(stream);
-
     mf->curr_frame++;
     return 1;
 }
@@ -202,6 +396,9 @@ static int demux_open_mf(demuxer_t *demuxer, enum demux_check check)
     demuxer->priv = (void *)mf;
     demuxer->seekable = true;
 
+    if (!mf->streams && mf->nr_of_files > 1 && mf_prefetch > 0)
+        mf->prefetch = prefetch_create(demuxer, mf_prefetch);
+
     return 0;
 
 error:
@@ -210,6 +407,9 @@ error:
 
 static void demux_close_mf(demuxer_t *demuxer)
 {
+    mf_t *mf = demuxer->priv;
+    if (mf)
+        prefetch_destroy(mf->prefetch);
 }
 
 static int demux_control_mf(demuxer_t *demuxer, int cmd, void *arg)
@@ -26,7 +26,10 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <libavutil/common.h>
 #include <libavutil/lzo.h>
@@ -43,8 +46,10 @@
 #endif
 
 #include "talloc.h"
+#include "osdep/io.h"
 #include "common/av_common.h"
 #include "options/options.h"
+#include "options/path.h"
 #include "bstr/bstr.h"
 #include "stream/stream.h"
 #include "demux.h"
@@ -52,6 +57,7 @@
 #include "ebml.h"
 #include "matroska.h"
 #include "codec_tags.h"
+#include "packet_pool.h"
 
 #include "common/msg.h"
 
@@ -140,9 +146,10 @@ typedef struct mkv_track {
     /* generic content encoding support */
     mkv_content_encoding_t *encodings;
     int num_encodings;
-
-    /* latest added index entry for this track */
-    int last_index_entry;
+#if HAVE_ZLIB
+    z_stream *zstream;
+#endif
+    double decode_ratio;        // decompressed/compressed size of last packets
 } mkv_track_t;
 
 typedef struct mkv_index {
@@ -150,6 +157,16 @@ typedef struct mkv_index {
     uint64_t timecode, filepos;
 } mkv_index_t;
 
+// Index entries of a single track number, sorted by timecode.
+struct mkv_index_list {
+    int tnum;
+    mkv_index_t *entries;
+    int num_entries;
+};
+
+// Size of the file identity stored in persistent index files.
+#define INDEX_ID_SIZE (8 + 8 + 16)
+
 typedef struct mkv_demuxer {
     int64_t segment_start, segment_end;
 
@@ -159,6 +176,10 @@ typedef struct mkv_demuxer {
     mkv_track_t **tracks;
     int num_tracks;
 
+    // tracks[] indexed by track number, or NULL if the numbers are too large
+    mkv_track_t **track_by_num;
+    int num_track_by_num;
+
     struct ebml_tags *tags;
 
     uint64_t tc_scale, cluster_tc;
@@ -166,11 +187,26 @@ typedef struct mkv_demuxer {
     uint64_t cluster_start;
     uint64_t cluster_end;
 
-    mkv_index_t *indexes;
-    int num_indexes;
+    // Contents of the current cluster, if it was read into memory (see
+    // read_cluster_buffer()). cluster_buf is the part not parsed yet.
+    void *cluster_alloc;
+    int64_t cluster_alloc_pos;  // file position of cluster_alloc[0]
+    int cluster_alloc_len;      // size of cluster_alloc (without padding)
+    bstr cluster_buf;
+
+    struct mkv_index_list *index_lists;
+    int num_index_lists;
+    int num_indexes;    // total number of entries in index_lists
     bool index_complete;
     uint64_t deferred_cues;
 
+    int64_t first_cluster;
+    // Persistent index (--demuxer-mkv-index-dir)
+    char *index_file;
+    uint8_t index_id[INDEX_ID_SIZE];
+    bool index_dirty;   // index has entries not written to index_file yet
+    struct mkv_bg_index *bg_index;
+
     struct header_elem {
         int32_t id;
         int64_t pos;
@@ -188,23 +224,27 @@ typedef struct mkv_demuxer {
 #define RAPROPERTIES4_SIZE 56
 #define RAPROPERTIES5_SIZE 70
 
+// Clusters up to this size are read into memory as a whole, and parsed from
+// there. Larger clusters and clusters of unknown size are parsed from the
+// stream.
+#define MAX_CLUSTER_BUFFER (16 * 1024 * 1024)
+
+// A packet referencing the cluster buffer keeps all of it allocated while it
+// is queued. Blocks from cluster buffers larger than this are copied instead,
+// if they're smaller than 1/CLUSTER_COPY_RATIO of the buffer.
+#define MAX_CLUSTER_REF (1024 * 1024)
+#define CLUSTER_COPY_RATIO 16
+
+// Allocated after block data (lzo decompression and decoders need this).
+#define BLOCK_PADDING MPMAX(AV_LZO_INPUT_PADDING, MP_INPUT_BUFFER_PADDING_SIZE)
+
+// Track numbers up to this value are looked up with a table.
+#define MAX_TRACK_LOOKUP 1024
+
 // Maximum number of subtitle packets that are accepted for pre-roll.
 // (Subtitle packets added before first A/V keyframe packet is found with seek.)
 #define NUM_SUB_PREROLL_PACKETS 500
 
-/**
- * \brief ensures there is space for at least one additional element
- * \param array array to grow
- * \param nelem current number of elements in array
- * \param elsize size of one array element
- */
-static void *grow_array(void *array, int nelem, size_t elsize)
-{
-    if (!(nelem & 31))
-        array = realloc(array, (nelem + 32) * elsize);
-    return array;
-}
-
 #define AAC_SYNC_EXTENSION_TYPE 0x02b7
 static int aac_get_sample_rate_index(uint32_t sample_rate)
 {
@@ -218,23 +258,55 @@ static int aac_get_sample_rate_index(uint32_t sample_rate)
     return i;
 }
 
-static bstr demux_mkv_decode(struct mp_log *log, mkv_track_t *track,
-                             bstr data, uint32_t type)
+// Allocated after decoded data.
+#define DECODE_PADDING MPMAX(BLOCK_PADDING, AV_LZO_OUTPUT_PADDING)
+
+// Allocate or resize a packet buffer for at least size bytes of decoded data.
+// Returns NULL on OOM (buf is left untouched).
+static uint8_t *decode_buffer(demuxer_t *demuxer, uint8_t *buf, size_t size)
 {
-    uint8_t *src = data.start;
-    uint8_t *orig_src = src;
-    uint8_t *dest = src;
-    uint32_t size = data.len;
+    if (buf)
+        return demux_packet_pool_realloc(buf, size + DECODE_PADDING);
+    return demuxer_alloc_packet_buffer(demuxer, size + DECODE_PADDING);
+}
+
+// Expected size of the decompressed data, based on previous packets.
+static size_t decode_size_estimate(mkv_track_t *track, size_t size)
+{
+    double ratio = track->decode_ratio > 0 ? track->decode_ratio * 1.125 : 3;
+    return MPMAX(size * ratio, 4096);
+}
+
+static void update_decode_ratio(mkv_track_t *track, size_t in, size_t out)
+{
+    if (!in)
+        return;
+    // Follow increases immediately, and decreases slowly.
+    double ratio = out / (double)in;
+    track->decode_ratio = MPMAX(ratio, track->decode_ratio * 0.95);
+}
+
+// Apply the track's content encodings (of the given scope) to data. If the
+// data is changed, the result is stored in a packet buffer, which is returned
+// in *out_buf and must be freed with demux_packet_pool_free(). The buffer is
+// padded, so packets can reference it directly. Otherwise, data is returned
+// as is, and *out_buf is set to NULL. Returns (bstr){0} on error.
+static bstr demux_mkv_decode(demuxer_t *demuxer, mkv_track_t *track,
+                             bstr data, uint32_t type, void **out_buf)
+{
+    uint8_t *buf = NULL;    // contains data, if already decoded
+    uint8_t *dest = NULL;
 
     for (int i = 0; i < track->num_encodings; i++) {
         struct mkv_content_encoding *enc = track->encodings + i;
         if (!(enc->scope & type))
             continue;
 
-        if (src != dest && src != orig_src)
-            talloc_free(src);
-        src = dest;  // output from last iteration is new source
+        uint8_t *src = data.start;
+        size_t size = data.len;
+        size_t dstlen;
 
+        dest = NULL;
         if (enc->comp_algo == 0) {
 #if HAVE_ZLIB
             /* zlib encoded track */
@@ -242,76 +314,103 @@ static bstr demux_mkv_decode(struct mp_log *log, mkv_track_t *track,
             if (size == 0)
                 continue;
 
-            z_stream zstream;
-
-            zstream.zalloc = (alloc_func) 0;
-            zstream.zfree = (free_func) 0;
-            zstream.opaque = (voidpf) 0;
-            if (inflateInit(&zstream) != Z_OK) {
-                mp_warn(log, "zlib initialization failed.\n");
+            // The decompressor state is reused for all packets of the track.
+            if (!track->zstream) {
+                track->zstream = talloc_zero(track, z_stream);
+                if (inflateInit(track->zstream) != Z_OK) {
+                    MP_WARN(demuxer, "zlib initialization failed.\n");
+                    talloc_free(track->zstream);
+                    track->zstream = NULL;
+                    goto error;
+                }
+            } else if (inflateReset(track->zstream) != Z_OK) {
+                MP_WARN(demuxer, "zlib reset failed.\n");
                 goto error;
             }
-            zstream.next_in = (Bytef *) src;
-            zstream.avail_in = size;
-
-            dest = NULL;
-            zstream.avail_out = size;
-            int result;
-            do {
-                size += 4000;
-                dest = talloc_realloc_size(track->parser_tmp, dest, size);
-                zstream.next_out = (Bytef *) (dest + zstream.total_out);
-                result = inflate(&zstream, Z_NO_FLUSH);
-                if (result != Z_OK && result != Z_STREAM_END) {
-                    mp_warn(log, "zlib decompression failed.\n");
-                    talloc_free(dest);
-                    dest = NULL;
-                    inflateEnd(&zstream);
+            z_stream *zstream = track->zstream;
+            zstream->next_in = (Bytef *) src;
+            zstream->avail_in = size;
+
+            dstlen = decode_size_estimate(track, size);
+            while (1) {
+                uint8_t *ndest = decode_buffer(demuxer, dest, dstlen);
+                if (!ndest)
+                    goto error;
+                dest = ndest;
+                dstlen = demux_packet_pool_size(dest) - DECODE_PADDING;
+                zstream->next_out = (Bytef *) (dest + zstream->total_out);
+                zstream->avail_out = dstlen - zstream->total_out;
+                int result = inflate(zstream, Z_NO_FLUSH);
+                if (result != Z_OK && result != Z_STREAM_END &&
+                    result != Z_BUF_ERROR)
+                {
+                    MP_WARN(demuxer, "zlib decompression failed.\n");
                     goto error;
                 }
-                zstream.avail_out += 4000;
-            } while (zstream.avail_out == 4000 && zstream.avail_in != 0
-                     && result != Z_STREAM_END);
+                // Truncated input is accepted.
+                if (result == Z_STREAM_END || zstream->avail_in == 0 ||
+                    zstream->avail_out != 0)
+                    break;
+                dstlen *= 2;
+            }
 
-            size = zstream.total_out;
-            inflateEnd(&zstream);
+            dstlen = zstream->total_out;
+            update_decode_ratio(track, size, dstlen);
+#else
+            continue;
 #endif
         } else if (enc->comp_algo == 2) {
             /* lzo encoded track */
             int out_avail;
-            int dstlen = size * 3;
 
-            dest = NULL;
+            dstlen = decode_size_estimate(track, size);
             while (1) {
                 int srclen = size;
-                dest = talloc_realloc_size(track->parser_tmp, dest,
-                                           dstlen + AV_LZO_OUTPUT_PADDING);
+                uint8_t *ndest = decode_buffer(demuxer, dest, dstlen);
+                if (!ndest)
+                    goto error;
+                dest = ndest;
+                dstlen = demux_packet_pool_size(dest) - DECODE_PADDING;
                 out_avail = dstlen;
                 int result = av_lzo1x_decode(dest, &out_avail, src, &srclen);
                 if (result == 0)
                     break;
                 if (!(result & AV_LZO_OUTPUT_FULL)) {
-                    mp_warn(log, "lzo decompression failed.\n");
-                    talloc_free(dest);
-                    dest = NULL;
+                    MP_WARN(demuxer, "lzo decompression failed.\n");
                     goto error;
                 }
-                mp_dbg(log, "lzo decompression buffer too small.\n");
+                MP_DBG(demuxer, "lzo decompression buffer too small.\n");
                 dstlen *= 2;
             }
-            size = dstlen - out_avail;
+            dstlen -= out_avail;
+            update_decode_ratio(track, size, dstlen);
         } else if (enc->comp_algo == 3) {
-            dest = talloc_size(track->parser_tmp, size + enc->comp_settings_len);
+            // Header stripping: write the header and the data into the
+            // packet buffer, so that the packet doesn't need another copy.
+            dstlen = size + enc->comp_settings_len;
+            dest = decode_buffer(demuxer, NULL, dstlen);
+            if (!dest)
+                goto error;
             memcpy(dest, enc->comp_settings, enc->comp_settings_len);
             memcpy(dest + enc->comp_settings_len, src, size);
-            size += enc->comp_settings_len;
+        } else {
+            continue;
         }
+
+        memset(dest + dstlen, 0, DECODE_PADDING);
+        demux_packet_pool_free(buf);
+        buf = dest;
+        data = (bstr){dest, dstlen};
     }
 
- error:
-    if (src != dest && src != orig_src)
-        talloc_free(src);
-    return (bstr){dest, size};
+    *out_buf = buf;
+    return data;
+
+error:
+    demux_packet_pool_free(dest);
+    demux_packet_pool_free(buf);
+    *out_buf = NULL;
+    return (bstr){0};
 }
 
 
@@ -517,6 +616,10 @@ static void parse_trackvideo(struct demuxer *demuxer, struct mkv_track *track,
  */
 static void demux_mkv_free_trackentry(mkv_track_t *track)
 {
+#if HAVE_ZLIB
+    if (track->zstream)
+        inflateEnd(track->zstream);
+#endif
     talloc_free(track->parser_tmp);
     talloc_free(track);
 }
@@ -526,7 +629,6 @@ static void parse_trackentry(struct demuxer *demuxer,
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
     struct mkv_track *track = talloc_zero_size(NULL, sizeof(*track));
-    track->last_index_entry = -1;
     track->parser_tmp = talloc_new(track);
 
     track->tnum = entry->track_number;
@@ -647,19 +749,85 @@ static int demux_mkv_read_tracks(demuxer_t *demuxer)
         parse_trackentry(demuxer, &tracks.track_entry[i]);
     }
     talloc_free(parse_ctx.talloc_ctx);
+
+    int max_num = -1;
+    for (int i = 0; i < mkv_d->num_tracks; i++) {
+        int tnum = mkv_d->tracks[i]->tnum;
+        max_num = tnum < 0 ? MAX_TRACK_LOOKUP : MPMAX(max_num, tnum);
+    }
+    talloc_free(mkv_d->track_by_num);
+    mkv_d->track_by_num = NULL;
+    mkv_d->num_track_by_num = 0;
+    if (max_num >= 0 && max_num < MAX_TRACK_LOOKUP) {
+        mkv_d->num_track_by_num = max_num + 1;
+        mkv_d->track_by_num = talloc_zero_array(mkv_d, mkv_track_t *,
+                                                mkv_d->num_track_by_num);
+        // Iterate backwards, so that the first track wins on duplicates.
+        for (int i = mkv_d->num_tracks - 1; i >= 0; i--)
+            mkv_d->track_by_num[mkv_d->tracks[i]->tnum] = mkv_d->tracks[i];
+    }
     return 0;
 }
 
+static mkv_track_t *find_track_by_num(mkv_demuxer_t *mkv_d, uint64_t num)
+{
+    if (mkv_d->track_by_num)
+        return num < mkv_d->num_track_by_num ? mkv_d->track_by_num[num] : NULL;
+    for (int i = 0; i < mkv_d->num_tracks; i++) {
+        if (mkv_d->tracks[i]->tnum == num)
+            return mkv_d->tracks[i];
+    }
+    return NULL;
+}
+
+static struct mkv_index_list *get_index_list(mkv_demuxer_t *mkv_d, int tnum,
+                                             bool create)
+{
+    for (int n = 0; n < mkv_d->num_index_lists; n++) {
+        if (mkv_d->index_lists[n].tnum == tnum)
+            return &mkv_d->index_lists[n];
+    }
+    if (!create)
+        return NULL;
+    struct mkv_index_list new = { .tnum = tnum };
+    MP_TARRAY_APPEND(mkv_d, mkv_d->index_lists, mkv_d->num_index_lists, new);
+    return &mkv_d->index_lists[mkv_d->num_index_lists - 1];
+}
+
+// Return the position of the first entry whose timecode (multiplied with
+// tc_scale) is larger than target, or larger or equal if !after.
+static int index_search(struct mkv_index_list *list, uint64_t tc_scale,
+                        int64_t target, bool after)
+{
+    int lo = 0, hi = list->num_entries;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int64_t ts = list->entries[mid].timecode * tc_scale;
+        if (after ? ts <= target : ts < target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 static void cue_index_add(demuxer_t *demuxer, int track_id, uint64_t filepos,
                           uint64_t timecode)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
+    struct mkv_index_list *list = get_index_list(mkv_d, track_id, true);
 
-    mkv_d->indexes = grow_array(mkv_d->indexes, mkv_d->num_indexes,
-                                sizeof(mkv_index_t));
-    mkv_d->indexes[mkv_d->num_indexes].tnum = track_id;
-    mkv_d->indexes[mkv_d->num_indexes].timecode = timecode;
-    mkv_d->indexes[mkv_d->num_indexes].filepos = filepos;
+    mkv_index_t new = {
+        .tnum = track_id,
+        .timecode = timecode,
+        .filepos = filepos,
+    };
+    // Entries are normally added in order, so this is usually an append.
+    int pos = list->num_entries;
+    if (pos && list->entries[pos - 1].timecode > timecode)
+        pos = index_search(list, 1, timecode, true);
+    MP_TARRAY_INSERT_AT(mkv_d, list->entries, list->num_entries, pos, new);
     mkv_d->num_indexes++;
 }
 
@@ -670,8 +838,9 @@ static void add_block_position(demuxer_t *demuxer, struct mkv_track *track,
 
     if (mkv_d->index_complete || !track)
         return;
-    if (track->last_index_entry >= 0) {
-        mkv_index_t *index = &mkv_d->indexes[track->last_index_entry];
+    struct mkv_index_list *list = get_index_list(mkv_d, track->tnum, false);
+    if (list && list->num_entries) {
+        mkv_index_t *index = &list->entries[list->num_entries - 1];
         // filepos is always the cluster position, which can contain multiple
         // blocks with different timecodes - one is enough.
         // Also, never add block which are already covered by the index.
@@ -679,7 +848,7 @@ static void add_block_position(demuxer_t *demuxer, struct mkv_track *track,
             return;
     }
     cue_index_add(demuxer, track->tnum, filepos, timecode);
-    track->last_index_entry = mkv_d->num_indexes - 1;
+    mkv_d->index_dirty = true;
 }
 
 static int demux_mkv_read_cues(demuxer_t *demuxer)
@@ -701,6 +870,8 @@ static int demux_mkv_read_cues(demuxer_t *demuxer)
     if (ebml_read_element(s, &parse_ctx, &cues, &ebml_cues_desc) < 0)
         return -1;
 
+    for (int n = 0; n < mkv_d->num_index_lists; n++)
+        mkv_d->index_lists[n].num_entries = 0;
     mkv_d->num_indexes = 0;
 
     for (int i = 0; i < cues.n_cue_point; i++) {
@@ -749,6 +920,364 @@ static void read_deferred_cues(demuxer_t *demuxer)
     }
 }
 
+/* Persistent index files. They contain:
+ *  magic (8 bytes), file identity (INDEX_ID_SIZE), flags (4), count (4),
+ *  count times: track number (4), timecode (8), file position (8)
+ * All numbers are little endian. The identity consists of the file size,
+ * modification time and segment UID.
+ */
+#define INDEX_FILE_MAGIC "mpvmkvi1"
+#define INDEX_FILE_HEADER_SIZE (8 + INDEX_ID_SIZE + 4 + 4)
+#define INDEX_FILE_ENTRY_SIZE (4 + 8 + 8)
+#define INDEX_FLAG_COMPLETE 1
+
+static bool get_file_mtime(demuxer_t *demuxer, int64_t *mtime)
+{
+    // Unsupported unless it's a local file, which can be opened again.
+    return stream_control(demuxer->stream, STREAM_CTRL_GET_MTIME, mtime)
+           == STREAM_OK;
+}
+
+static void load_index_file(demuxer_t *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    FILE *f = fopen(mkv_d->index_file, "rb");
+    if (!f)
+        return;
+    uint8_t hdr[INDEX_FILE_HEADER_SIZE];
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr, INDEX_FILE_MAGIC, 8) != 0 ||
+        memcmp(hdr + 8, mkv_d->index_id, INDEX_ID_SIZE) != 0)
+    {
+        MP_WARN(demuxer, "Ignoring invalid index file '%s'.\n",
+                mkv_d->index_file);
+        goto done;
+    }
+    uint32_t flags = AV_RL32(hdr + 8 + INDEX_ID_SIZE);
+    uint32_t count = AV_RL32(hdr + 8 + INDEX_ID_SIZE + 4);
+    for (uint32_t n = 0; n < count; n++) {
+        uint8_t e[INDEX_FILE_ENTRY_SIZE];
+        uint64_t filepos;
+        if (fread(e, sizeof(e), 1, f) != 1 ||
+            (filepos = AV_RL64(e + 12)) < mkv_d->segment_start ||
+            filepos >= demuxer->stream->end_pos)
+        {
+            MP_WARN(demuxer, "Broken index file '%s'.\n", mkv_d->index_file);
+            for (int i = 0; i < mkv_d->num_index_lists; i++)
+                mkv_d->index_lists[i].num_entries = 0;
+            mkv_d->num_indexes = 0;
+            goto done;
+        }
+        cue_index_add(demuxer, (int32_t)AV_RL32(e), filepos, AV_RL64(e + 4));
+    }
+    mkv_d->index_complete = flags & INDEX_FLAG_COMPLETE;
+    MP_VERBOSE(demuxer, "Loaded %d index entries from '%s'%s.\n",
+               mkv_d->num_indexes, mkv_d->index_file,
+               mkv_d->index_complete ? " (complete)" : "");
+done:
+    fclose(f);
+}
+
+static void save_index_file(demuxer_t *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    if (!mkv_d->index_file || !mkv_d->index_dirty || !mkv_d->num_indexes)
+        return;
+    FILE *f = mp_open_file_atomic(mkv_d->index_file);
+    if (!f) {
+        MP_ERR(demuxer, "Can't write index file '%s': %s\n",
+               mkv_d->index_file, strerror(errno));
+        return;
+    }
+    uint8_t hdr[INDEX_FILE_HEADER_SIZE];
+    memcpy(hdr, INDEX_FILE_MAGIC, 8);
+    memcpy(hdr + 8, mkv_d->index_id, INDEX_ID_SIZE);
+    AV_WL32(hdr + 8 + INDEX_ID_SIZE,
+            mkv_d->index_complete ? INDEX_FLAG_COMPLETE : 0);
+    AV_WL32(hdr + 8 + INDEX_ID_SIZE + 4, mkv_d->num_indexes);
+    bool ok = fwrite(hdr, sizeof(hdr), 1, f) == 1;
+    for (int i = 0; i < mkv_d->num_index_lists; i++) {
+        struct mkv_index_list *list = &mkv_d->index_lists[i];
+        for (int n = 0; n < list->num_entries; n++) {
+            uint8_t e[INDEX_FILE_ENTRY_SIZE];
+            AV_WL32(e, list->entries[n].tnum);
+            AV_WL64(e + 4, list->entries[n].timecode);
+            AV_WL64(e + 12, list->entries[n].filepos);
+            ok &= fwrite(e, sizeof(e), 1, f) == 1;
+        }
+    }
+    if (!mp_commit_file_atomic(f, mkv_d->index_file, ok)) {
+        MP_ERR(demuxer, "Can't write index file '%s'.\n", mkv_d->index_file);
+    } else {
+        MP_VERBOSE(demuxer, "Wrote %d index entries to '%s'.\n",
+                   mkv_d->num_indexes, mkv_d->index_file);
+        mkv_d->index_dirty = false;
+    }
+}
+
+// Set up the persistent index file, and load the index if it exists.
+static void open_index_file(demuxer_t *demuxer)
+{
+    struct MPOpts *opts = demuxer->opts;
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    int64_t mtime;
+
+    if (!opts->mkv_index_dir || !opts->mkv_index_dir[0] ||
+        !get_file_mtime(demuxer, &mtime))
+        return;
+
+    uint8_t *id = mkv_d->index_id;
+    AV_WL64(id, demuxer->stream->end_pos);
+    AV_WL64(id + 8, mtime);
+    memcpy(id + 16, demuxer->matroska_data.uid.segment, 16);
+
+    void *tmp = talloc_new(NULL);
+    char *dir = mp_get_user_path(tmp, demuxer->global, opts->mkv_index_dir);
+    mp_path_ensure_dir(dir);
+    char *key = mp_path_hash_name(tmp, id, INDEX_ID_SIZE);
+    mkv_d->index_file = talloc_asprintf(mkv_d, "%s/%s.mkvidx", dir, key);
+    talloc_free(tmp);
+
+    load_index_file(demuxer);
+}
+
+// Building the index in a background thread (--demuxer-mkv-index-background).
+// The thread reads the file with a separate stream, and only looks at the
+// block headers. The result replaces the index once it's complete.
+struct mkv_bg_index {
+    struct mp_log *log;
+    struct stream *stream;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    bool cancel;        // protected by lock
+    bool done;          // protected by lock
+
+    // Owned by the thread until done is set.
+    bool success;
+    int64_t start, end;
+    struct bg_index_track {
+        int tnum;
+        int last_entry; // latest added entry for this track, or -1
+    } *tracks;
+    int num_tracks;
+    mkv_index_t *entries;
+    int num_entries;
+};
+
+// Like index_block() and add_block_position().
+static void bg_index_block(struct mkv_bg_index *bg, bstr header,
+                           uint64_t filepos, int64_t cluster_tc,
+                           bool simple, bool keyframe)
+{
+    uint64_t num = ebml_read_vlen_uint(&header);
+    if (num == EBML_UINT_INVALID || header.len < 3)
+        return;
+    int16_t time = header.start[0] << 8 | header.start[1];
+    if (simple)
+        keyframe = header.start[2] & 0x80;
+    int64_t timecode = cluster_tc + time;
+    if (!keyframe || timecode < 0)
+        return;
+    for (int n = 0; n < bg->num_tracks; n++) {
+        struct bg_index_track *t = &bg->tracks[n];
+        if (t->tnum != num)
+            continue;
+        if (t->last_entry >= 0) {
+            mkv_index_t *index = &bg->entries[t->last_entry];
+            if (index->filepos == filepos || index->timecode >= timecode)
+                return;
+        }
+        mkv_index_t new = {
+            .tnum = t->tnum,
+            .timecode = timecode,
+            .filepos = filepos,
+        };
+        MP_TARRAY_APPEND(bg, bg->entries, bg->num_entries, new);
+        t->last_entry = bg->num_entries - 1;
+        return;
+    }
+}
+
+static void *bg_index_thread(void *arg)
+{
+    struct mkv_bg_index *bg = arg;
+    stream_t *s = bg->stream;
+    int64_t cluster_pos = 0, cluster_tc = 0;
+    int64_t group_end = -1;
+    bool group_keyframe = false;
+    uint8_t group_block[16];
+    int group_block_len = 0;
+    uint8_t buf[16];
+
+    bool ok = stream_seek(s, bg->start);
+    for (int n = 0; ok; n++) {
+        if (!(n & 1023)) {
+            pthread_mutex_lock(&bg->lock);
+            ok = !bg->cancel;
+            pthread_mutex_unlock(&bg->lock);
+            if (!ok)
+                break;
+        }
+        int64_t pos = stream_tell(s);
+        if (group_end >= 0 && pos >= group_end) {
+            bg_index_block(bg, (bstr){group_block, group_block_len},
+                           cluster_pos, cluster_tc, false, group_keyframe);
+            group_end = -1;
+        }
+        if (pos >= bg->end)
+            break;
+        uint32_t id = ebml_read_id(s);
+        if (s->eof || id == EBML_ID_EBML) // EOF, or appended segment
+            break;
+        uint64_t len = ebml_read_length(s);
+        if (id == MATROSKA_ID_CLUSTER) {
+            // Read the cluster contents as if they were on the same level.
+            // This works because their IDs never appear outside of clusters,
+            // and also handles clusters of unknown size.
+            cluster_pos = pos;
+            cluster_tc = 0;
+            group_end = -1;
+            continue;
+        }
+        if (id == EBML_ID_INVALID || len == EBML_UINT_INVALID ||
+            len > bg->end - stream_tell(s))
+        {
+            MP_VERBOSE(bg, "Broken element at %"PRId64", stopping.\n", pos);
+            ok = false;
+            break;
+        }
+        int64_t next = stream_tell(s) + len;
+        int read_len = MPMIN(len, sizeof(buf));
+        switch (id) {
+        case MATROSKA_ID_BLOCKGROUP:
+            // Descend into the group; the entry is added when it ends.
+            group_end = next;
+            group_keyframe = true;
+            group_block_len = 0;
+            continue;
+        case MATROSKA_ID_TIMECODE:
+        case MATROSKA_ID_REFERENCEBLOCK:
+        case MATROSKA_ID_SIMPLEBLOCK:
+        case MATROSKA_ID_BLOCK:
+            if (stream_read(s, (char *)buf, read_len) != read_len)
+                goto eof;
+            break;
+        }
+        switch (id) {
+        case MATROSKA_ID_TIMECODE:
+            cluster_tc = 0;
+            for (int i = 0; i < read_len; i++)
+                cluster_tc = (cluster_tc << 8) | buf[i];
+            break;
+        case MATROSKA_ID_REFERENCEBLOCK:
+            for (int i = 0; i < read_len; i++) {
+                if (buf[i])
+                    group_keyframe = false;
+            }
+            break;
+        case MATROSKA_ID_BLOCK:
+            memcpy(group_block, buf, read_len);
+            group_block_len = read_len;
+            break;
+        case MATROSKA_ID_SIMPLEBLOCK:
+            bg_index_block(bg, (bstr){buf, read_len}, cluster_pos, cluster_tc,
+                           true, false);
+            break;
+        }
+        if (!stream_seek(s, next))
+            break;
+    }
+eof:
+    if (ok && group_end >= 0) {
+        bg_index_block(bg, (bstr){group_block, group_block_len},
+                       cluster_pos, cluster_tc, false, group_keyframe);
+    }
+
+    pthread_mutex_lock(&bg->lock);
+    bg->success = ok;
+    bg->done = true;
+    pthread_mutex_unlock(&bg->lock);
+    return NULL;
+}
+
+static void start_bg_index(demuxer_t *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    int64_t mtime;
+
+    if (!get_file_mtime(demuxer, &mtime))
+        return;
+    struct stream *s = stream_open(demuxer->stream->url, demuxer->global);
+    if (!s)
+        return;
+
+    struct mkv_bg_index *bg = talloc_zero(NULL, struct mkv_bg_index);
+    *bg = (struct mkv_bg_index){
+        .log = demuxer->log,
+        .stream = s,
+        .start = mkv_d->first_cluster,
+        .end = mkv_d->segment_end > 0 ? mkv_d->segment_end : INT64_MAX,
+    };
+    pthread_mutex_init(&bg->lock, NULL);
+    for (int n = 0; n < mkv_d->num_tracks; n++) {
+        struct bg_index_track t = { mkv_d->tracks[n]->tnum, -1 };
+        MP_TARRAY_APPEND(bg, bg->tracks, bg->num_tracks, t);
+    }
+    if (pthread_create(&bg->thread, NULL, bg_index_thread, bg)) {
+        pthread_mutex_destroy(&bg->lock);
+        free_stream(s);
+        talloc_free(bg);
+        return;
+    }
+    MP_VERBOSE(demuxer, "Building index in the background.\n");
+    mkv_d->bg_index = bg;
+}
+
+static void stop_bg_index(mkv_demuxer_t *mkv_d)
+{
+    struct mkv_bg_index *bg = mkv_d->bg_index;
+    if (!bg)
+        return;
+    pthread_mutex_lock(&bg->lock);
+    bg->cancel = true;
+    pthread_mutex_unlock(&bg->lock);
+    pthread_join(bg->thread, NULL);
+    pthread_mutex_destroy(&bg->lock);
+    free_stream(bg->stream);
+    talloc_free(bg);
+    mkv_d->bg_index = NULL;
+}
+
+// Replace the index with the one built by the background thread, if it's
+// done.
+static void check_bg_index(demuxer_t *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    struct mkv_bg_index *bg = mkv_d->bg_index;
+    if (!bg)
+        return;
+    pthread_mutex_lock(&bg->lock);
+    bool done = bg->done;
+    pthread_mutex_unlock(&bg->lock);
+    if (!done)
+        return;
+    if (bg->success && !mkv_d->index_complete) {
+        for (int n = 0; n < mkv_d->num_index_lists; n++)
+            mkv_d->index_lists[n].num_entries = 0;
+        mkv_d->num_indexes = 0;
+        for (int n = 0; n < bg->num_entries; n++) {
+            mkv_index_t *e = &bg->entries[n];
+            cue_index_add(demuxer, e->tnum, e->filepos, e->timecode);
+        }
+        mkv_d->index_complete = true;
+        mkv_d->index_dirty = true;
+        MP_VERBOSE(demuxer, "Background index done (%d entries).\n",
+                   mkv_d->num_indexes);
+    }
+    stop_bg_index(mkv_d);
+}
+
 static int demux_mkv_read_chapters(struct demuxer *demuxer)
 {
     struct MPOpts *opts = demuxer->opts;
@@ -1636,13 +2165,14 @@ static int demux_mkv_open_sub(demuxer_t *demuxer, mkv_track_t *track)
     sh_sub_t *sh_s = sh->sub;
     sh->demuxer_id = track->tnum;
     sh->codec = subtitle_type;
-    bstr buffer = demux_mkv_decode(demuxer->log, track, in, 2);
-    if (buffer.start && buffer.start != track->private_data) {
+    void *buf;
+    bstr buffer = demux_mkv_decode(demuxer, track, in, 2, &buf);
+    if (buffer.start && buf) {
         talloc_free(track->private_data);
-        talloc_steal(track, buffer.start);
-        track->private_data = buffer.start;
+        track->private_data = talloc_memdup(track, buffer.start, buffer.len);
         track->private_size = buffer.len;
     }
+    demux_packet_pool_free(buf);
     sh_s->extradata = talloc_size(sh, track->private_size);
     memcpy(sh_s->extradata, track->private_data, track->private_size);
     sh_s->extradata_len = track->private_size;
@@ -1659,27 +2189,25 @@ static int demux_mkv_open_sub(demuxer_t *demuxer, mkv_track_t *track)
     return 0;
 }
 
-static int read_ebml_header(demuxer_t *demuxer)
+static int read_ebml_header(stream_t *s, struct mp_log *log)
 {
-    stream_t *s = demuxer->stream;
-
     if (ebml_read_id(s) != EBML_ID_EBML)
         return 0;
     struct ebml_ebml ebml_master = {{0}};
-    struct ebml_parse_ctx parse_ctx = { demuxer->log, .no_error_messages = true };
+    struct ebml_parse_ctx parse_ctx = { log, .no_error_messages = true };
     if (ebml_read_element(s, &parse_ctx, &ebml_master, &ebml_ebml_desc) < 0)
         return 0;
     if (ebml_master.doc_type.start == NULL) {
-        MP_VERBOSE(demuxer, "File has EBML header but no doctype."
+        mp_verbose(log, "File has EBML header but no doctype."
                " Assuming \"matroska\".\n");
     } else if (bstrcmp(ebml_master.doc_type, bstr0("matroska")) != 0
         && bstrcmp(ebml_master.doc_type, bstr0("webm")) != 0) {
-        MP_DBG(demuxer, "no head found\n");
+        mp_dbg(log, "no head found\n");
         talloc_free(parse_ctx.talloc_ctx);
         return 0;
     }
     if (ebml_master.doc_type_read_version > 2) {
-        MP_WARN(demuxer, "This looks like a Matroska file, "
+        mp_warn(log, "This looks like a Matroska file, "
                "but we don't support format version %"PRIu64"\n",
                ebml_master.doc_type_read_version);
         talloc_free(parse_ctx.talloc_ctx);
@@ -1692,7 +2220,7 @@ static int read_ebml_header(demuxer_t *demuxer)
         || (ebml_master.n_ebml_max_id_length
             && ebml_master.ebml_max_id_length != 4))
     {
-        MP_WARN(demuxer, "This looks like a Matroska file, "
+        mp_warn(log, "This looks like a Matroska file, "
                "but the header has bad parameters\n");
         talloc_free(parse_ctx.talloc_ctx);
         return 0;
@@ -1730,7 +2258,7 @@ static int read_mkv_segment_header(demuxer_t *demuxer, int64_t *segment_end)
             return 0;
         }
         // Segments are like concatenated Matroska files
-        if (!read_ebml_header(demuxer))
+        if (!read_ebml_header(s, demuxer->log))
             return 0;
     }
 
@@ -1745,7 +2273,7 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
     int64_t start_pos;
     int64_t end_pos;
 
-    if (!read_ebml_header(demuxer))
+    if (!read_ebml_header(s, demuxer->log))
         return -1;
     MP_VERBOSE(demuxer, "Found the head...\n");
 
@@ -1817,9 +2345,17 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
         MP_ERR(demuxer, "Couldn't seek back after reading headers?\n");
         return -1;
     }
+    mkv_d->first_cluster = start_pos;
 
     MP_VERBOSE(demuxer, "All headers are parsed!\n");
 
+    // Files without cues are indexed while demuxing.
+    if (!mkv_d->index_complete && !mkv_d->deferred_cues) {
+        open_index_file(demuxer);
+        if (!mkv_d->index_complete && demuxer->opts->mkv_index_background)
+            start_bg_index(demuxer);
+    }
+
     process_tags(demuxer);
     display_create_tracks(demuxer);
 
@@ -1960,7 +2496,7 @@ static void handle_realvideo(demuxer_t *demuxer, mkv_track_t *track,
     demux_packet_t *dp;
     int64_t timestamp = mkv_d->last_pts * 1000;
 
-    dp = new_demux_packet_from(data.start, data.len);
+    dp = demuxer_new_packet_from(demuxer, data.start, data.len);
 
     if (mkv_d->v_skip_to_keyframe) {
         dp->pts = mkv_d->last_pts;
@@ -2057,8 +2593,9 @@ static void handle_realaudio(demuxer_t *demuxer, mkv_track_t *track,
             track->sub_packet_cnt = 0;
             // Release all the audio packets
             for (int x = 0; x < sph * w / apk_usize; x++) {
-                dp = new_demux_packet_from(track->audio_buf + x * apk_usize,
-                                           apk_usize);
+                dp = demuxer_new_packet_from(demuxer,
+                                             track->audio_buf + x * apk_usize,
+                                             apk_usize);
                 /* Put timestamp only on packets that correspond to original
                  * audio packets in file */
                 dp->pts = (x * apk_usize % w) ? MP_NOPTS_VALUE :
@@ -2069,7 +2606,7 @@ static void handle_realaudio(demuxer_t *demuxer, mkv_track_t *track,
             }
         }
     } else { // Not a codec that requires reordering
-        dp = new_demux_packet_from(buffer, size);
+        dp = demuxer_new_packet_from(demuxer, buffer, size);
         if (track->ra_pts == mkv_d->last_pts && !mkv_d->a_skip_to_keyframe)
             dp->pts = MP_NOPTS_VALUE;
         else
@@ -2240,13 +2777,13 @@ struct block_info {
     uint64_t timecode;
     mkv_track_t *track;
     bstr data;
-    void *alloc;
+    void *alloc;        // packet pool buffer containing data
     int64_t filepos;
 };
 
 static void free_block(struct block_info *block)
 {
-    free(block->alloc);
+    demux_packet_pool_free(block->alloc);
     block->alloc = NULL;
     block->data = (bstr){0};
 }
@@ -2260,27 +2797,14 @@ static void index_block(demuxer_t *demuxer, struct block_info *block)
     }
 }
 
-static int read_block(demuxer_t *demuxer, int64_t end, struct block_info *block)
+// Parse the header of the Block element in block->data.
+static int parse_block_header(demuxer_t *demuxer, struct block_info *block)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
-    stream_t *s = demuxer->stream;
     uint64_t num;
     int16_t time;
-    uint64_t length;
     int res = -1;
 
-    free_block(block);
-    length = ebml_read_length(s);
-    if (length > 500000000 || stream_tell(s) + length > (uint64_t)end)
-        goto exit;
-    block->alloc = malloc(length + AV_LZO_INPUT_PADDING);
-    if (!block->alloc)
-        goto exit;
-    block->data = (bstr){block->alloc, length};
-    block->filepos = stream_tell(s);
-    if (stream_read(s, block->data.start, block->data.len) != block->data.len)
-        goto exit;
-
     // Parse header of the Block element
     /* first byte(s): track num */
     num = ebml_read_vlen_uint(&block->data);
@@ -2295,24 +2819,227 @@ static int read_block(demuxer_t *demuxer, int64_t end, struct block_info *block)
     if (block->simple)
         block->keyframe = block->data.start[0] & 0x80;
     block->timecode = time * mkv_d->tc_scale + mkv_d->cluster_tc;
-    for (int i = 0; i < mkv_d->num_tracks; i++) {
-        if (mkv_d->tracks[i]->tnum == num) {
-            block->track = mkv_d->tracks[i];
-            break;
-        }
-    }
+    block->track = find_track_by_num(mkv_d, num);
     if (!block->track) {
         res = 0;
         goto exit;
     }
 
     res = 1;
+exit:
+    return res;
+}
+
+static int read_block(demuxer_t *demuxer, int64_t end, struct block_info *block)
+{
+    stream_t *s = demuxer->stream;
+    uint64_t length;
+    int res = -1;
+
+    free_block(block);
+    length = ebml_read_length(s);
+    if (length > 500000000 || stream_tell(s) + length > (uint64_t)end)
+        goto exit;
+    // Read the data directly into memory that packets can reference.
+    block->alloc = demuxer_alloc_packet_buffer(demuxer, length + BLOCK_PADDING);
+    block->data = (bstr){block->alloc, length};
+    memset(block->data.start + length, 0, BLOCK_PADDING);
+    block->filepos = stream_tell(s);
+    if (stream_read(s, block->data.start, block->data.len) != block->data.len)
+        goto exit;
+
+    res = parse_block_header(demuxer, block);
 exit:
     if (res <= 0)
         free_block(block);
     return res;
 }
 
+static int64_t cluster_buf_pos(mkv_demuxer_t *mkv_d, unsigned char *ptr)
+{
+    return mkv_d->cluster_alloc_pos + (ptr - (unsigned char *)mkv_d->cluster_alloc);
+}
+
+static void drop_cluster_buffer(mkv_demuxer_t *mkv_d)
+{
+    demux_packet_pool_free(mkv_d->cluster_alloc);
+    mkv_d->cluster_alloc = NULL;
+    mkv_d->cluster_buf = (bstr){0};
+}
+
+// Drop the cluster buffer, and continue reading from the stream at the first
+// element that wasn't parsed from the buffer yet.
+static void unbuffer_cluster(demuxer_t *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+
+    if (!mkv_d->cluster_alloc)
+        return;
+    stream_seek(demuxer->stream,
+                cluster_buf_pos(mkv_d, mkv_d->cluster_buf.start));
+    drop_cluster_buffer(mkv_d);
+}
+
+// Read the rest of the current cluster into memory, if it's not too large.
+// Packets reference this memory directly (see read_block_buffered()).
+static void read_cluster_buffer(demuxer_t *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    stream_t *s = demuxer->stream;
+
+    drop_cluster_buffer(mkv_d);
+    int64_t pos = stream_tell(s);
+    if (mkv_d->cluster_end == EBML_UINT_INVALID ||
+        mkv_d->cluster_end <= pos || mkv_d->cluster_end - pos > MAX_CLUSTER_BUFFER)
+        return;
+    int len = mkv_d->cluster_end - pos;
+    mkv_d->cluster_alloc = demuxer_alloc_packet_buffer(demuxer, len + BLOCK_PADDING);
+    int got = MPMAX(stream_read(s, mkv_d->cluster_alloc, len), 0);
+    // A truncated cluster is parsed as far as possible.
+    memset((char *)mkv_d->cluster_alloc + got, 0, len - got + BLOCK_PADDING);
+    mkv_d->cluster_alloc_pos = pos;
+    mkv_d->cluster_alloc_len = len;
+    mkv_d->cluster_buf = (bstr){mkv_d->cluster_alloc, got};
+}
+
+// Like read_block(), but data is the Block element in the cluster buffer.
+static int read_block_buffered(demuxer_t *demuxer, bstr data,
+                               struct block_info *block)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+
+    free_block(block);
+    block->filepos = cluster_buf_pos(mkv_d, data.start);
+    if (mkv_d->cluster_alloc_len > MAX_CLUSTER_REF &&
+        data.len < mkv_d->cluster_alloc_len / CLUSTER_COPY_RATIO)
+    {
+        block->alloc = demuxer_alloc_packet_buffer(demuxer,
+                                                   data.len + BLOCK_PADDING);
+        memcpy(block->alloc, data.start, data.len);
+        memset((char *)block->alloc + data.len, 0, BLOCK_PADDING);
+        block->data = (bstr){block->alloc, data.len};
+    } else {
+        demux_packet_pool_ref(mkv_d->cluster_alloc);
+        block->alloc = mkv_d->cluster_alloc;
+        block->data = data;
+    }
+    int res = parse_block_header(demuxer, block);
+    if (res <= 0)
+        free_block(block);
+    return res;
+}
+
+static int read_block_group_buffered(demuxer_t *demuxer, bstr data,
+                                     struct block_info *block)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    *block = (struct block_info){ .keyframe = true };
+
+    while (data.len) {
+        uint32_t id = ebml_bstr_read_id(&data);
+        switch (id) {
+        case MATROSKA_ID_BLOCKDURATION:
+            block->duration = ebml_bstr_read_uint(&data);
+            if (block->duration == EBML_UINT_INVALID)
+                goto error;
+            block->duration *= mkv_d->tc_scale;
+            break;
+
+        case MATROSKA_ID_REFERENCEBLOCK:;
+            int64_t num = ebml_bstr_read_int(&data);
+            if (num == EBML_INT_INVALID)
+                goto error;
+            if (num)
+                block->keyframe = false;
+            break;
+
+        case MATROSKA_ID_CLUSTER:
+        case EBML_ID_INVALID:
+            goto error;
+
+        default: {
+            uint64_t len = ebml_bstr_read_length(&data);
+            if (len == EBML_UINT_INVALID || len > data.len)
+                goto error;
+            if (id == MATROSKA_ID_BLOCK &&
+                read_block_buffered(demuxer, bstr_splice(data, 0, len), block) < 0)
+                goto error;
+            data = bstr_cut(data, len);
+            break;
+        }
+        }
+    }
+
+    return block->data.start ? 1 : 0;
+
+error:
+    free_block(block);
+    return -1;
+}
+
+// Parse the next block from the cluster buffer. Returns 1 if a block was
+// found. Otherwise, the buffer is dropped, the stream is positioned at the
+// first unparsed element (normally the end of the cluster), and 0 is
+// returned. Then parsing from the stream continues, which also takes care of
+// handling errors and broken cluster sizes.
+static int read_next_block_buffered(demuxer_t *demuxer,
+                                    struct block_info *block)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+
+    while (mkv_d->cluster_buf.len) {
+        bstr buf = mkv_d->cluster_buf;
+        uint32_t id = ebml_bstr_read_id(&buf);
+        switch (id) {
+        case MATROSKA_ID_TIMECODE: {
+            uint64_t num = ebml_bstr_read_uint(&buf);
+            if (num == EBML_UINT_INVALID)
+                goto done;
+            mkv_d->cluster_tc = num * mkv_d->tc_scale;
+            break;
+        }
+
+        case MATROSKA_ID_BLOCKGROUP:
+        case MATROSKA_ID_SIMPLEBLOCK: {
+            uint64_t len = ebml_bstr_read_length(&buf);
+            if (len == EBML_UINT_INVALID || len > buf.len)
+                goto done;
+            bstr data = bstr_splice(buf, 0, len);
+            int res;
+            if (id == MATROSKA_ID_BLOCKGROUP) {
+                res = read_block_group_buffered(demuxer, data, block);
+            } else {
+                *block = (struct block_info){ .simple = true };
+                res = read_block_buffered(demuxer, data, block);
+            }
+            if (res < 0)
+                goto done;
+            mkv_d->cluster_buf = bstr_cut(buf, len);
+            if (res > 0)
+                return 1;
+            continue;
+        }
+
+        case MATROSKA_ID_CLUSTER:
+        case EBML_ID_INVALID:
+            goto done;
+
+        default: {
+            uint64_t len = ebml_bstr_read_length(&buf);
+            if (len == EBML_UINT_INVALID || len > buf.len)
+                goto done;
+            buf = bstr_cut(buf, len);
+            break;
+        }
+        }
+        mkv_d->cluster_buf = buf;
+    }
+
+done:
+    unbuffer_cluster(demuxer);
+    return 0;
+}
+
 static int handle_block(demuxer_t *demuxer, struct block_info *block_info)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
@@ -2376,11 +3103,32 @@ static int handle_block(demuxer_t *demuxer, struct block_info *block_info)
             else if (stream->type == STREAM_AUDIO && track->realmedia)
                 handle_realaudio(demuxer, track, block, keyframe);
             else {
-                bstr raw = demux_mkv_decode(demuxer->log, track, block, 1);
+                void *raw_buf;
+                bstr raw = demux_mkv_decode(demuxer, track, block, 1, &raw_buf);
+                bstr decoded = raw;
                 bstr buffer;
                 while (raw.start && mkv_parse_packet(track, &raw, &buffer)) {
-                    demux_packet_t *dp =
-                        new_demux_packet_from(buffer.start, buffer.len);
+                    demux_packet_t *dp;
+                    // Reference the block memory if the data wasn't changed
+                    // by parsing. Laces are followed by other block or
+                    // cluster data, or by padding. The same applies to the
+                    // decoded data, which is padded.
+                    if (buffer.start >= block_info->data.start &&
+                        buffer.start + buffer.len <=
+                            block_info->data.start + block_info->data.len)
+                    {
+                        dp = new_demux_packet_ref(block_info->alloc,
+                                                  buffer.start, buffer.len);
+                    } else if (raw_buf && buffer.start >= decoded.start &&
+                               buffer.start + buffer.len <=
+                                    decoded.start + decoded.len)
+                    {
+                        dp = new_demux_packet_ref(raw_buf, buffer.start,
+                                                  buffer.len);
+                    } else {
+                        dp = demuxer_new_packet_from(demuxer, buffer.start,
+                                                     buffer.len);
+                    }
                     dp->keyframe = keyframe;
                     /* If default_duration is 0, assume no pts value is known
                      * for packets after the first one (rather than all pts
@@ -2393,6 +3141,7 @@ static int handle_block(demuxer_t *demuxer, struct block_info *block_info)
                     dp->duration = block_duration / 1e9;
                     demuxer_add_packet(demuxer, stream, dp);
                 }
+                demux_packet_pool_free(raw_buf);
                 talloc_free_children(track->parser_tmp);
             }
             data = bstr_cut(data, lace_size[i]);
@@ -2465,6 +3214,9 @@ static int read_next_block(demuxer_t *demuxer, struct block_info *block)
     stream_t *s = demuxer->stream;
 
     while (1) {
+        if (mkv_d->cluster_alloc && read_next_block_buffered(demuxer, block) > 0)
+            return 1;
+
         while (stream_tell(s) < mkv_d->cluster_end) {
             int64_t start_filepos = stream_tell(s);
             switch (ebml_read_id(s)) {
@@ -2514,6 +3266,7 @@ static int read_next_block(demuxer_t *demuxer, struct block_info *block)
         }
 
     find_next_cluster:
+        drop_cluster_buffer(mkv_d);
         mkv_d->cluster_end = 0;
         for (;;) {
             mkv_d->cluster_start = stream_tell(s);
@@ -2540,6 +3293,7 @@ static int read_next_block(demuxer_t *demuxer, struct block_info *block)
         // mkv files for "streaming" can have this legally
         if (mkv_d->cluster_end != EBML_UINT_INVALID)
             mkv_d->cluster_end += stream_tell(s);
+        read_cluster_buffer(demuxer);
     }
 }
 
@@ -2567,10 +3321,10 @@ static mkv_index_t *get_highest_index_entry(struct demuxer *demuxer)
     assert(!mkv_d->index_complete); // would require separate code
 
     mkv_index_t *index = NULL;
-    for (int n = 0; n < mkv_d->num_tracks; n++) {
-        int n_index = mkv_d->tracks[n]->last_index_entry;
-        if (n_index >= 0) {
-            mkv_index_t *index2 = &mkv_d->indexes[n_index];
+    for (int n = 0; n < mkv_d->num_index_lists; n++) {
+        struct mkv_index_list *list = &mkv_d->index_lists[n];
+        if (list->num_entries) {
+            mkv_index_t *index2 = &list->entries[list->num_entries - 1];
             if (!index || index2->filepos > index->filepos)
                 index = index2;
         }
@@ -2584,6 +3338,7 @@ static int create_index_until(struct demuxer *demuxer, uint64_t timecode)
     struct stream *s = demuxer->stream;
 
     read_deferred_cues(demuxer);
+    check_bg_index(demuxer);
 
     if (mkv_d->index_complete)
         return 0;
@@ -2591,8 +3346,10 @@ static int create_index_until(struct demuxer *demuxer, uint64_t timecode)
     mkv_index_t *index = get_highest_index_entry(demuxer);
 
     if (!index || index->timecode * mkv_d->tc_scale < timecode) {
-        if (index)
+        if (index) {
+            drop_cluster_buffer(mkv_d);
             stream_seek(s, index->filepos);
+        }
         MP_VERBOSE(demuxer, "creating index until TC %" PRIu64 "\n", timecode);
         for (;;) {
             int res;
@@ -2609,13 +3366,30 @@ static int create_index_until(struct demuxer *demuxer, uint64_t timecode)
                 break;
         }
     }
-    if (!mkv_d->indexes) {
+    if (!mkv_d->num_indexes) {
         MP_WARN(demuxer, "no target for seek found\n");
         return -1;
     }
     return 0;
 }
 
+// Select entry as seek target if it's better than *index (see seek_with_cues).
+static void check_seek_entry(struct mkv_demuxer *mkv_d, mkv_index_t *entry,
+                             int64_t target_timecode, int flags,
+                             int64_t *min_diff, mkv_index_t **index)
+{
+    int64_t diff = target_timecode - (int64_t) (entry->timecode * mkv_d->tc_scale);
+    if (flags & SEEK_BACKWARD)
+        diff = -diff;
+    if (diff <= 0) {
+        if (*min_diff <= 0 && diff <= *min_diff)
+            return;
+    } else if (diff >= *min_diff)
+        return;
+    *min_diff = diff;
+    *index = entry;
+}
+
 static struct mkv_index *seek_with_cues(struct demuxer *demuxer, int seek_id,
                                         int64_t target_timecode, int flags)
 {
@@ -2633,30 +3407,41 @@ static struct mkv_index *seek_with_cues(struct demuxer *demuxer, int seek_id,
         min_diff = -min_diff;
     min_diff = FFMAX(min_diff, 1);
 
-    for (int i = 0; i < mkv_d->num_indexes; i++) {
-        if (seek_id < 0 || mkv_d->indexes[i].tnum == seek_id) {
-            int64_t diff =
-                target_timecode -
-                (int64_t) (mkv_d->indexes[i].timecode * mkv_d->tc_scale);
-            if (flags & SEEK_BACKWARD)
-                diff = -diff;
-            if (diff <= 0) {
-                if (min_diff <= 0 && diff <= min_diff)
-                    continue;
-            } else if (diff >= min_diff)
-                continue;
-            min_diff = diff;
-            index = mkv_d->indexes + i;
+    for (int n = 0; n < mkv_d->num_index_lists; n++) {
+        struct mkv_index_list *list = &mkv_d->index_lists[n];
+        if (seek_id >= 0 && list->tnum != seek_id)
+            continue;
+        // Only the entries directly before and after the target can be the
+        // closest ones in either direction.
+        int i = index_search(list, mkv_d->tc_scale, target_timecode,
+                             flags & SEEK_BACKWARD);
+        if (i < list->num_entries) {
+            check_seek_entry(mkv_d, &list->entries[i], target_timecode, flags,
+                             &min_diff, &index);
+        }
+        if (i > 0) {
+            // Prefer the first of several entries with the same timecode.
+            uint64_t tc = list->entries[i - 1].timecode;
+            while (i > 1 && list->entries[i - 2].timecode == tc)
+                i--;
+            check_seek_entry(mkv_d, &list->entries[i - 1], target_timecode,
+                             flags, &min_diff, &index);
         }
     }
 
     if (index) {        /* We've found an entry. */
         uint64_t seek_pos = index->filepos;
         if (flags & SEEK_SUBPREROLL) {
+            // Find the closest cluster before seek_pos. The lists are sorted
+            // by timecode, which doesn't imply sorting by position (cues can
+            // be in any order), so all entries have to be checked.
             uint64_t prev_target = 0;
-            for (int i = 0; i < mkv_d->num_indexes; i++) {
-                if (seek_id < 0 || mkv_d->indexes[i].tnum == seek_id) {
-                    uint64_t index_pos = mkv_d->indexes[i].filepos;
+            for (int n = 0; n < mkv_d->num_index_lists; n++) {
+                struct mkv_index_list *list = &mkv_d->index_lists[n];
+                if (seek_id >= 0 && list->tnum != seek_id)
+                    continue;
+                for (int i = 0; i < list->num_entries; i++) {
+                    uint64_t index_pos = list->entries[i].filepos;
                     if (index_pos > prev_target && index_pos < seek_pos)
                         prev_target = index_pos;
                 }
@@ -2665,6 +3450,7 @@ static struct mkv_index *seek_with_cues(struct demuxer *demuxer, int seek_id,
                 seek_pos = prev_target;
         }
 
+        drop_cluster_buffer(mkv_d);
         mkv_d->cluster_end = 0;
         stream_seek(demuxer->stream, seek_pos);
     }
@@ -2674,6 +3460,7 @@ static struct mkv_index *seek_with_cues(struct demuxer *demuxer, int seek_id,
 static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
 {
     mkv_demuxer_t *mkv_d = demuxer->priv;
+    unbuffer_cluster(demuxer);
     int64_t old_pos = stream_tell(demuxer->stream);
     uint64_t v_tnum = -1;
     uint64_t a_tnum = -1;
@@ -2741,6 +3528,7 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
         int i;
 
         read_deferred_cues(demuxer);
+        check_bg_index(demuxer);
 
         if (!mkv_d->index_complete) {   /* not implemented without index */
             MP_VERBOSE(demuxer, "seek unsupported flags\n");
@@ -2749,19 +3537,20 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
         }
 
         target_filepos = (uint64_t) (s->end_pos * rel_seek_secs);
-        for (i = 0; i < mkv_d->num_indexes; i++)
-            if (mkv_d->indexes[i].tnum == v_tnum)
-                if ((index == NULL)
-                    || ((mkv_d->indexes[i].filepos >= target_filepos)
-                        && ((index->filepos < target_filepos)
-                            || (mkv_d->indexes[i].filepos < index->filepos))))
-                    index = &mkv_d->indexes[i];
+        struct mkv_index_list *list = get_index_list(mkv_d, v_tnum, false);
+        for (i = 0; list && i < list->num_entries; i++)
+            if ((index == NULL)
+                || ((list->entries[i].filepos >= target_filepos)
+                    && ((index->filepos < target_filepos)
+                        || (list->entries[i].filepos < index->filepos))))
+                index = &list->entries[i];
 
         if (!index) {
             stream_seek(s, old_pos);
             return;
         }
 
+        drop_cluster_buffer(mkv_d);
         mkv_d->cluster_end = 0;
         stream_seek(s, index->filepos);
 
@@ -2795,9 +3584,12 @@ static void mkv_free(struct demuxer *demuxer)
     if (!mkv_d)
         return;
     mkv_seek_reset(demuxer);
+    drop_cluster_buffer(mkv_d);
+    check_bg_index(demuxer);
+    stop_bg_index(mkv_d);
+    save_index_file(demuxer);
     for (int i = 0; i < mkv_d->num_tracks; i++)
         demux_mkv_free_trackentry(mkv_d->tracks[i]);
-    free(mkv_d->indexes);
 }
 
 const demuxer_desc_t demuxer_desc_matroska = {
@@ -2817,3 +3609,54 @@ bool demux_matroska_uid_cmp(struct matroska_segment_uid *a,
     return (!memcmp(a->segment, b->segment, 16) &&
             a->edition == b->edition);
 }
+
+// Read the segment UIDs of all segments in the stream, without opening a
+// demuxer. Only the EBML headers, and the top level elements up to the
+// segment info are read; everything else is skipped. Segments without UID
+// get an all-zero UID. Returns the number of segments found, or -1 if the
+// segment info of a segment could not be found this way (the caller has to
+// open the file with the demuxer to find out).
+int demux_mkv_read_segment_uids(struct stream *s, struct mp_log *log,
+                                void *talloc_ctx,
+                                struct matroska_segment_uid **uids)
+{
+    int num_uids = 0;
+    *uids = NULL;
+    while (read_ebml_header(s, log)) {
+        if (ebml_read_id(s) != MATROSKA_ID_SEGMENT)
+            break;
+        uint64_t len = ebml_read_length(s);
+        int64_t end = len == EBML_UINT_INVALID ? 0 : stream_tell(s) + len;
+        struct matroska_segment_uid uid = {{0}};
+        bool found = false;
+        while (!s->eof && (!end || stream_tell(s) < end)) {
+            uint32_t id = ebml_read_id(s);
+            if (id == MATROSKA_ID_INFO) {
+                struct ebml_info info = {0};
+                struct ebml_parse_ctx parse_ctx = {
+                    log, .no_error_messages = true
+                };
+                int r = ebml_read_element(s, &parse_ctx, &info, &ebml_info_desc);
+                if (r >= 0 && info.n_segment_uid &&
+                    info.segment_uid.len == sizeof(uid.segment))
+                    memcpy(uid.segment, info.segment_uid.start, 16);
+                talloc_free(parse_ctx.talloc_ctx);
+                found = r >= 0;
+                break;
+            }
+            // The info element comes before the clusters in all sane files.
+            if (id == MATROSKA_ID_CLUSTER || id == EBML_ID_INVALID ||
+                ebml_read_skip(log, end, s))
+                break;
+        }
+        if (!found) {
+            talloc_free(*uids);
+            *uids = NULL;
+            return -1;
+        }
+        MP_TARRAY_APPEND(talloc_ctx, *uids, num_uids, uid);
+        if (!end || end >= s->end_pos || !stream_seek(s, end))
+            break;
+    }
+    return num_uids;
+}
@@ -199,12 +199,14 @@ static int raw_fill_buffer(demuxer_t *demuxer)
     if (demuxer->stream->eof)
         return 0;
 
-    struct demux_packet *dp = new_demux_packet(p->frame_size * p->read_frames);
-    dp->pos = stream_tell(demuxer->stream) - demuxer->stream->start_pos;
+    struct demux_packet *dp =
+        demuxer_read_packet_data(demuxer, demuxer->stream,
+                                 p->frame_size * p->read_frames);
+    if (!dp)
+        return 0;
+    dp->pos -= demuxer->stream->start_pos;
     dp->pts = (dp->pos  / p->frame_size) / p->frame_rate;
 
-    int len = stream_read(demuxer->stream, dp->buffer, dp->len);
-    resize_demux_packet(dp, len);
     demuxer_add_packet(demuxer, demuxer->streams[0], dp);
 
     return 1;
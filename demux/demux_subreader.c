@@ -24,6 +24,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <ctype.h>
@@ -35,6 +38,7 @@
 #include "common/msg.h"
 #include "common/common.h"
 #include "options/options.h"
+#include "misc/charset_conv.h"
 #include "stream/stream.h"
 #include "demux/demux.h"
 
@@ -1065,6 +1069,9 @@ static int sub_autodetect (stream_t* st, int *uses_time, int utf16) {
     return SUB_INVALID;  // too many bad lines
 }
 
+// Framerate assumed for frame-based formats.
+#define FALLBACK_FPS 23.976
+
 struct subreader {
     subtitle * (*read)(stream_t *st, subtitle *dest,
                        struct readline_args *args);
@@ -1074,37 +1081,36 @@ struct subreader {
     struct readline_args args;
 };
 
+// Give sub a duration if it has none, and (if block is set) make it end
+// before nextsub starts. nextsub is NULL for the last subtitle. Returns whether
+// the subtitle was changed.
+static bool adjust_sub_time(subtitle *sub, subtitle *nextsub,
+                            unsigned long subfms, int block)
+{
+        bool changed = false;
+        if (sub->end <= sub->start){
+                sub->end = sub->start + subfms;
+                changed = true;
+        }
+        if (nextsub && block && sub->end >= nextsub->start){
+                sub->end = nextsub->start - 1;
+                if (sub->end - sub->start > subfms)
+                        sub->end = sub->start + subfms;
+                changed = true;
+        }
+        return changed;
+}
+
 static void adjust_subs_time(struct subreader *srp, subtitle* sub,
                              float subtime, float fps,
                              float sub_fps, int block,
                              int sub_num, int sub_uses_time) {
-        int n,m;
-        subtitle* nextsub;
-        int i = sub_num;
+        int n = 0;
         unsigned long subfms = (sub_uses_time ? 100 : fps) * subtime;
 
-        n=m=0;
-        if (i)  for (;;){
-                if (sub->end <= sub->start){
-                        sub->end = sub->start + subfms;
-                        m++;
-                        n++;
-                }
-                if (!--i) break;
-                nextsub = sub + 1;
-            if(block){
-                if (sub->end >= nextsub->start){
-                        sub->end = nextsub->start - 1;
-                        if (sub->end - sub->start > subfms)
-                                sub->end = sub->start + subfms;
-                        if (!m)
-                                n++;
-                }
-            }
-
-                sub = nextsub;
-                m = 0;
-        }
+        for (int i = 0; i < sub_num; i++)
+                n += adjust_sub_time(&sub[i], i + 1 < sub_num ? &sub[i + 1] : NULL,
+                                     subfms, block);
         if (n) MP_VERBOSE(&srp->args, "Adjusted %d subtitle(s).\n", n);
 }
 
@@ -1162,7 +1168,7 @@ static bool subreader_autodetect(stream_t *fd, struct MPOpts *opts,
 static sub_data* sub_read_file(stream_t *fd, struct subreader *srp)
 {
     struct MPOpts *opts = fd->opts;
-    float fps = 23.976;
+    float fps = FALLBACK_FPS;
     int n_max, i, j;
     subtitle *first, *sub, *return_sub, *alloced_sub = NULL;
     sub_data *subt_data;
@@ -1277,8 +1283,59 @@ struct priv {
     int num_pkts;
     int current;
     struct sh_stream *sh;
+
+    // Protects the fields above and below while the parser thread is running.
+    // The thread appends packets; it's the only user of the stream, and the
+    // only thread allocating memory on priv.
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    bool parsed;            // all packets have been added
+    bool cancel;
+    double seek_pts;        // skip packets ending before this (or NOPTS)
+
+    pthread_t thread;
+    bool thread_valid;
+    struct subreader sr;
+    char *charset;          // recode packets from this charset to UTF-8
 };
 
+// Turn a subtitle into a packet with ASS-style line breaks and alignment.
+// t is the duration of a subtitle time unit in seconds.
+static struct demux_packet *make_packet(void *talloc_ctx, subtitle *st, double t)
+{
+    int len = 0;
+    for (int j = 0; j < st->lines; j++)
+        len += st->text[j] ? strlen(st->text[j]) : 0;
+
+    len += 2 * st->lines;   // '\N', including the one after the last line
+    len += 6;               // {\anX}
+    len += 1;               // '\0'
+
+    char *data = talloc_array(NULL, char, len);
+
+    char *p = data;
+    char *end = p + len;
+
+    if (st->alignment)
+        p += snprintf(p, end - p, "{\\an%d}", st->alignment);
+
+    for (int j = 0; j < st->lines; j++)
+        p += snprintf(p, end - p, "%s\\N", st->text[j]);
+
+    if (st->lines > 0)
+        p -= 2;             // remove last "\N"
+    *p = 0;
+
+    struct demux_packet *pkt = talloc_ptrtype(talloc_ctx, pkt);
+    *pkt = (struct demux_packet) {
+        .pts = st->start * t,
+        .duration = (st->end - st->start) * t,
+        .buffer = talloc_steal(pkt, data),
+        .len = strlen(data),
+    };
+    return pkt;
+}
+
 static void add_sub_data(struct demuxer *demuxer, struct sub_data *subdata)
 {
     struct priv *priv = demuxer->priv;
@@ -1288,39 +1345,133 @@ static void add_sub_data(struct demuxer *demuxer, struct sub_data *subdata)
         // subdata is in 10 ms ticks, pts is in seconds
         double t = subdata->sub_uses_time ? 0.01 : (1 / subdata->fallback_fps);
 
-        int len = 0;
-        for (int j = 0; j < st->lines; j++)
-            len += st->text[j] ? strlen(st->text[j]) : 0;
+        struct demux_packet *pkt = make_packet(priv, st, t);
+        MP_TARRAY_APPEND(priv, priv->pkts, priv->num_pkts, pkt);
+    }
+}
 
-        len += 2 * st->lines;   // '\N', including the one after the last line
-        len += 6;               // {\anX}
-        len += 1;               // '\0'
+static void free_sub_text(subtitle *sub)
+{
+    for (int i = 0; i < sub->lines; i++)
+        free(sub->text[i]);
+    sub->lines = 0;
+}
 
-        char *data = talloc_array(NULL, char, len);
+// State of the background parser. Each subtitle is held back until the next
+// one has been read, because its end time might depend on the next start
+// time. The same applies to packets and --sub-fix-timing.
+struct parse_state {
+    struct demuxer *demuxer;
+    double t;                   // see make_packet()
+    unsigned long subfms;       // default duration, in subtitle time units
+    bool fix_timing;
+    subtitle sub;
+    bool have_sub;
+    struct demux_packet *pkt;
+};
 
-        char *p = data;
-        char *end = p + len;
+// Make the packet visible to the reader. The list is kept sorted by pts.
+static void publish_packet(struct demuxer *demuxer, struct demux_packet *pkt)
+{
+    struct priv *p = demuxer->priv;
+    pthread_mutex_lock(&p->lock);
+    int n = p->num_pkts;
+    while (n > 0 && p->pkts[n - 1]->pts > pkt->pts)
+        n--;
+    MP_TARRAY_INSERT_AT(p, p->pkts, p->num_pkts, n, pkt);
+    if (n < p->current)
+        p->current++;
+    pthread_cond_broadcast(&p->wakeup);
+    pthread_mutex_unlock(&p->lock);
+}
 
-        if (st->alignment)
-            p += snprintf(p, end - p, "{\\an%d}", st->alignment);
+// Queue a packet for the held back subtitle; NULL flushes the last packet.
+static void add_packet(struct parse_state *ps, struct demux_packet *pkt)
+{
+    struct demux_packet *prev = ps->pkt;
+    if (prev) {
+        if (pkt && ps->fix_timing && pkt->pts >= prev->pts)
+            demux_packet_fix_timing(prev, pkt);
+        publish_packet(ps->demuxer, prev);
+    }
+    ps->pkt = pkt;
+}
 
-        for (int j = 0; j < st->lines; j++)
-            p += snprintf(p, end - p, "%s\\N", st->text[j]);
+// Add the subtitle read before sub; sub is NULL at EOF.
+static void add_sub(struct parse_state *ps, subtitle *sub,
+                    struct readline_args *args)
+{
+    struct priv *p = ps->demuxer->priv;
+    unsigned long previous_sub_end = sub ? args->previous_sub_end : 0;
+    args->previous_sub_end = 0;
+    if (ps->have_sub) {
+        if (previous_sub_end)
+            ps->sub.end = previous_sub_end;
+        subtitle *next = sub && sub->start >= ps->sub.start ? sub : NULL;
+        adjust_sub_time(&ps->sub, next, ps->subfms, 1);
+        struct demux_packet *pkt = make_packet(p, &ps->sub, ps->t);
+        free_sub_text(&ps->sub);
+        if (p->charset) {
+            bstr data = {pkt->buffer, pkt->len};
+            bstr conv = mp_iconv_to_utf8(ps->demuxer->log, data, p->charset,
+                                         MP_ICONV_VERBOSE);
+            if (conv.start && conv.start != data.start) {
+                pkt->buffer = bstrdup0(pkt, conv);
+                pkt->len = conv.len;
+                talloc_free(conv.start);
+                talloc_free(data.start);
+            }
+        }
+        add_packet(ps, pkt);
+    }
+    ps->have_sub = !!sub;
+    if (sub)
+        ps->sub = *sub;
+}
 
-        if (st->lines > 0)
-            p -= 2;             // remove last "\N"
-        *p = 0;
+static void *parse_thread(void *arg)
+{
+    struct demuxer *demuxer = arg;
+    struct priv *p = demuxer->priv;
+    struct readline_args args = p->sr.args;
+    struct parse_state ps = {
+        .demuxer = demuxer,
+        .t = args.uses_time ? 0.01 : 1 / FALLBACK_FPS,
+        .subfms = (args.uses_time ? 100 : FALLBACK_FPS) * 6.0, // ~6 secs AST
+        .fix_timing = !demuxer->opts->suboverlap_enabled,
+    };
 
-        struct demux_packet *pkt = talloc_ptrtype(priv, pkt);
-        *pkt = (struct demux_packet) {
-            .pts = st->start * t,
-            .duration = (st->end - st->start) * t,
-            .buffer = talloc_steal(pkt, data),
-            .len = strlen(data),
-        };
+    int sub_num = 0;
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        bool cancel = p->cancel;
+        pthread_mutex_unlock(&p->lock);
+        if (cancel)
+            break;
 
-        MP_TARRAY_APPEND(priv, priv->pkts, priv->num_pkts, pkt);
+        subtitle cur = {0};
+        subtitle *sub = p->sr.read(demuxer->stream, &cur, &args);
+        if (!sub)
+            break;
+        if (sub == ERR) {
+            MP_ERR(demuxer, "Error parsing subtitle %d, stopping.\n", sub_num + 1);
+            break;
+        }
+        if (p->sr.post)
+            p->sr.post(sub);
+        add_sub(&ps, sub, &args);
+        sub_num++;
     }
+    add_sub(&ps, NULL, &args);
+    add_packet(&ps, NULL);
+
+    MP_VERBOSE(demuxer, "Read %d subtitles in the background.\n", sub_num);
+
+    pthread_mutex_lock(&p->lock);
+    p->parsed = true;
+    pthread_cond_broadcast(&p->wakeup);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
 }
 
 static struct stream *read_probe_stream(struct stream *s, int max)
@@ -1332,6 +1483,42 @@ static struct stream *read_probe_stream(struct stream *s, int max)
 
 #define PROBE_SIZE FFMIN(32 * 1024, STREAM_MAX_BUFFER_SIZE)
 
+// Whether the file should be parsed in the background. The SAMI and JACOsub
+// readers keep state in static variables, so they can't run in parallel with
+// other subreader instances.
+static bool use_streaming(struct demuxer *demuxer, struct subreader *sr)
+{
+    int64_t size = demuxer->stream->end_pos;
+    int min_size = demuxer->opts->sub_stream_size;
+    return min_size > 0 && size >= min_size * 1024LL &&
+           sr->read != sub_read_line_sami && sr->read != sub_read_line_jacosub;
+}
+
+static bool start_streaming(struct demuxer *demuxer)
+{
+    struct priv *p = demuxer->priv;
+    struct MPOpts *opts = demuxer->opts;
+
+    // The subreader functions return UTF-8 for UTF-16 files, otherwise guess
+    // the charset here, as the decoder never sees all packets at once.
+    if (!p->sr.args.utf16 && opts->sub_cp) {
+        bstr probe = stream_peek(demuxer->stream, PROBE_SIZE);
+        const char *cp = mp_charset_guess(demuxer->log, probe, opts->sub_cp, 0);
+        if (cp && cp[0] && !mp_charset_is_utf8(cp)) {
+            MP_INFO(demuxer, "Using subtitle charset: %s\n", cp);
+            p->charset = talloc_strdup(p, cp);
+        }
+    }
+
+    if (pthread_create(&p->thread, NULL, parse_thread, demuxer)) {
+        p->charset = NULL;
+        return false;
+    }
+    p->thread_valid = true;
+    MP_VERBOSE(demuxer, "Parsing subtitles in the background.\n");
+    return true;
+}
+
 static int d_open_file(struct demuxer *demuxer, enum demux_check check)
 {
     if (check > DEMUX_CHECK_REQUEST)
@@ -1352,16 +1539,40 @@ static int d_open_file(struct demuxer *demuxer, enum demux_check check)
 
     demuxer->filetype = sr.name;
 
+    struct priv *p = talloc_zero(demuxer, struct priv);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wakeup, NULL);
+    p->seek_pts = MP_NOPTS_VALUE;
+    p->sr = sr;
+
+    if (use_streaming(demuxer, &sr)) {
+        demuxer->priv = p;
+        if (start_streaming(demuxer)) {
+            p->sh = new_sh_stream(demuxer, STREAM_SUB);
+            p->sh->codec = sr.codec_name ? sr.codec_name : "text";
+            p->sh->sub->frame_based = sr.args.uses_time ? 0 : FALLBACK_FPS;
+            p->sh->sub->is_utf8 = true; // converted by the parser thread
+            p->sh->sub->streaming = true;
+            demuxer->seekable = true;
+            return 0;
+        }
+        demuxer->priv = NULL;
+    }
+
     sub_data *sd = sub_read_file(demuxer->stream, &sr);
-    if (!sd)
+    if (!sd) {
+        pthread_cond_destroy(&p->wakeup);
+        pthread_mutex_destroy(&p->lock);
+        talloc_free(p);
         return -1;
+    }
 
-    struct priv *p = talloc_zero(demuxer, struct priv);
     demuxer->priv = p;
+    p->parsed = true;
 
     p->sh = new_sh_stream(demuxer, STREAM_SUB);
     p->sh->codec = sd->codec;
-    p->sh->sub->frame_based = sd->sub_uses_time ? 0 : 23.976;
+    p->sh->sub->frame_based = sd->sub_uses_time ? 0 : FALLBACK_FPS;
     p->sh->sub->is_utf8 = sr.args.utf16 != 0; // converted from utf-16 -> utf-8
 
     add_sub_data(demuxer, sd);
@@ -1375,15 +1586,33 @@ static int d_open_file(struct demuxer *demuxer, enum demux_check check)
 static int d_fill_buffer(struct demuxer *demuxer)
 {
     struct priv *p = demuxer->priv;
-    struct demux_packet *dp = demux_packet_list_fill(p->pkts, p->num_pkts,
-                                                     &p->current);
+    struct demux_packet *dp;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        // After seeking past the parsed part, skip what ends before the target.
+        while (p->seek_pts != MP_NOPTS_VALUE && p->current >= 0 &&
+               p->current < p->num_pkts &&
+               p->pkts[p->current]->pts + p->pkts[p->current]->duration <
+                    p->seek_pts)
+            p->current++;
+        dp = demux_packet_list_fill(p->pkts, p->num_pkts, &p->current);
+        if (dp || p->parsed)
+            break;
+        pthread_cond_wait(&p->wakeup, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
     return demuxer_add_packet(demuxer, p->sh, dp);
 }
 
 static void d_seek(struct demuxer *demuxer, float secs, int flags)
 {
     struct priv *p = demuxer->priv;
+    pthread_mutex_lock(&p->lock);
     demux_packet_list_seek(p->pkts, p->num_pkts, &p->current, secs, flags);
+    p->seek_pts = MP_NOPTS_VALUE;
+    if (!p->parsed && (flags & SEEK_ABSOLUTE) && !(flags & SEEK_FACTOR))
+        p->seek_pts = secs;
+    pthread_mutex_unlock(&p->lock);
 }
 
 static int d_control(struct demuxer *demuxer, int cmd, void *arg)
@@ -1391,13 +1620,30 @@ static int d_control(struct demuxer *demuxer, int cmd, void *arg)
     struct priv *p = demuxer->priv;
     switch (cmd) {
     case DEMUXER_CTRL_GET_TIME_LENGTH:
+        pthread_mutex_lock(&p->lock);
         *((double *) arg) = demux_packet_list_duration(p->pkts, p->num_pkts);
+        pthread_mutex_unlock(&p->lock);
         return DEMUXER_CTRL_OK;
     default:
         return DEMUXER_CTRL_NOTIMPL;
     }
 }
 
+static void d_close(struct demuxer *demuxer)
+{
+    struct priv *p = demuxer->priv;
+    if (!p)
+        return;
+    if (p->thread_valid) {
+        pthread_mutex_lock(&p->lock);
+        p->cancel = true;
+        pthread_mutex_unlock(&p->lock);
+        pthread_join(p->thread, NULL);
+    }
+    pthread_cond_destroy(&p->wakeup);
+    pthread_mutex_destroy(&p->lock);
+}
+
 const struct demuxer_desc demuxer_desc_subreader = {
     .name = "subreader",
     .desc = "Deprecated MPlayer subreader",
@@ -1405,4 +1651,5 @@ const struct demuxer_desc demuxer_desc_subreader = {
     .fill_buffer = d_fill_buffer,
     .seek = d_seek,
     .control = d_control,
+    .close = d_close,
 };
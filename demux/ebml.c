@@ -27,6 +27,7 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 
 #include <libavutil/intfloat.h>
@@ -341,6 +342,76 @@ static int64_t ebml_parse_sint(uint8_t *data, int length)
     return r;
 }
 
+// The parse functions above read up to 8 bytes without checking the length.
+// Return a pointer to the start of buffer that is safe to use with them.
+static uint8_t *safe_bytes(bstr *buffer, uint8_t tmp[8])
+{
+    if (buffer->len >= 8)
+        return buffer->start;
+    memset(tmp, 0, 8);
+    memcpy(tmp, buffer->start, buffer->len);
+    return tmp;
+}
+
+/*
+ * Read an element ID from memory, and skip it.
+ * The following functions leave buffer untouched on error.
+ */
+uint32_t ebml_bstr_read_id(bstr *buffer)
+{
+    uint8_t tmp[8];
+    int len;
+    if (!buffer->len)
+        return EBML_ID_INVALID;
+    uint32_t id = ebml_parse_id(safe_bytes(buffer, tmp), &len);
+    if (len < 0 || len > buffer->len)
+        return EBML_ID_INVALID;
+    *buffer = bstr_cut(*buffer, len);
+    return id;
+}
+
+/*
+ * Read an element content length from memory, and skip it.
+ */
+uint64_t ebml_bstr_read_length(bstr *buffer)
+{
+    uint8_t tmp[8];
+    int len;
+    if (!buffer->len)
+        return EBML_UINT_INVALID;
+    uint64_t length = ebml_parse_length(safe_bytes(buffer, tmp), &len);
+    if (len < 0 || len > buffer->len)
+        return EBML_UINT_INVALID;
+    *buffer = bstr_cut(*buffer, len);
+    return length;
+}
+
+/*
+ * Read the element content (after the ID) as unsigned int from memory.
+ */
+uint64_t ebml_bstr_read_uint(bstr *buffer)
+{
+    bstr b = *buffer;
+    uint64_t len = ebml_bstr_read_length(&b);
+    if (len == EBML_UINT_INVALID || len < 1 || len > 8 || len > b.len)
+        return EBML_UINT_INVALID;
+    *buffer = bstr_cut(b, len);
+    return ebml_parse_uint(b.start, len);
+}
+
+/*
+ * Read the element content (after the ID) as signed int from memory.
+ */
+int64_t ebml_bstr_read_int(bstr *buffer)
+{
+    bstr b = *buffer;
+    uint64_t len = ebml_bstr_read_length(&b);
+    if (len == EBML_UINT_INVALID || len < 1 || len > 8 || len > b.len)
+        return EBML_INT_INVALID;
+    *buffer = bstr_cut(b, len);
+    return ebml_parse_sint(b.start, len);
+}
+
 static double ebml_parse_float(uint8_t *data, int length)
 {
     assert(length == 4 || length == 8);
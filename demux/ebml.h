@@ -101,6 +101,11 @@ int64_t ebml_read_int (stream_t *s);
 int ebml_read_skip(struct mp_log *log, int64_t end, stream_t *s);
 int ebml_resync_cluster(struct mp_log *log, stream_t *s);
 
+uint32_t ebml_bstr_read_id(bstr *buffer);
+uint64_t ebml_bstr_read_length(bstr *buffer);
+uint64_t ebml_bstr_read_uint(bstr *buffer);
+int64_t ebml_bstr_read_int(bstr *buffer);
+
 int ebml_read_element(struct stream *s, struct ebml_parse_ctx *ctx,
                       void *target, const struct ebml_elem_desc *desc);
 
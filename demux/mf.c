@@ -36,6 +36,7 @@
 
 double mf_fps = 1.0;
 char *mf_type = NULL;  //"jpg";
+int mf_prefetch = 4;
 
 static void mf_add(mf_t *mf, const char *fname)
 {
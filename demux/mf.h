@@ -23,6 +23,7 @@ struct mp_log;
 
 extern double mf_fps;
 extern char * mf_type;
+extern int mf_prefetch;
 
 typedef struct mf {
     struct mp_log *log;
@@ -32,6 +33,7 @@ typedef struct mf {
     char **names;
     // optional
     struct stream **streams;
+    struct mf_prefetch *prefetch;
 } mf_t;
 
 mf_t *open_mf_pattern(void *talloc_ctx, struct mp_log *log, char *filename);
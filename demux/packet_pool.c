@@ -0,0 +1,207 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "common/common.h"
+#include "compat/atomics.h"
+#include "packet_pool.h"
+
+// Smallest class is MIN_SIZE bytes (including header), each following class
+// doubles the size. Larger buffers are not pooled.
+#define MIN_SIZE_SHIFT 8
+#define NUM_CLASSES 15      // up to 4 MiB
+
+// Don't keep more than this many bytes in the free lists.
+#define MAX_CACHED_BYTES (32 * 1024 * 1024)
+
+// Put in front of each buffer. Sized to keep the data 16 byte aligned.
+struct buffer_header {
+    struct demux_packet_pool *pool; // NULL if not pooled
+    int size_class;
+    int refcount;                   // atomic
+    size_t size;                    // usable bytes after the header
+};
+
+#define HEADER_SIZE MP_ALIGN_UP(sizeof(struct buffer_header), 16)
+
+// Overlaid on the data of unused buffers.
+struct free_buffer {
+    struct free_buffer *next;
+};
+
+struct demux_packet_pool {
+    pthread_mutex_t lock;
+    int refcount;
+    struct free_buffer *free_list[NUM_CLASSES];
+    size_t cached_bytes;
+};
+
+// Number of malloc() calls made for packet buffers (by all pools).
+static uint64_t num_mallocs;
+
+struct demux_packet_pool *demux_packet_pool_create(void)
+{
+    struct demux_packet_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->refcount = 1;
+    return pool;
+}
+
+static void destroy_pool(struct demux_packet_pool *pool)
+{
+    for (int n = 0; n < NUM_CLASSES; n++) {
+        struct free_buffer *b = pool->free_list[n];
+        while (b) {
+            struct free_buffer *next = b->next;
+            free((char *)b - HEADER_SIZE);
+            b = next;
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void demux_packet_pool_unref(struct demux_packet_pool *pool)
+{
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    assert(pool->refcount > 0);
+    bool destroy = --pool->refcount == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (destroy)
+        destroy_pool(pool);
+}
+
+static size_t class_size(int size_class)
+{
+    return (size_t)1 << (MIN_SIZE_SHIFT + size_class);
+}
+
+void *demux_packet_pool_alloc(struct demux_packet_pool *pool, size_t size)
+{
+    if (size > SIZE_MAX - HEADER_SIZE)
+        return NULL;
+
+    int size_class = 0;
+    while (size_class < NUM_CLASSES && class_size(size_class) < size + HEADER_SIZE)
+        size_class++;
+    if (size_class == NUM_CLASSES)
+        pool = NULL;
+
+    size_t alloc_size = pool ? class_size(size_class) : size + HEADER_SIZE;
+    struct free_buffer *b = NULL;
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        b = pool->free_list[size_class];
+        if (b) {
+            pool->free_list[size_class] = b->next;
+            pool->cached_bytes -= alloc_size;
+        }
+        pool->refcount++;
+        pthread_mutex_unlock(&pool->lock);
+        if (b) {
+            struct buffer_header *h = (void *)((char *)b - HEADER_SIZE);
+            h->refcount = 1;
+            return b;
+        }
+    }
+
+    mp_atomic_add_and_fetch(&num_mallocs, 1);
+    char *mem = malloc(alloc_size);
+    if (!mem) {
+        demux_packet_pool_unref(pool);
+        return NULL;
+    }
+    struct buffer_header *h = (void *)mem;
+    *h = (struct buffer_header){
+        .pool = pool,
+        .size_class = pool ? size_class : -1,
+        .refcount = 1,
+        .size = alloc_size - HEADER_SIZE,
+    };
+    return mem + HEADER_SIZE;
+}
+
+void demux_packet_pool_free(void *buf)
+{
+    if (!buf)
+        return;
+    char *mem = (char *)buf - HEADER_SIZE;
+    struct buffer_header *h = (void *)mem;
+    if (mp_atomic_add_and_fetch(&h->refcount, -1) > 0)
+        return;
+    struct demux_packet_pool *pool = h->pool;
+    if (!pool) {
+        free(mem);
+        return;
+    }
+    size_t alloc_size = class_size(h->size_class);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->cached_bytes + alloc_size <= MAX_CACHED_BYTES) {
+        struct free_buffer *b = buf;
+        b->next = pool->free_list[h->size_class];
+        pool->free_list[h->size_class] = b;
+        pool->cached_bytes += alloc_size;
+        mem = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(mem);
+    demux_packet_pool_unref(pool);
+}
+
+void demux_packet_pool_ref(void *buf)
+{
+    struct buffer_header *h = (void *)((char *)buf - HEADER_SIZE);
+    mp_atomic_add_and_fetch(&h->refcount, 1);
+}
+
+void *demux_packet_pool_realloc(void *buf, size_t size)
+{
+    if (!buf)
+        return demux_packet_pool_alloc(NULL, size);
+    struct buffer_header *h = (void *)((char *)buf - HEADER_SIZE);
+    assert(h->refcount == 1); // shared buffers are immutable
+    if (size <= h->size)
+        return buf;
+    struct demux_packet_pool *pool = h->pool;
+    void *new = demux_packet_pool_alloc(pool, size);
+    if (!new)
+        return NULL;
+    memcpy(new, buf, h->size);
+    demux_packet_pool_free(buf);
+    return new;
+}
+
+size_t demux_packet_pool_size(void *buf)
+{
+    struct buffer_header *h = (void *)((char *)buf - HEADER_SIZE);
+    return h->size;
+}
+
+uint64_t demux_packet_pool_num_mallocs(void)
+{
+    return mp_atomic_add_and_fetch(&num_mallocs, 0);
+}
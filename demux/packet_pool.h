@@ -0,0 +1,59 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_DEMUX_PACKET_POOL_H
+#define MP_DEMUX_PACKET_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Recycles packet payload buffers in power-of-two size classes. Buffers are
+// refcounted, and can be returned from any thread. The pool is refcounted: each buffer holds a
+// reference, so the owner can drop its reference while packets are still in
+// use by decoders.
+struct demux_packet_pool;
+
+struct demux_packet_pool *demux_packet_pool_create(void);
+void demux_packet_pool_unref(struct demux_packet_pool *pool);
+
+// Allocate a buffer with at least size bytes. pool can be NULL, in which case
+// this is a plain malloc() (but the buffer still must be freed with
+// demux_packet_pool_free()). Returns NULL on OOM.
+void *demux_packet_pool_alloc(struct demux_packet_pool *pool, size_t size);
+
+// Resize the buffer, preserving its contents, like realloc(). If the buffer is
+// large enough, it is returned as is; otherwise a new buffer is allocated from
+// the same pool. On OOM, returns NULL and leaves buf untouched.
+void *demux_packet_pool_realloc(void *buf, size_t size);
+
+// Drop a reference. If it was the last one, return the buffer to the pool
+// it was allocated from (or free it).
+void demux_packet_pool_free(void *buf);
+
+// Add a reference, so that the buffer can be shared by several packets.
+// Buffers with more than one reference must not be written to.
+void demux_packet_pool_ref(void *buf);
+
+// Number of bytes usable in buf (can be more than requested).
+size_t demux_packet_pool_size(void *buf);
+
+// Total number of buffers that had to be allocated with malloc() so far, i.e.
+// allocations that were not served from a free list. Process-wide; used for
+// benchmarking.
+uint64_t demux_packet_pool_num_mallocs(void);
+
+#endif
@@ -92,6 +92,8 @@ typedef struct sh_sub {
     double frame_based;         // timestamps are frame-based (and this is the
                                 // fallback framerate used for timestamps)
     bool is_utf8;               // if false, subtitle packet charset is unknown
+    bool streaming;             // packets are parsed in the background; better
+                                // read them as needed than all at once
     struct dec_sub *dec_sub;    // decoder context
 } sh_sub_t;
 
@@ -179,6 +179,10 @@ struct m_sub_property {
     .type = CONF_TYPE_STRING, .value = {.string = (char *)(s)}
 #define SUB_PROP_FLOAT(f) \
     .type = CONF_TYPE_FLOAT, .value = {.float_ = (f)}
+#define SUB_PROP_DOUBLE(f) \
+    .type = CONF_TYPE_DOUBLE, .value = {.double_ = (f)}
+#define SUB_PROP_INT64(i) \
+    .type = CONF_TYPE_INT64, .value = {.int64 = (i)}
 #define SUB_PROP_FLAG(f) \
     .type = CONF_TYPE_FLAG, .value = {.flag = (f)}
 
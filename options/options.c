@@ -34,6 +34,7 @@
 #include "common/common.h"
 #include "stream/stream.h"
 #include "stream/tv.h"
+#include "demux/demux.h"
 #include "video/csputils.h"
 #include "sub/osd.h"
 #include "audio/mixer.h"
@@ -157,6 +158,7 @@ static const m_option_t scaler_filter_conf[]={
 
 extern double mf_fps;
 extern char * mf_type;
+extern int mf_prefetch;
 extern const struct m_obj_list vf_obj_list;
 extern const struct m_obj_list af_obj_list;
 extern const struct m_obj_list vo_obj_list;
@@ -165,6 +167,7 @@ extern const struct m_obj_list ao_obj_list;
 static const m_option_t mfopts_conf[]={
     {"fps", &mf_fps, CONF_TYPE_DOUBLE, 0, 0, 0, NULL},
     {"type", &mf_type, CONF_TYPE_STRING, 0, 0, 0, NULL},
+    {"prefetch", &mf_prefetch, CONF_TYPE_INT, CONF_RANGE, 0, 64, NULL},
     {NULL, NULL, 0, 0, 0, 0, NULL}
 };
 
@@ -251,6 +254,16 @@ const m_option_t mp_opts[] = {
                    0, 99),
     OPT_CHOICE_OR_INT("cache-pause", stream_cache_pause, 0,
                       0, 40, ({"no", -1})),
+    OPT_INTRANGE("cache-max-ranges", stream_cache_max_ranges, 0, 0, 64),
+    OPT_STRING("cache-file", stream_cache_file, 0),
+    OPT_INTRANGE("cache-file-size", stream_cache_file_size, 0, 0, 0x7fffffff),
+    OPT_STRING("cache-dir", stream_cache_dir, 0),
+    OPT_INTRANGE("cache-dir-size", stream_cache_dir_size, 0, 0, 0x7fffffff),
+    OPT_FLAG("stream-mmap", stream_mmap, 0),
+    OPT_CHOICE_OR_INT("stream-readahead", stream_readahead, 0, 1, 64,
+                      ({"no", 0},
+                       {"auto", -1})),
+    OPT_INTRANGE("stream-buffer-size", stream_buffer_size, 0, 2, 2048),
 
     {"cdrom-device", &cdrom_device, CONF_TYPE_STRING, 0, 0, 0, NULL},
 #if HAVE_DVDREAD || HAVE_DVDNAV
@@ -324,6 +337,12 @@ const m_option_t mp_opts[] = {
     OPT_STRING("demuxer", demuxer_name, 0),
     OPT_STRING("audio-demuxer", audio_demuxer_name, 0),
     OPT_STRING("sub-demuxer", sub_demuxer_name, 0),
+    OPT_FLAG("demuxer-thread", demuxer_thread, 0),
+    OPT_FLAG("demuxer-benchmark", demuxer_benchmark, 0),
+    OPT_INTRANGE("demuxer-benchmark-seeks", demuxer_benchmark_seeks, 0, 0, 1000000),
+    OPT_INTRANGE("demuxer-readahead-packets", demuxer_min_packs, 0, 0, 1000000),
+    OPT_INTRANGE("demuxer-queue-size", demuxer_queue_size, 0, 1, 0x7fffffff / 1024),
+    OPT_INTRANGE("demuxer-queue-packets", demuxer_queue_packets, 0, 1, 0x7fffffff),
 
     {"mf", (void *) mfopts_conf, CONF_TYPE_SUBCONFIG, 0,0,0, NULL},
 #if HAVE_TV
@@ -399,6 +418,8 @@ const m_option_t mp_opts[] = {
 
     OPT_FLAG("demuxer-mkv-subtitle-preroll", mkv_subtitle_preroll, 0),
     OPT_FLAG("mkv-subtitle-preroll", mkv_subtitle_preroll, 0), // old alias
+    OPT_STRING("demuxer-mkv-index-dir", mkv_index_dir, 0),
+    OPT_FLAG("demuxer-mkv-index-background", mkv_index_background, 0),
 
 // ------------------------- subtitles options --------------------
 
@@ -413,6 +434,7 @@ const m_option_t mp_opts[] = {
     OPT_FLAG("sub-forced-only", forced_subs_only, 0),
     OPT_FLAG("stretch-dvd-subs", stretch_dvd_subs, 0),
     OPT_FLAG_CONSTANTS("sub-fix-timing", suboverlap_enabled, 0, 1, 0),
+    OPT_INTRANGE("sub-stream-size", sub_stream_size, 0, 0, 0x7fffffff / 1024),
     OPT_CHOICE("autosub-match", sub_match_fuzziness, 0,
                ({"exact", 0}, {"fuzzy", 1}, {"all", 2})),
     OPT_INTRANGE("sub-pos", sub_pos, 0, 0, 100),
@@ -568,6 +590,7 @@ const m_option_t mp_opts[] = {
     OPT_FLAG("ordered-chapters", ordered_chapters, 0),
     OPT_STRING("ordered-chapters-files", ordered_chapters_files, 0),
     OPT_INTRANGE("chapter-merge-threshold", chapter_merge_threshold, 0, 0, 10000),
+    OPT_INTRANGE("timeline-max-sources", timeline_max_sources, 0, 0, 10000),
 
     OPT_DOUBLE("chapter-seek-threshold", chapter_seek_threshold, 0),
 
@@ -695,6 +718,15 @@ const struct MPOpts mp_default_opts = {
     .stream_cache_min_percent = 20.0,
     .stream_cache_seek_min_percent = 50.0,
     .stream_cache_pause = 10.0,
+    .stream_cache_file_size = 1024 * 1024,
+    .stream_cache_dir_size = 4096,
+    .stream_readahead = -1,
+    .demuxer_min_packs = 300,
+    .demuxer_queue_size = 256,
+    .demuxer_queue_packets = 16384,
+    .demuxer_benchmark_seeks = 100,
+    .sub_stream_size = 4096,
+    .stream_buffer_size = 32,
     .network_rtsp_transport = 2,
     .chapterrange = {-1, -1},
     .edition_id = -1,
@@ -105,6 +105,7 @@ typedef struct MPOpts {
     int ordered_chapters;
     char *ordered_chapters_files;
     int chapter_merge_threshold;
+    int timeline_max_sources;
     double chapter_seek_threshold;
     int load_unsafe_playlists;
     int merge_files;
@@ -118,6 +119,14 @@ typedef struct MPOpts {
     float stream_cache_seek_min_percent;
     int network_rtsp_transport;
     int stream_cache_pause;
+    int stream_cache_max_ranges;
+    char *stream_cache_file;
+    int stream_cache_file_size;
+    char *stream_cache_dir;
+    int stream_cache_dir_size;
+    int stream_mmap;
+    int stream_readahead;
+    int stream_buffer_size;
     int chapterrange[2];
     int edition_id;
     int correct_pts;
@@ -171,6 +180,7 @@ typedef struct MPOpts {
     // subreader.c
     int suboverlap_enabled;
     char *sub_cp;
+    int sub_stream_size;
 
     char *audio_stream;
     int audio_stream_cache;
@@ -178,6 +188,14 @@ typedef struct MPOpts {
     char *audio_demuxer_name;
     char *sub_demuxer_name;
     int mkv_subtitle_preroll;
+    char *mkv_index_dir;
+    int mkv_index_background;
+    int demuxer_thread;
+    int demuxer_benchmark;
+    int demuxer_benchmark_seeks;
+    int demuxer_min_packs;
+    int demuxer_queue_size;
+    int demuxer_queue_packets;
 
     struct image_writer_opts *screenshot_image_opts;
     char *screenshot_template;
@@ -264,6 +282,8 @@ typedef struct MPOpts {
         char *cryptokey;
         char *avopt;
         int genptsmode;
+        int index;
+        char *index_dir;
     } lavfdopts;
 
     struct input_conf {
@@ -33,6 +33,8 @@
 #include <unistd.h>
 #include <errno.h>
 
+#include <libavutil/md5.h>
+
 #include "config.h"
 
 #include "common/global.h"
@@ -292,3 +294,49 @@ void mp_mk_config_dir(struct mpv_global *global, char *subdir)
     }
     talloc_free(tmp);
 }
+
+char *mp_path_hash_name(void *talloc_ctx, const void *data, size_t len)
+{
+    uint8_t md5[16];
+    av_md5_sum(md5, data, len);
+    char *name = talloc_strdup(talloc_ctx, "");
+    for (int i = 0; i < 16; i++)
+        name = talloc_asprintf_append(name, "%02X", md5[i]);
+    return name;
+}
+
+bool mp_path_ensure_dir(const char *path)
+{
+    if (!mp_path_isdir(path))
+        mkdir(path, 0700);
+    return mp_path_isdir(path);
+}
+
+static char *atomic_tmp_path(const char *path)
+{
+    return talloc_asprintf(NULL, "%s.tmp", path);
+}
+
+FILE *mp_open_file_atomic(const char *path)
+{
+    char *tmp_path = atomic_tmp_path(path);
+    FILE *f = fopen(tmp_path, "wb");
+    talloc_free(tmp_path);
+    return f;
+}
+
+bool mp_commit_file_atomic(FILE *f, const char *path, bool ok)
+{
+    char *tmp_path = atomic_tmp_path(path);
+    ok &= !ferror(f);
+    ok &= fclose(f) == 0;
+    if (ok) {
+        // On Windows, rename() doesn't replace existing files.
+        unlink(path);
+        ok = rename(tmp_path, path) == 0;
+    }
+    if (!ok)
+        unlink(tmp_path);
+    talloc_free(tmp_path);
+    return ok;
+}
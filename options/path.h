@@ -21,6 +21,7 @@
 #ifndef MPLAYER_PATH_H
 #define MPLAYER_PATH_H
 
+#include <stdio.h>
 #include <stdbool.h>
 #include "bstr/bstr.h"
 
@@ -79,4 +80,21 @@ bstr mp_split_proto(bstr path, bstr *out_url);
 
 void mp_mk_config_dir(struct mpv_global *global, char *subdir);
 
+// Return the MD5 hash of data as hex string, for use as file name.
+char *mp_path_hash_name(void *talloc_ctx, const void *data, size_t len);
+
+// Create the directory if it doesn't exist (parent directories must exist).
+// Returns whether the directory exists now.
+bool mp_path_ensure_dir(const char *path);
+
+// Open a temporary file for writing, which mp_commit_file_atomic() moves to
+// path. This way, a crash while writing doesn't leave behind a partially
+// written file at path. Returns NULL on error (errno is set).
+FILE *mp_open_file_atomic(const char *path);
+
+// Close f (as returned by mp_open_file_atomic()). If ok is set and there were
+// no write errors, replace path with it, otherwise remove it. Returns whether
+// path was written.
+bool mp_commit_file_atomic(FILE *f, const char *path, bool ok);
+
 #endif /* MPLAYER_PATH_H */
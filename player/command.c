@@ -1041,6 +1041,101 @@ static int mp_property_cache_size(m_option_t *prop, int action, void *arg,
     return M_PROPERTY_NOT_IMPLEMENTED;
 }
 
+static int mp_property_cache_speed(m_option_t *prop, int action, void *arg,
+                                   MPContext *mpctx)
+{
+    int64_t speed = mp_get_cache_speed(mpctx);
+    if (speed < 0)
+        return M_PROPERTY_UNAVAILABLE;
+    if (action == M_PROPERTY_PRINT) {
+        *(char **)arg = talloc_asprintf(NULL, "%.1f KiB/s", speed / 1024.0);
+        return M_PROPERTY_OK;
+    }
+    return m_property_int64_ro(prop, action, arg, speed);
+}
+
+static int mp_property_cache_duration(m_option_t *prop, int action, void *arg,
+                                      MPContext *mpctx)
+{
+    double duration = mp_get_cache_duration(mpctx);
+    if (duration < 0)
+        return M_PROPERTY_UNAVAILABLE;
+    return m_property_double_ro(prop, action, arg, duration);
+}
+
+static int mp_property_cache_stats(m_option_t *prop, int action, void *arg,
+                                   MPContext *mpctx)
+{
+    struct stream_cache_stats st;
+    if (!mpctx->stream ||
+        stream_control(mpctx->stream, STREAM_CTRL_GET_CACHE_STATS, &st)
+            != STREAM_OK)
+        return M_PROPERTY_UNAVAILABLE;
+    int64_t *lat = st.read_latency;
+    struct m_sub_property props[] = {
+        {"read-bytes",          SUB_PROP_INT64(st.read_bytes)},
+        {"file-bytes",          SUB_PROP_INT64(st.file_bytes)},
+        {"range-bytes",         SUB_PROP_INT64(st.range_bytes)},
+        {"served-bytes",        SUB_PROP_INT64(st.served_bytes)},
+        {"reads",               SUB_PROP_INT64(st.reads)},
+        {"reads-under-1ms",     SUB_PROP_INT64(lat[0])},
+        {"reads-under-4ms",     SUB_PROP_INT64(lat[1])},
+        {"reads-under-16ms",    SUB_PROP_INT64(lat[2])},
+        {"reads-under-64ms",    SUB_PROP_INT64(lat[3])},
+        {"reads-under-256ms",   SUB_PROP_INT64(lat[4])},
+        {"reads-under-1024ms",  SUB_PROP_INT64(lat[5])},
+        {"reads-over-1024ms",   SUB_PROP_INT64(lat[6])},
+        {"drops-seek",          SUB_PROP_INT64(st.drops_seek)},
+        {"drops-control",       SUB_PROP_INT64(st.drops_control)},
+        {"wait-time",           SUB_PROP_DOUBLE(st.wait_time)},
+        {"controls",            SUB_PROP_INT64(st.controls)},
+        {"control-time",        SUB_PROP_DOUBLE(st.control_time)},
+        {"control-time-max",    SUB_PROP_DOUBLE(st.control_time_max)},
+        {0}
+    };
+    return m_property_read_sub(props, action, arg);
+}
+
+static int get_cache_range_entry(int item, int action, void *arg, void *ctx)
+{
+    struct stream_cache_ranges *list = ctx;
+    struct stream_range *r = &list->ranges[item];
+    struct m_sub_property props[] = {
+        {"start",       CONF_TYPE_INT64, {.int64 = r->start}},
+        {"end",         CONF_TYPE_INT64, {.int64 = r->end}},
+        {0}
+    };
+
+    return m_property_read_sub(props, action, arg);
+}
+
+static int mp_property_cache_ranges(m_option_t *prop, int action, void *arg,
+                                    MPContext *mpctx)
+{
+    if (!mpctx->stream)
+        return M_PROPERTY_UNAVAILABLE;
+    struct stream_cache_ranges list = {0};
+    if (stream_control(mpctx->stream, STREAM_CTRL_GET_CACHE_RANGES, &list)
+            != STREAM_OK)
+        return M_PROPERTY_UNAVAILABLE;
+    int r;
+    if (action == M_PROPERTY_PRINT) {
+        char *res = talloc_strdup(NULL, "");
+        for (int n = 0; n < list.num_ranges; n++) {
+            res = talloc_asprintf_append(res, "%"PRId64"-%"PRId64"\n",
+                                         list.ranges[n].start,
+                                         list.ranges[n].end);
+        }
+        *(char **)arg = res;
+        r = M_PROPERTY_OK;
+    } else {
+        r = m_property_read_list(action, arg, list.num_ranges,
+                                 get_cache_range_entry, &list);
+    }
+    talloc_free(list.ranges);
+    return r;
+}
+
 static int mp_property_paused_for_cache(m_option_t *prop, int action, void *arg,
                             MPContext *mpctx)
 {
@@ -1339,6 +1434,11 @@ static int get_track_entry(int item, int action, void *arg, void *ctx)
 
     const char *codec = track->stream ? track->stream->codec : NULL;
 
+    int queued_packets = 0;
+    int64_t queued_bytes = 0;
+    if (track->stream)
+        demux_get_queue_size(track->stream, &queued_packets, &queued_bytes);
+
     struct m_sub_property props[] = {
         {"id",          SUB_PROP_INT(track->user_tid)},
         {"type",        SUB_PROP_STR(stream_type_name(track->type)),
@@ -1357,6 +1457,10 @@ static int get_track_entry(int item, int action, void *arg, void *ctx)
                         .unavailable = !track->external_filename},
         {"codec",       SUB_PROP_STR(codec),
                         .unavailable = !codec},
+        {"demux-queued-packets", SUB_PROP_INT(queued_packets),
+                        .unavailable = !track->stream},
+        {"demux-queued-bytes", SUB_PROP_INT64(queued_bytes),
+                        .unavailable = !track->stream},
         {0}
     };
 
@@ -2302,6 +2406,10 @@ static const m_option_t mp_properties[] = {
       M_OPT_RANGE, 0, 1, NULL },
     { "cache", mp_property_cache, CONF_TYPE_INT },
     { "cache-size", mp_property_cache_size, CONF_TYPE_INT, M_OPT_MIN, 0 },
+    M_PROPERTY("cache-ranges", mp_property_cache_ranges),
+    { "cache-speed", mp_property_cache_speed, CONF_TYPE_INT64 },
+    { "cache-duration", mp_property_cache_duration, CONF_TYPE_TIME },
+    M_PROPERTY("cache-stats", mp_property_cache_stats),
     { "paused-for-cache", mp_property_paused_for_cache, CONF_TYPE_FLAG,
       M_OPT_RANGE, 0, 1, NULL },
     M_OPTION_PROPERTY("pts-association-mode"),
@@ -66,7 +66,11 @@ enum exit_reason {
 struct timeline_part {
     double start;
     double source_start;
-    struct demuxer *source;
+    struct demuxer *source;     // NULL if not open (see source_url)
+    // If set, the source can be opened on demand and closed again
+    // (--timeline-max-sources).
+    char *source_url;
+    char *source_demuxer;       // forced demuxer for source_url, or NULL
 };
 
 struct chapter {
@@ -185,10 +189,16 @@ typedef struct MPContext {
 
     struct demuxer **sources;
     int num_sources;
+    // Used by ordered chapters (tl_matroska.c)
+    struct segment_uid_cache *segment_uid_cache;
 
     struct timeline_part *timeline;
     int num_timeline_parts;
     int timeline_part;
+    // Timeline sources which can be closed, least recently used first.
+    struct demuxer **timeline_lru;
+    int num_timeline_lru;
+    struct timeline_prefetch *timeline_prefetch;
     struct chapter *chapters;
     int num_chapters;
     double video_offset;
@@ -415,6 +425,9 @@ double get_relative_time(struct MPContext *mpctx);
 void merge_playlist_files(struct playlist *pl);
 int mp_get_cache_percent(struct MPContext *mpctx);
 bool mp_get_cache_idle(struct MPContext *mpctx);
+int64_t mp_get_cache_speed(struct MPContext *mpctx);
+double mp_get_stream_bitrate(struct MPContext *mpctx);
+double mp_get_cache_duration(struct MPContext *mpctx);
 void update_window_title(struct MPContext *mpctx, bool force);
 void stream_dump(struct MPContext *mpctx);
 
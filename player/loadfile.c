@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <libavutil/avutil.h>
 
@@ -74,6 +75,119 @@ static void uninit_sub(struct MPContext *mpctx, int order)
     reselect_demux_streams(mpctx);
 }
 
+// Opening the source of the next timeline part in the background
+// (--timeline-max-sources).
+struct timeline_prefetch {
+    struct mpv_global *global;
+    pthread_t thread;
+    const char *url;            // owned by the timeline
+    char *demuxer_name;         // owned by the timeline
+    int cache_size, cache_def_size;
+    float cache_min_percent, cache_seek_min_percent;
+    struct demuxer *result;
+};
+
+static struct demuxer *open_timeline_source(struct timeline_prefetch *pf)
+{
+    struct stream *s = stream_open(pf->url, pf->global);
+    if (!s)
+        return NULL;
+    stream_enable_cache_percent(&s, pf->cache_size, pf->cache_def_size,
+                                pf->cache_min_percent,
+                                pf->cache_seek_min_percent);
+    struct demuxer *d = demux_open(s, pf->demuxer_name, NULL, pf->global);
+    if (!d)
+        free_stream(s);
+    return d;
+}
+
+static void init_timeline_prefetch(struct MPContext *mpctx,
+                                   struct timeline_prefetch *pf,
+                                   struct timeline_part *p)
+{
+    struct MPOpts *opts = mpctx->opts;
+    *pf = (struct timeline_prefetch){
+        .global = mpctx->global,
+        .url = p->source_url,
+        .demuxer_name = p->source_demuxer,
+        .cache_size = opts->stream_cache_size,
+        .cache_def_size = opts->stream_cache_def_size,
+        .cache_min_percent = opts->stream_cache_min_percent,
+        .cache_seek_min_percent = opts->stream_cache_seek_min_percent,
+    };
+}
+
+static void *timeline_prefetch_thread(void *arg)
+{
+    struct timeline_prefetch *pf = arg;
+    pf->result = open_timeline_source(pf);
+    return NULL;
+}
+
+static void close_source(struct demuxer *d)
+{
+    struct stream *stream = d->stream;
+    free_demuxer(d);
+    free_stream(stream);
+}
+
+// Make d the source of all parts with its URL.
+static void add_timeline_source(struct MPContext *mpctx, struct demuxer *d,
+                                const char *url)
+{
+    MP_TARRAY_APPEND(NULL, mpctx->sources, mpctx->num_sources, d);
+    MP_TARRAY_APPEND(NULL, mpctx->timeline_lru, mpctx->num_timeline_lru, d);
+    for (int n = 0; n < mpctx->num_timeline_parts; n++) {
+        struct timeline_part *p = &mpctx->timeline[n];
+        if (!p->source && p->source_url && strcmp(p->source_url, url) == 0)
+            p->source = d;
+    }
+    demux_start_thread(d);
+}
+
+// Wait until the background open is done, and add the source it opened.
+static void finish_timeline_prefetch(struct MPContext *mpctx)
+{
+    struct timeline_prefetch *pf = mpctx->timeline_prefetch;
+    if (!pf)
+        return;
+    pthread_join(pf->thread, NULL);
+    mpctx->timeline_prefetch = NULL;
+    if (pf->result)
+        add_timeline_source(mpctx, pf->result, pf->url);
+    talloc_free(pf);
+}
+
+static void cancel_timeline_prefetch(struct MPContext *mpctx)
+{
+    struct timeline_prefetch *pf = mpctx->timeline_prefetch;
+    if (!pf)
+        return;
+    pthread_join(pf->thread, NULL);
+    mpctx->timeline_prefetch = NULL;
+    if (pf->result)
+        close_source(pf->result);
+    talloc_free(pf);
+}
+
+static void close_timeline_source(struct MPContext *mpctx, struct demuxer *d)
+{
+    MP_VERBOSE(mpctx, "Closing timeline source '%s'.\n", d->filename);
+    // (The terminating entry can reference a source too.)
+    for (int n = 0; n <= mpctx->num_timeline_parts; n++) {
+        if (mpctx->timeline[n].source == d)
+            mpctx->timeline[n].source = NULL;
+    }
+    for (int n = 0; n < mpctx->num_sources; n++) {
+        if (mpctx->sources[n] == d) {
+            MP_TARRAY_REMOVE_AT(mpctx->sources, mpctx->num_sources, n);
+            break;
+        }
+    }
+    uninit_subs(d);
+    close_source(d);
+}
+
 void uninit_player(struct MPContext *mpctx, unsigned int mask)
 {
     struct MPOpts *opts = mpctx->opts;
@@ -134,6 +248,10 @@ void uninit_player(struct MPContext *mpctx, unsigned int mask)
         assert(!mpctx->d_video && !mpctx->d_audio &&
                !mpctx->d_sub[0] && !mpctx->d_sub[1]);
         mpctx->master_demuxer = NULL;
+        cancel_timeline_prefetch(mpctx);
+        talloc_free(mpctx->timeline_lru);
+        mpctx->timeline_lru = NULL;
+        mpctx->num_timeline_lru = 0;
         for (int i = 0; i < mpctx->num_sources; i++) {
             uninit_subs(mpctx->sources[i]);
             struct demuxer *demuxer = mpctx->sources[i];
@@ -324,14 +442,112 @@ static struct sh_stream *select_fallback_stream(struct demuxer *d,
     return best_stream;
 }
 
+// Sources of timeline parts which have a URL are opened when they're needed,
+// and closed in least recently used order if there are more than
+// --timeline-max-sources. Sources which were opened when building the
+// timeline are closed the same way, except the one whose streams were used
+// for the track list.
+static void init_timeline_sources(struct MPContext *mpctx)
+{
+    if (!mpctx->timeline || mpctx->opts->timeline_max_sources <= 0)
+        return;
+    // Sources of earlier parts are used more recently.
+    for (int n = mpctx->num_timeline_parts - 1; n >= 0; n--) {
+        struct demuxer *d = mpctx->timeline[n].source;
+        if (!d || !mpctx->timeline[n].source_url || d == mpctx->demuxer ||
+            d == mpctx->master_demuxer)
+            continue;
+        for (int i = 0; i < mpctx->num_timeline_lru; i++) {
+            if (mpctx->timeline_lru[i] == d) {
+                MP_TARRAY_REMOVE_AT(mpctx->timeline_lru,
+                                    mpctx->num_timeline_lru, i);
+                break;
+            }
+        }
+        MP_TARRAY_APPEND(NULL, mpctx->timeline_lru, mpctx->num_timeline_lru, d);
+    }
+}
+
+// Open the source of part i, if it isn't open yet.
+static bool open_timeline_part(struct MPContext *mpctx, int i)
+{
+    struct timeline_part *p = mpctx->timeline + i;
+    if (p->source)
+        return true;
+    finish_timeline_prefetch(mpctx);
+    if (p->source)
+        return true;
+    MP_VERBOSE(mpctx, "Opening timeline source '%s'.\n", p->source_url);
+    struct timeline_prefetch pf;
+    init_timeline_prefetch(mpctx, &pf, p);
+    struct demuxer *d = open_timeline_source(&pf);
+    if (!d) {
+        MP_ERR(mpctx, "Could not open source '%s'.\n", p->source_url);
+        return false;
+    }
+    add_timeline_source(mpctx, d, p->source_url);
+    return true;
+}
+
+// Called after switching to a timeline part: mark the current source as
+// used, close sources over the limit, and start opening the next part's
+// source in the background.
+static void update_timeline_sources(struct MPContext *mpctx)
+{
+    int max = mpctx->opts->timeline_max_sources;
+    if (max <= 0)
+        return;
+
+    for (int n = 0; n < mpctx->num_timeline_lru; n++) {
+        if (mpctx->timeline_lru[n] == mpctx->demuxer) {
+            MP_TARRAY_REMOVE_AT(mpctx->timeline_lru, mpctx->num_timeline_lru, n);
+            MP_TARRAY_APPEND(NULL, mpctx->timeline_lru, mpctx->num_timeline_lru,
+                             mpctx->demuxer);
+            break;
+        }
+    }
+
+    for (int n = 0; n < mpctx->num_timeline_lru;) {
+        struct demuxer *d = mpctx->timeline_lru[n];
+        if (mpctx->num_timeline_lru <= max)
+            break;
+        if (d == mpctx->demuxer) {
+            n++;
+            continue;
+        }
+        MP_TARRAY_REMOVE_AT(mpctx->timeline_lru, mpctx->num_timeline_lru, n);
+        close_timeline_source(mpctx, d);
+    }
+
+    int next = mpctx->timeline_part + 1;
+    if (mpctx->timeline_prefetch || next >= mpctx->num_timeline_parts)
+        return;
+    struct timeline_part *p = mpctx->timeline + next;
+    if (p->source || !p->source_url)
+        return;
+    struct timeline_prefetch *pf = talloc_ptrtype(NULL, pf);
+    init_timeline_prefetch(mpctx, pf, p);
+    if (pthread_create(&pf->thread, NULL, timeline_prefetch_thread, pf)) {
+        talloc_free(pf);
+        return;
+    }
+    mpctx->timeline_prefetch = pf;
+}
+
 bool timeline_set_part(struct MPContext *mpctx, int i, bool force)
 {
+    if (!open_timeline_part(mpctx, i)) {
+        mpctx->stop_play = AT_END_OF_FILE;
+        return false;
+    }
     struct timeline_part *p = mpctx->timeline + mpctx->timeline_part;
     struct timeline_part *n = mpctx->timeline + i;
     mpctx->timeline_part = i;
     mpctx->video_offset = n->start - n->source_start;
-    if (n->source == p->source && !force)
+    if (n->source == p->source && !force) {
+        update_timeline_sources(mpctx);
         return false;
+    }
     enum stop_play_reason orig_stop_play = mpctx->stop_play;
     if (!mpctx->d_video && mpctx->stop_play == KEEP_PLAYING)
         mpctx->stop_play = AT_END_OF_FILE;  // let audio uninit drain data
@@ -359,6 +575,7 @@ bool timeline_set_part(struct MPContext *mpctx, int i, bool force)
         }
     }
     reselect_demux_streams(mpctx);
+    update_timeline_sources(mpctx);
 
     return true;
 }
@@ -995,7 +1212,8 @@ static void print_timeline(struct MPContext *mpctx)
         for (int i = 0; i < part_count; i++) {
             struct timeline_part *p = mpctx->timeline + i;
             MP_VERBOSE(mpctx, "%3d %9.3f %9.3f %p/%s\n", i, p->start,
-                       p->source_start, p->source, p->source->filename);
+                       p->source_start, p->source,
+                       p->source ? p->source->filename : p->source_url);
         }
         MP_VERBOSE(mpctx, "END %9.3f\n",
                    mpctx->timeline[part_count].start);
@@ -1183,6 +1401,11 @@ goto_reopen_demuxer: ;
 
     mpctx->initialized_flags |= INITIALIZED_DEMUXER;
 
+    if (opts->demuxer_benchmark) {
+        demux_benchmark(mpctx->demuxer, opts->demuxer_benchmark_seeks);
+        goto terminate_playback;
+    }
+
     if (mpctx->demuxer->playlist) {
         if (mpctx->demuxer->stream->safe_origin || opts->load_unsafe_playlists) {
             transfer_playlist(mpctx, mpctx->demuxer->playlist);
@@ -1223,6 +1446,7 @@ goto_reopen_demuxer: ;
     add_dvd_tracks(mpctx);
     add_demuxer_tracks(mpctx, mpctx->demuxer);
 
+    init_timeline_sources(mpctx);
     mpctx->timeline_part = 0;
     if (mpctx->timeline)
         timeline_set_part(mpctx, mpctx->timeline_part, true);
@@ -1267,6 +1491,9 @@ goto_reopen_demuxer: ;
     demux_info_update(mpctx->master_demuxer);
     print_file_properties(mpctx);
 
+    for (int n = 0; n < mpctx->num_sources; n++)
+        demux_start_thread(mpctx->sources[n]);
+
 #if HAVE_ENCODING
     if (mpctx->encode_lavc_ctx && mpctx->current_track[0][STREAM_VIDEO])
         encode_lavc_expect_stream(mpctx->encode_lavc_ctx, AVMEDIA_TYPE_VIDEO);
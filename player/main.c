@@ -54,6 +54,7 @@
 #include "audio/mixer.h"
 #include "demux/demux.h"
 #include "stream/stream.h"
+#include "stream/rar.h"
 #include "sub/ass_mp.h"
 #include "sub/osd.h"
 #include "video/decode/dec_video.h"
@@ -150,6 +151,7 @@ void mp_destroy(struct MPContext *mpctx)
     if (mpctx->opts->use_terminal)
         getch2_disable();
     uninit_libav(mpctx->global);
+    RarUninit();
 
     mp_msg_uninit(mpctx->global);
     talloc_free(mpctx);
@@ -135,6 +135,42 @@ bool mp_get_cache_idle(struct MPContext *mpctx)
     return idle;
 }
 
+// Speed at which the cache reads the stream in bytes/second, or -1 if unknown.
+int64_t mp_get_cache_speed(struct MPContext *mpctx)
+{
+    int64_t speed = -1;
+    if (mpctx->stream)
+        stream_control(mpctx->stream, STREAM_CTRL_GET_CACHE_SPEED, &speed);
+    return speed;
+}
+
+// Average bitrate of the main file in bytes/second, or -1 if unknown.
+double mp_get_stream_bitrate(struct MPContext *mpctx)
+{
+    if (!mpctx->stream || !mpctx->master_demuxer)
+        return -1;
+    int64_t size = -1;
+    demux_stream_control(mpctx->master_demuxer, STREAM_CTRL_GET_SIZE, &size);
+    double len = demuxer_get_time_length(mpctx->master_demuxer);
+    if (size <= 0 || len <= 0)
+        return -1;
+    return size / len;
+}
+
+// Estimated duration of the media data in the cache (ahead of the current
+// read position) in seconds, or -1 if unknown.
+double mp_get_cache_duration(struct MPContext *mpctx)
+{
+    double rate = mp_get_stream_bitrate(mpctx);
+    int64_t fill = -1;
+    if (rate <= 0)
+        return -1;
+    stream_control(mpctx->stream, STREAM_CTRL_GET_CACHE_FILL, &fill);
+    if (fill < 0)
+        return -1;
+    return fill / rate;
+}
+
 void update_window_title(struct MPContext *mpctx, bool force)
 {
     if (!mpctx->video_out && !mpctx->ao) {
@@ -654,14 +654,21 @@ static void handle_pause_on_low_cache(struct MPContext *mpctx)
     struct MPOpts *opts = mpctx->opts;
     int cache = mp_get_cache_percent(mpctx);
     bool idle = mp_get_cache_idle(mpctx);
+    // If the stream is read clearly faster than it's played, and a few seconds
+    // are buffered, the cache won't run dry - no need to wait for the fill
+    // percentage to catch up.
+    bool fast = false;
+    double rate = cache >= 0 ? mp_get_stream_bitrate(mpctx) : -1;
+    if (rate > 0 && mp_get_cache_duration(mpctx) >= 2.0)
+        fast = mp_get_cache_speed(mpctx) > rate * 1.5;
     if (mpctx->paused && mpctx->paused_for_cache) {
-        if (cache < 0 || cache >= opts->stream_cache_min_percent || idle) {
+        if (cache < 0 || cache >= opts->stream_cache_min_percent || idle || fast) {
             mpctx->paused_for_cache = false;
             if (!opts->pause)
                 unpause_player(mpctx);
         }
     } else {
-        if (cache >= 0 && cache <= opts->stream_cache_pause && !idle &&
+        if (cache >= 0 && cache <= opts->stream_cache_pause && !idle && !fast &&
             opts->stream_cache_pause < opts->stream_cache_min_percent)
         {
             bool prev_paused_user = opts->pause;
@@ -221,6 +221,9 @@ static void reinit_subdec(struct MPContext *mpctx, struct track *track,
     if (!track->preloaded && track->is_external) {
         demux_seek(track->demuxer, 0, SEEK_ABSOLUTE);
         track->preloaded = sub_read_all_packets(dec_sub, track->stream);
+        // Packets will be read during playback; start at the current position.
+        if (!track->preloaded)
+            demux_seek(track->demuxer, get_main_demux_pts(mpctx), SEEK_ABSOLUTE);
     }
 }
 
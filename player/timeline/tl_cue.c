@@ -387,6 +387,10 @@ void build_cue_timeline(struct MPContext *mpctx)
             .start = starttime,
             .source_start = tracks[i].start,
             .source = source,
+            .source_url = talloc_strdup(timeline, source->stream->url),
+            // .bin files can be opened only if forced (see try_open())
+            .source_demuxer = strcmp(source->desc->name, "rawaudio") == 0 ?
+                              "rawaudio" : NULL,
         };
         chapters[i] = (struct chapter) {
             .start = timeline[i].start,
@@ -21,6 +21,7 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -39,10 +40,17 @@
 #include "common/playlist.h"
 #include "stream/stream.h"
 
+// Number of files probed for segment UIDs in parallel.
+#define PROBE_THREADS 8
+
+// Max. number of files remembered in struct segment_uid_cache.
+#define MAX_CACHED_FILES 10000
+
 struct find_entry {
     char *name;
     int matchlen;
     off_t size;
+    int64_t mtime;
 };
 
 static int cmp_entry(const void *pa, const void *pb)
@@ -59,21 +67,22 @@ static int cmp_entry(const void *pa, const void *pb)
     return 0;
 }
 
-static char **find_files(const char *original_file, const char *suffix)
+static struct find_entry *find_files(void *talloc_ctx,
+                                     const char *original_file,
+                                     const char *suffix, int *num_results)
 {
     void *tmpmem = talloc_new(NULL);
     char *basename = mp_basename(original_file);
     struct bstr directory = mp_dirname(original_file);
-    char **results = talloc_size(NULL, 0);
+    struct find_entry *entries = talloc_array(talloc_ctx, struct find_entry, 0);
+    *num_results = 0;
     char *dir_zero = bstrdup0(tmpmem, directory);
     DIR *dp = opendir(dir_zero);
     if (!dp) {
         talloc_free(tmpmem);
-        return results;
+        return entries;
     }
-    struct find_entry *entries = NULL;
     struct dirent *ep;
-    int num_results = 0;
     while ((ep = readdir(dp))) {
         int suffix_offset = strlen(ep->d_name) - strlen(suffix);
         // name must end with suffix
@@ -83,7 +92,7 @@ static char **find_files(const char *original_file, const char *suffix)
         if (!strcmp(ep->d_name, basename))
             continue;
 
-        char *name = mp_path_join(results, directory, bstr0(ep->d_name));
+        char *name = mp_path_join(talloc_ctx, directory, bstr0(ep->d_name));
         char *s1 = ep->d_name;
         char *s2 = basename;
         int matchlen = 0;
@@ -95,23 +104,198 @@ static char **find_files(const char *original_file, const char *suffix)
         struct stat statbuf;
         if (stat(name, &statbuf) != 0)
             continue;
-        off_t size = statbuf.st_size;
 
-        entries = talloc_realloc(tmpmem, entries, struct find_entry,
-                                 num_results + 1);
-        entries[num_results] = (struct find_entry) { name, matchlen, size };
-        num_results++;
+        struct find_entry entry = {
+            name, matchlen, statbuf.st_size, statbuf.st_mtime,
+        };
+        MP_TARRAY_APPEND(talloc_ctx, entries, *num_results, entry);
     }
     closedir(dp);
-    // NOTE: maybe should make it compare pointers instead
-    if (entries)
-        qsort(entries, num_results, sizeof(struct find_entry), cmp_entry);
-    results = talloc_realloc(NULL, results, char *, num_results);
-    for (int i = 0; i < num_results; i++) {
-        results[i] = entries[i].name;
-    }
+    qsort(entries, *num_results, sizeof(struct find_entry), cmp_entry);
     talloc_free(tmpmem);
-    return results;
+    return entries;
+}
+
+// Segment UIDs of files which were probed before, so that opening further
+// files from the same directory (e.g. the next episode) doesn't have to read
+// all candidates again. Entries are invalidated if size or modification time
+// of the file change. Lives as long as the player.
+struct segment_uid_cache {
+    struct cached_file {
+        char *filename;
+        int64_t size, mtime;
+        struct matroska_segment_uid *uids;
+        int num_uids;
+    } *entries;
+    int num_entries;
+};
+
+// A file which could contain one of the referenced segments.
+struct candidate {
+    char *filename;
+    int64_t size, mtime;        // -1 if unknown
+    bool probed;
+    bool cached;                // uids were taken from the cache
+    struct matroska_segment_uid *uids;
+    int num_uids;
+};
+
+static struct cached_file *find_cached_file(struct segment_uid_cache *cache,
+                                            struct candidate *c)
+{
+    for (int n = 0; n < cache->num_entries; n++) {
+        struct cached_file *e = &cache->entries[n];
+        if (strcmp(e->filename, c->filename) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void lookup_cached_uids(struct MPContext *mpctx, void *talloc_ctx,
+                               struct candidate *c)
+{
+    struct segment_uid_cache *cache = mpctx->segment_uid_cache;
+    struct cached_file *e = cache ? find_cached_file(cache, c) : NULL;
+    if (!e || c->size < 0 || e->size != c->size || e->mtime != c->mtime)
+        return;
+    c->uids = talloc_memdup(talloc_ctx, e->uids,
+                            e->num_uids * sizeof(e->uids[0]));
+    c->num_uids = e->num_uids;
+    c->probed = c->cached = true;
+}
+
+static void cache_uids(struct MPContext *mpctx, struct candidate *c)
+{
+    if (!c->probed || c->cached || c->size < 0)
+        return;
+    if (!mpctx->segment_uid_cache)
+        mpctx->segment_uid_cache = talloc_zero(mpctx, struct segment_uid_cache);
+    struct segment_uid_cache *cache = mpctx->segment_uid_cache;
+    struct cached_file *e = find_cached_file(cache, c);
+    if (!e) {
+        if (cache->num_entries >= MAX_CACHED_FILES) {
+            talloc_free(cache->entries);
+            cache->entries = NULL;
+            cache->num_entries = 0;
+        }
+        struct cached_file new = {
+            .filename = talloc_strdup(cache, c->filename),
+        };
+        MP_TARRAY_APPEND(cache, cache->entries, cache->num_entries, new);
+        e = &cache->entries[cache->num_entries - 1];
+        talloc_steal(cache->entries, e->filename);
+    }
+    talloc_free(e->uids);
+    e->size = c->size;
+    e->mtime = c->mtime;
+    e->uids = talloc_memdup(cache->entries, c->uids,
+                            c->num_uids * sizeof(c->uids[0]));
+    e->num_uids = c->num_uids;
+}
+
+struct probe_ctx {
+    struct MPContext *mpctx;
+    struct candidate *candidates;
+    int num_candidates;
+    pthread_mutex_t lock;
+    int next;                   // protected by lock
+};
+
+static void probe_candidate(struct MPContext *mpctx, struct candidate *c)
+{
+    if (c->size < 0) {
+        struct stat statbuf;
+        if (stat(c->filename, &statbuf) == 0) {
+            c->size = statbuf.st_size;
+            c->mtime = statbuf.st_mtime;
+        }
+    }
+    struct stream *s = stream_open(c->filename, mpctx->global);
+    if (!s)
+        return;
+    c->num_uids = demux_mkv_read_segment_uids(s, mpctx->log, NULL, &c->uids);
+    free_stream(s);
+    // If it fails, candidate_matches() makes check_file() open the file.
+    c->probed = c->num_uids >= 0;
+    if (!c->probed)
+        c->num_uids = 0;
+}
+
+static void *probe_thread(void *arg)
+{
+    struct probe_ctx *ctx = arg;
+    while (1) {
+        pthread_mutex_lock(&ctx->lock);
+        int n = ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+        if (n >= ctx->num_candidates)
+            break;
+        struct candidate *c = &ctx->candidates[n];
+        if (!c->probed)
+            probe_candidate(ctx->mpctx, c);
+    }
+    return NULL;
+}
+
+// Read the segment UIDs of all candidates that are not in the cache yet.
+// Opening files is slow on network filesystems, so this is done in
+// parallel.
+static void probe_candidates(struct MPContext *mpctx,
+                             struct candidate *candidates, int num_candidates)
+{
+    int num_probe = 0;
+    for (int n = 0; n < num_candidates; n++) {
+        lookup_cached_uids(mpctx, candidates, &candidates[n]);
+        num_probe += !candidates[n].probed;
+    }
+    MP_VERBOSE(mpctx, "Probing %d files (%d cached).\n", num_probe,
+               num_candidates - num_probe);
+    if (!num_probe)
+        return;
+
+    struct probe_ctx ctx = {
+        .mpctx = mpctx,
+        .candidates = candidates,
+        .num_candidates = num_candidates,
+    };
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_t threads[PROBE_THREADS];
+    int num_threads = 0;
+    for (int n = 0; n < MPMIN(num_probe, PROBE_THREADS); n++) {
+        if (pthread_create(&threads[num_threads], NULL, probe_thread, &ctx))
+            break;
+        num_threads++;
+    }
+    // Do the work on this thread if no threads could be created.
+    probe_thread(&ctx);
+    for (int n = 0; n < num_threads; n++)
+        pthread_join(threads[n], NULL);
+    pthread_mutex_destroy(&ctx.lock);
+
+    for (int n = 0; n < num_candidates; n++) {
+        struct candidate *c = &candidates[n];
+        talloc_steal(candidates, c->uids);
+        cache_uids(mpctx, c);
+    }
+}
+
+// Whether the file might contain one of the sources that are still missing.
+// If the file couldn't be probed, it has to be checked with a full open.
+static bool candidate_matches(struct candidate *c, struct demuxer **sources,
+                              int num_sources,
+                              struct matroska_segment_uid *uids)
+{
+    if (!c->probed)
+        return true;
+    for (int i = 1; i < num_sources; i++) {
+        if (sources[i])
+            continue;
+        for (int n = 0; n < c->num_uids; n++) {
+            if (!memcmp(c->uids[n].segment, uids[i].segment, 16))
+                return true;
+        }
+    }
+    return false;
 }
 
 static int enable_cache(struct MPContext *mpctx, struct stream **stream,
@@ -253,8 +437,8 @@ static int find_ordered_chapter_sources(struct MPContext *mpctx,
 {
     struct MPOpts *opts = mpctx->opts;
     void *tmp = talloc_new(NULL);
-    int num_filenames = 0;
-    char **filenames = NULL;
+    int num_candidates = 0;
+    struct candidate *candidates = NULL;
     if (*num_sources > 1) {
         char *main_filename = mpctx->demuxer->filename;
         MP_INFO(mpctx, "This file references data from "
@@ -265,18 +449,27 @@ static int find_ordered_chapter_sources(struct MPContext *mpctx,
             struct playlist *pl =
                 playlist_parse_file(opts->ordered_chapters_files, mpctx->global);
             talloc_steal(tmp, pl);
-            for (struct playlist_entry *e = pl->first; e; e = e->next)
-                MP_TARRAY_APPEND(tmp, filenames, num_filenames, e->filename);
+            for (struct playlist_entry *e = pl->first; e; e = e->next) {
+                struct candidate c = { e->filename, -1, -1 };
+                MP_TARRAY_APPEND(tmp, candidates, num_candidates, c);
+            }
         } else if (mpctx->demuxer->stream->uncached_type != STREAMTYPE_FILE) {
             MP_WARN(mpctx, "Playback source is not a "
                    "normal disk file. Will not search for related files.\n");
         } else {
             MP_INFO(mpctx, "Will scan other files in the "
                    "same directory to find referenced sources.\n");
-            filenames = find_files(main_filename, ".mkv");
-            num_filenames = MP_TALLOC_ELEMS(filenames);
-            talloc_steal(tmp, filenames);
+            int num_files;
+            struct find_entry *files =
+                find_files(tmp, main_filename, ".mkv", &num_files);
+            for (int i = 0; i < num_files; i++) {
+                struct candidate c = {
+                    files[i].name, files[i].size, files[i].mtime,
+                };
+                MP_TARRAY_APPEND(tmp, candidates, num_candidates, c);
+            }
         }
+        probe_candidates(mpctx, candidates, num_candidates);
         // Possibly get further segments appended to the first segment
         check_file(mpctx, sources, num_sources, uids, main_filename, 1);
     }
@@ -284,11 +477,14 @@ static int find_ordered_chapter_sources(struct MPContext *mpctx,
     int old_source_count;
     do {
         old_source_count = *num_sources;
-        for (int i = 0; i < num_filenames; i++) {
+        for (int i = 0; i < num_candidates; i++) {
             if (!missing(*sources, *num_sources))
                 break;
-            MP_INFO(mpctx, "Checking file %s\n", filenames[i]);
-            check_file(mpctx, sources, num_sources, uids, filenames[i], 0);
+            struct candidate *c = &candidates[i];
+            if (!candidate_matches(c, *sources, *num_sources, *uids))
+                continue;
+            MP_INFO(mpctx, "Checking file %s\n", c->filename);
+            check_file(mpctx, sources, num_sources, uids, c->filename, 0);
         }
     /* Loop while we have new sources to look for. */
     } while (old_source_count != *num_sources);
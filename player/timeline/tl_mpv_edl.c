@@ -144,14 +144,22 @@ static struct demuxer *open_file(char *filename, struct MPContext *mpctx)
     return d;
 }
 
-static struct demuxer *open_source(struct MPContext *mpctx, char *filename)
+static struct demuxer *find_source(struct MPContext *mpctx, char *filename)
 {
     for (int n = 0; n < mpctx->num_sources; n++) {
         struct demuxer *d = mpctx->sources[n];
         if (strcmp(d->stream->url, filename) == 0)
             return d;
     }
-    struct demuxer *d = open_file(filename, mpctx);
+    return NULL;
+}
+
+static struct demuxer *open_source(struct MPContext *mpctx, char *filename)
+{
+    struct demuxer *d = find_source(mpctx, filename);
+    if (d)
+        return d;
+    d = open_file(filename, mpctx);
     if (d)
         MP_TARRAY_APPEND(NULL, mpctx->sources, mpctx->num_sources, d);
     return d;
@@ -216,7 +224,30 @@ static void build_timeline(struct MPContext *mpctx, struct tl_parts *parts)
     double starttime = 0;
     for (int n = 0; n < parts->num_parts; n++) {
         struct tl_part *part = &parts->parts[n];
-        struct demuxer *source = open_source(mpctx, part->filename);
+
+        // With --timeline-max-sources, parts with known length are opened
+        // when playback reaches them. The first part is needed for the
+        // track layout. Chapters of such sources are not added.
+        bool lazy = mpctx->opts->timeline_max_sources > 0 && n > 0 &&
+                    part->length >= 0 && !part->chapter_ts;
+        struct demuxer *source = find_source(mpctx, part->filename);
+        if (!source && lazy) {
+            struct chapter ch = {
+                .start = starttime,
+                .name = talloc_strdup(chapters, part->filename),
+            };
+            MP_TARRAY_APPEND(NULL, chapters, num_chapters, ch);
+            timeline[n] = (struct timeline_part) {
+                .start = starttime,
+                .source_start = part->offset,
+                .source_url = talloc_strdup(timeline, part->filename),
+            };
+            starttime += part->length;
+            continue;
+        }
+
+        if (!source)
+            source = open_source(mpctx, part->filename);
         if (!source)
             goto error;
 
@@ -257,10 +288,16 @@ static void build_timeline(struct MPContext *mpctx, struct tl_parts *parts)
             .start = starttime,
             .source_start = part->offset,
             .source = source,
+            .source_url = talloc_strdup(timeline, part->filename),
         };
 
         starttime += part->length;
     }
+    // Lazy parts whose file was opened for a later part anyway.
+    for (int n = 0; n < parts->num_parts; n++) {
+        if (!timeline[n].source)
+            timeline[n].source = find_source(mpctx, timeline[n].source_url);
+    }
     timeline[parts->num_parts] = (struct timeline_part) {.start = starttime};
     mpctx->timeline = timeline;
     mpctx->num_timeline_parts = parts->num_parts;
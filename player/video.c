@@ -237,7 +237,7 @@ int reinit_video_chain(struct MPContext *mpctx)
 
     vo_control(mpctx->video_out, VOCTRL_GET_HWDEC_INFO, &d_video->hwdec_info);
 
-    if (stream_control(sh->demuxer->stream, STREAM_CTRL_GET_ASPECT_RATIO, &ar)
+    if (demux_stream_control(sh->demuxer, STREAM_CTRL_GET_ASPECT_RATIO, &ar)
             != STREAM_UNSUPPORTED)
         d_video->stream_aspect = ar;
 
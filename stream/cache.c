@@ -36,6 +36,16 @@
 // Time in seconds the cache prints a new message at all.
 #define CACHE_NO_SPAM 5.0
 
+// Time in seconds a single read from the stream should take. The read size is
+// adapted to the measured stream speed: fast streams are read with few large
+// calls, while reads from slow streams don't block the cache thread (and the
+// handling of STREAM_CTRLs) for too long.
+#define CACHE_TARGET_READ_TIME 0.1
+
+// Bounds for the adaptive read size.
+#define CACHE_MIN_READ_CHUNK (4 * 1024)
+#define CACHE_MAX_READ_CHUNK (4 * 1024 * 1024)
+
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -54,10 +64,14 @@
 
 #include "osdep/timer.h"
 #include "osdep/threads.h"
+#include "compat/atomics.h"
 
 #include "common/msg.h"
+#include "options/options.h"
+#include "options/path.h"
 
 #include "stream.h"
+#include "cache_file.h"
 #include "common/common.h"
 
 
@@ -76,6 +90,7 @@ struct priv {
     int64_t seek_limit;     // keep filling cache if distance is less that seek limit
     struct byte_meta *bm;   // additional per-byte metadata
     bool seekable;          // underlying stream is seekable
+    int max_ranges;         // max. number of stashed ranges (0: disabled)
 
     struct mp_log *log;
 
@@ -88,6 +103,11 @@ struct priv {
 
     // All the following members are shared between the threads.
     // You must lock the mutex to access them.
+    // Exception: the reader can access min_filepos, max_filepos, offset,
+    // read_filepos and the buffer data without lock (see read_lockfree()).
+    // Changes to them by the cache thread must use atomic operations, and
+    // anything that is not just appending data must be done between
+    // block_lockfree() and unblock_lockfree().
 
     // Ringbuffer
     int64_t min_filepos;    // range of file that is cached in the buffer
@@ -97,9 +117,40 @@ struct priv {
                             // to the byte at max_filepos (must be wrapped by
                             // buffer_size)
 
+    int lockfree_readers;   // number of readers in read_lockfree() (atomic)
+    int lockfree_blocked;   // if >0, read_lockfree() must not be used (atomic)
+
     bool idle;              // cache thread has stopped reading
     int64_t reads;          // number of actual read attempts performed
 
+    // Stream speed measurement (only reads from the stream itself count)
+    int64_t read_chunk;     // current read size, adapted to the speed
+    double speed;           // smoothed stream speed in bytes/second (0: unknown)
+    double read_latency;    // smoothed time in seconds a read call takes
+
+    // Ranges that were kicked out of the ringbuffer by seeking. They are
+    // stored in range_buffer in units of RANGE_BLOCK_SIZE blocks.
+    unsigned char *range_buffer;
+    int range_blocks;       // range_buffer_size / RANGE_BLOCK_SIZE
+    int *free_blocks;       // indexes of unused blocks in range_buffer
+    int num_free_blocks;
+    struct cache_range **ranges;
+    int num_ranges;
+    uint64_t range_use;     // incremented on each range access (for LRU)
+
+    // On-disk cache tier (--cache-file). Data evicted from the ringbuffer is
+    // written to it, and read back from it instead of the stream. Only the
+    // cache thread uses the file, and it does the file I/O with the mutex
+    // unlocked. Other threads see file_ranges instead.
+    struct cache_file *file;
+    bool file_persistent;   // file is kept after closing (--cache-dir)
+    struct stream_range *file_ranges; // copy of cache_file_get_ranges()
+    int num_file_ranges;
+
+    // Statistics (STREAM_CTRL_GET_CACHE_STATS). stats.served_bytes is updated
+    // with atomic operations, because the lock-free reader changes it too.
+    struct stream_cache_stats stats;
+
     int64_t read_filepos;   // client read position (mirrors cache->pos)
     int control;            // requested STREAM_CTRL_... or CACHE_CTRL_...
     void *control_arg;      // temporary for executing STREAM_CTRLs
@@ -124,9 +175,21 @@ struct byte_meta {
     float stream_pts;
 };
 
+// A contiguous part of the file, which is not in the ringbuffer.
+struct cache_range {
+    int64_t start, end;     // file positions covered ([start, end) )
+    uint64_t last_use;      // value of priv.range_use on last access
+    // Byte start+n is at range_buffer[blocks[n / RANGE_BLOCK_SIZE] *
+    // RANGE_BLOCK_SIZE + n % RANGE_BLOCK_SIZE].
+    int *blocks;
+    int num_blocks;
+};
+
 enum {
     BYTE_META_CHUNK_SIZE = 8 * 1024,
 
+    RANGE_BLOCK_SIZE = 64 * 1024,
+
     CACHE_INTERRUPTED = -1,
 
     CACHE_CTRL_NONE = 0,
@@ -167,13 +230,45 @@ static int cache_wakeup_and_wait(struct priv *s, double *retry_time)
     }
 
     pthread_cond_signal(&s->wakeup);
+    MP_STATS(s, "start wait");
     mpthread_cond_timedwait(&s->wakeup, &s->mutex, CACHE_WAIT_TIME);
+    MP_STATS(s, "end wait");
 
-    *retry_time += mp_time_sec() - start;
+    double waited = mp_time_sec() - start;
+    *retry_time += waited;
+    s->stats.wait_time += waited;
 
     return 0;
 }
 
+// The fields used by the lock-free reader are 64 bit, and plain 64 bit
+// accesses are not atomic on all platforms.
+static int64_t atomic_get64(int64_t *p)
+{
+    return mp_atomic_add_and_fetch(p, 0);
+}
+
+static void atomic_add64(int64_t *p, int64_t v)
+{
+    mp_atomic_add_and_fetch(p, v);
+}
+
+// Stop the reader from accessing the buffer without lock, and wait until
+// lock-free reads in progress are done. The reader never holds on to the
+// buffer for long (a single memcpy), so just spin.
+// Runs in the cache thread, with the mutex held.
+static void block_lockfree(struct priv *s)
+{
+    mp_atomic_add_and_fetch(&s->lockfree_blocked, 1);
+    while (mp_atomic_add_and_fetch(&s->lockfree_readers, 0))
+        mp_sleep_us(0);
+}
+
+static void unblock_lockfree(struct priv *s)
+{
+    mp_atomic_add_and_fetch(&s->lockfree_blocked, -1);
+}
+
 // Runs in the cache thread
 static void cache_drop_contents(struct priv *s)
 {
@@ -181,6 +276,233 @@ static void cache_drop_contents(struct priv *s)
     s->eof = false;
 }
 
+static void range_free(struct priv *s, struct cache_range *r)
+{
+    for (int n = 0; n < r->num_blocks; n++)
+        s->free_blocks[s->num_free_blocks++] = r->blocks[n];
+    for (int n = 0; n < s->num_ranges; n++) {
+        if (s->ranges[n] == r) {
+            MP_TARRAY_REMOVE_AT(s->ranges, s->num_ranges, n);
+            break;
+        }
+    }
+    talloc_free(r);
+}
+
+static void ranges_drop_all(struct priv *s)
+{
+    while (s->num_ranges)
+        range_free(s, s->ranges[0]);
+}
+
+static struct cache_range *range_find(struct priv *s, int64_t pos)
+{
+    for (int n = 0; n < s->num_ranges; n++) {
+        struct cache_range *r = s->ranges[n];
+        if (pos >= r->start && pos < r->end)
+            return r;
+    }
+    return NULL;
+}
+
+// Copy at most dst_size bytes at the given file position from the range.
+static size_t range_read(struct priv *s, struct cache_range *r,
+                         unsigned char *dst, size_t dst_size, int64_t pos)
+{
+    size_t read = 0;
+    while (read < dst_size && pos < r->end) {
+        int64_t rpos = pos - r->start;
+        int block = rpos / RANGE_BLOCK_SIZE;
+        int64_t boffset = rpos % RANGE_BLOCK_SIZE;
+        size_t len = MPMIN(RANGE_BLOCK_SIZE - boffset, r->end - pos);
+        len = MPMIN(len, dst_size - read);
+        memcpy(dst + read, s->range_buffer +
+               r->blocks[block] * (int64_t)RANGE_BLOCK_SIZE + boffset, len);
+        read += len;
+        pos += len;
+    }
+    r->last_use = ++s->range_use;
+    return read;
+}
+
+// Free the least recently used range, except keep. Returns false if there
+// was nothing to evict.
+static bool range_evict_lru(struct priv *s, struct cache_range *keep)
+{
+    struct cache_range *lru = NULL;
+    for (int n = 0; n < s->num_ranges; n++) {
+        struct cache_range *r = s->ranges[n];
+        if (r != keep && (!lru || r->last_use < lru->last_use))
+            lru = r;
+    }
+    if (!lru)
+        return false;
+    MP_VERBOSE(s, "Evicting cached range %"PRId64"-%"PRId64".\n",
+               lru->start, lru->end);
+    range_free(s, lru);
+    return true;
+}
+
+static size_t read_buffer(struct priv *s, unsigned char *dst,
+                          size_t dst_size, int64_t pos);
+
+// Move the contents of the ringbuffer into a new range (as far as it fits).
+// Existing ranges are evicted if needed, except keep.
+static void stash_ringbuffer(struct priv *s, struct cache_range *keep)
+{
+    if (!s->max_ranges || s->max_filepos <= s->min_filepos)
+        return;
+
+    // Ranges completely covered by the ringbuffer are redundant.
+    for (int n = s->num_ranges - 1; n >= 0; n--) {
+        struct cache_range *r = s->ranges[n];
+        if (r != keep && r->start >= s->min_filepos && r->end <= s->max_filepos)
+            range_free(s, r);
+    }
+
+    int max_blocks = s->range_blocks - (keep ? keep->num_blocks : 0);
+    int64_t len = MPMIN(s->max_filepos - s->min_filepos,
+                        max_blocks * (int64_t)RANGE_BLOCK_SIZE);
+    int num_blocks = (len + RANGE_BLOCK_SIZE - 1) / RANGE_BLOCK_SIZE;
+    if (num_blocks < 1)
+        return;
+
+    while (s->num_ranges >= s->max_ranges || s->num_free_blocks < num_blocks) {
+        if (!range_evict_lru(s, keep))
+            return;
+    }
+
+    // Keep the most recently read data if the range store is too small.
+    struct cache_range *r = talloc_ptrtype(s, r);
+    *r = (struct cache_range){
+        .start = s->max_filepos - len,
+        .end = s->max_filepos,
+        .last_use = ++s->range_use,
+        .blocks = talloc_array(r, int, num_blocks),
+        .num_blocks = num_blocks,
+    };
+    for (int n = 0; n < num_blocks; n++) {
+        int block = s->free_blocks[--s->num_free_blocks];
+        r->blocks[n] = block;
+        int64_t pos = r->start + n * (int64_t)RANGE_BLOCK_SIZE;
+        size_t copy = MPMIN(RANGE_BLOCK_SIZE, r->end - pos);
+        size_t res = read_buffer(s, s->range_buffer +
+                                 block * (int64_t)RANGE_BLOCK_SIZE, copy, pos);
+        assert(res == copy);
+    }
+    MP_TARRAY_APPEND(s, s->ranges, s->num_ranges, r);
+
+    MP_VERBOSE(s, "Keeping cached range %"PRId64"-%"PRId64".\n",
+               r->start, r->end);
+}
+
+// Copy a range back into the (empty) ringbuffer, and free it.
+static void restore_range(struct priv *s, struct cache_range *r)
+{
+    assert(s->min_filepos == s->max_filepos);
+    int64_t len = MPMIN(r->end - r->start, s->buffer_size - FILL_LIMIT);
+    range_read(s, r, s->buffer, len, r->start);
+    for (int64_t n = 0; n < len; n += BYTE_META_CHUNK_SIZE)
+        s->bm[n / BYTE_META_CHUNK_SIZE].stream_pts = MP_NOPTS_VALUE;
+    s->offset = s->min_filepos = r->start;
+    s->max_filepos = r->start + len;
+    MP_VERBOSE(s, "Restoring cached range %"PRId64"-%"PRId64".\n",
+               r->start, r->end);
+    range_free(s, r);
+}
+
+// Update the copy of the cache file ranges that other threads can access.
+// Runs in the cache thread, with the mutex held.
+static void update_file_ranges(struct priv *s)
+{
+    int num = 0;
+    const struct stream_range *ranges = cache_file_get_ranges(s->file, &num);
+    MP_RESIZE_ARRAY(s, s->file_ranges, num);
+    memcpy(s->file_ranges, ranges, num * sizeof(ranges[0]));
+    s->num_file_ranges = num;
+}
+
+// Write the given part of the ringbuffer to the cache file. The mutex is
+// unlocked while writing. Only the cache thread changes the buffer, so the
+// data stays valid, and other threads can still read it.
+// Runs in the cache thread.
+static void spill_to_file(struct priv *s, int64_t start, int64_t end)
+{
+    if (!s->file || start >= end)
+        return;
+    int64_t offset = s->offset;
+    int64_t keep_pos = s->read_filepos;
+    pthread_mutex_unlock(&s->mutex);
+    while (start < end) {
+        int64_t bpos = start - offset;
+        if (bpos < 0) {
+            bpos += s->buffer_size;
+        } else if (bpos >= s->buffer_size) {
+            bpos -= s->buffer_size;
+        }
+        int64_t len = MPMIN(end - start, s->buffer_size - bpos);
+        cache_file_write(s->file, start, &s->buffer[bpos], len, keep_pos);
+        start += len;
+    }
+    pthread_mutex_lock(&s->mutex);
+    update_file_ranges(s);
+}
+
+// Number of bytes cache_fill() could read ahead at most.
+static int64_t cache_free_space(struct priv *s)
+{
+    int64_t read = s->read_filepos;
+    int64_t back = mp_clipi64(read - s->min_filepos, 0, s->back_size);
+    int64_t newb = FFMAX(s->max_filepos - read, 0);
+    return s->buffer_size - (newb + back);
+}
+
+// Update the speed estimate with a read of len bytes that took the given time,
+// and pick the size of the next read from it.
+// Runs in the cache thread.
+static void update_read_speed(struct priv *s, int64_t len, double time)
+{
+    if (len <= 0)
+        return;
+    time = MPMAX(time, 1e-6);
+    if (s->speed > 0) {
+        s->speed = s->speed * 0.8 + len / time * 0.2;
+        s->read_latency = s->read_latency * 0.8 + time * 0.2;
+    } else {
+        s->speed = len / time;
+        s->read_latency = time;
+    }
+    // Only grow if the stream actually returned the full amount of data;
+    // partial reads (e.g. network packets) say nothing about the capacity.
+    int64_t chunk = s->speed * CACHE_TARGET_READ_TIME;
+    if (len < s->read_chunk)
+        chunk = MPMIN(chunk, s->read_chunk);
+    chunk = MPMIN(chunk, s->buffer_size / 8);
+    chunk = mp_clipi64(chunk, CACHE_MIN_READ_CHUNK, CACHE_MAX_READ_CHUNK);
+    s->read_chunk = chunk & ~(int64_t)(CACHE_MIN_READ_CHUNK - 1);
+}
+
+// Runs in the cache thread
+// Called when the read position is outside of the ringbuffer. Instead of
+// dropping the ringbuffer contents, keep them as separate range, and reuse a
+// previously kept range if it contains the new read position.
+static void cache_switch_range(struct priv *s)
+{
+    struct cache_range *hit = NULL;
+    for (int n = 0; n < s->num_ranges; n++) {
+        struct cache_range *r = s->ranges[n];
+        if (s->read_filepos >= r->start && s->read_filepos <= r->end)
+            hit = r;
+    }
+    spill_to_file(s, s->min_filepos, s->max_filepos);
+    stash_ringbuffer(s, hit);
+    block_lockfree(s);
+    cache_drop_contents(s);
+    if (hit)
+        restore_range(s, hit);
+    unblock_lockfree(s);
+}
+
 // Copy at most dst_size from the cache at the given absolute file position pos.
 // Return number of bytes that could actually be read.
 // Does not advance the file position, or change anything else.
@@ -215,11 +537,24 @@ static size_t read_buffer(struct priv *s, unsigned char *dst,
     return read;
 }
 
+static void add_read_stats(struct priv *s, int64_t len, double time)
+{
+    s->stats.reads++;
+    s->stats.read_bytes += MPMAX(len, 0);
+    int bin = 0;
+    double limit = 0.001;
+    while (bin < STREAM_CACHE_LATENCY_BINS - 1 && time >= limit) {
+        bin++;
+        limit *= 4;
+    }
+    s->stats.read_latency[bin]++;
+}
+
 // Runs in the cache thread.
 // Returns true if reading was attempted, and the mutex was shortly unlocked.
 static bool cache_fill(struct priv *s)
 {
-    int64_t read = s->read_filepos;
+    int64_t read = atomic_get64(&s->read_filepos);
     int len;
 
     // drop cache contents only if seeking backward or too much fwd.
@@ -227,13 +562,22 @@ static bool cache_fill(struct priv *s)
     // That in turn can cause major bandwidth increase and performance
     // issues with e.g. mov or badly interleaved files
     if (read < s->min_filepos || read > s->max_filepos + s->seek_limit) {
+        s->stats.drops_seek++;
+        MP_STATS(s, "cache drop seek");
         MP_VERBOSE(s, "Dropping cache at pos %"PRId64", "
                    "cached range: %"PRId64"-%"PRId64".\n", read,
                    s->min_filepos, s->max_filepos);
-        cache_drop_contents(s);
+        cache_switch_range(s);
     }
 
-    if (stream_tell(s->stream) != s->max_filepos && s->seekable) {
+    // Data that was kept in a separate range doesn't need to be read again.
+    struct cache_range *range = range_find(s, s->max_filepos);
+    bool on_disk = !range && s->file &&
+                   cache_file_available(s->file, s->max_filepos) > 0;
+
+    if (!range && !on_disk && stream_tell(s->stream) != s->max_filepos &&
+        s->seekable)
+    {
         MP_VERBOSE(s, "Seeking underlying stream: %"PRId64" -> %"PRId64"\n",
                    stream_tell(s->stream), s->max_filepos);
         stream_seek(s->stream, s->max_filepos);
@@ -264,34 +608,62 @@ static bool cache_fill(struct priv *s)
         space = s->buffer_size - pos;
 
     // limit read size (or else would block and read the entire buffer in 1 call)
-    space = FFMIN(space, s->stream->read_chunk);
+    space = FFMIN(space, s->read_chunk);
 
     // back+newb+space <= buffer_size
     int64_t back2 = s->buffer_size - (space + newb); // max back size
-    if (s->min_filepos < (read - back2))
-        s->min_filepos = read - back2;
+    if (s->min_filepos < (read - back2)) {
+        // The data before the new min_filepos is going to be overwritten.
+        spill_to_file(s, s->min_filepos, read - back2);
+        atomic_add64(&s->min_filepos, (read - back2) - s->min_filepos);
+    }
 
-    // The read call might take a long time and block, so drop the lock.
-    pthread_mutex_unlock(&s->mutex);
-    len = stream_read_partial(s->stream, &s->buffer[pos], space);
-    pthread_mutex_lock(&s->mutex);
+    double pts = MP_NOPTS_VALUE;
+    if (range) {
+        len = range_read(s, range, &s->buffer[pos], space, s->max_filepos);
+        s->stats.range_bytes += len;
+        if (s->max_filepos + len >= range->end)
+            range_free(s, range);
+    } else if (on_disk) {
+        // The part of the buffer after max_filepos is not accessed by other
+        // threads, so the file can be read without the lock.
+        int64_t fpos = s->max_filepos;
+        pthread_mutex_unlock(&s->mutex);
+        len = cache_file_read(s->file, fpos, &s->buffer[pos], space);
+        pthread_mutex_lock(&s->mutex);
+        s->stats.file_bytes += len;
+    } else {
+        // The read call might take a long time and block, so drop the lock.
+        pthread_mutex_unlock(&s->mutex);
+        MP_STATS(s, "start read");
+        double start = mp_time_sec();
+        len = stream_read_partial(s->stream, &s->buffer[pos], space);
+        double read_time = mp_time_sec() - start;
+        MP_STATS(s, "end read");
+        pthread_mutex_lock(&s->mutex);
 
-    double pts;
-    if (stream_control(s->stream, STREAM_CTRL_GET_CURRENT_TIME, &pts) <= 0)
-        pts = MP_NOPTS_VALUE;
+        update_read_speed(s, len, read_time);
+        add_read_stats(s, len, read_time);
+
+        if (stream_control(s->stream, STREAM_CTRL_GET_CURRENT_TIME, &pts) <= 0)
+            pts = MP_NOPTS_VALUE;
+    }
     for (int64_t b_pos = pos; b_pos < pos + len + BYTE_META_CHUNK_SIZE;
          b_pos += BYTE_META_CHUNK_SIZE)
     {
         s->bm[b_pos / BYTE_META_CHUNK_SIZE] = (struct byte_meta){.stream_pts = pts};
     }
 
-    s->max_filepos += len;
+    // Make sure the lock-free reader sees the data before the new max_filepos.
+    mp_memory_barrier();
+    atomic_add64(&s->max_filepos, len);
     if (pos + len == s->buffer_size)
-        s->offset += s->buffer_size; // wrap...
+        atomic_add64(&s->offset, s->buffer_size); // wrap...
 
     s->eof = len <= 0;
     s->idle = s->eof;
     s->reads++;
+    MP_STATS(s, "value %f cache-fill-kb", (s->max_filepos - read) / 1024.0);
     if (s->eof)
         MP_VERBOSE(s, "EOF reached.\n");
 
@@ -307,15 +679,28 @@ static int resize_cache(struct priv *s, int64_t size)
     int64_t max_size = ((size_t)-1) / 4;
     int64_t buffer_size = MPMIN(MPMAX(size, min_size), max_size);
 
+    // A quarter of the cache memory is reserved for keeping ranges.
+    int range_blocks = 0;
+    if (s->max_ranges > 0) {
+        range_blocks = buffer_size / 4 / RANGE_BLOCK_SIZE;
+        buffer_size -= range_blocks * (int64_t)RANGE_BLOCK_SIZE;
+    }
+
     unsigned char *buffer = malloc(buffer_size);
     struct byte_meta *bm = calloc(buffer_size / BYTE_META_CHUNK_SIZE + 2,
                                   sizeof(struct byte_meta));
-    if (!buffer || !bm) {
+    unsigned char *range_buffer = NULL;
+    if (range_blocks)
+        range_buffer = malloc(range_blocks * (int64_t)RANGE_BLOCK_SIZE);
+    if (!buffer || !bm || (range_blocks && !range_buffer)) {
         free(buffer);
         free(bm);
+        free(range_buffer);
         return STREAM_ERROR;
     }
 
+    block_lockfree(s);
+
     if (s->buffer) {
         // Copy & free the old ringbuffer data.
         // If the buffer is too small, prefer to copy these regions:
@@ -345,6 +730,15 @@ static int resize_cache(struct priv *s, int64_t size)
     free(s->buffer);
     free(s->bm);
 
+    ranges_drop_all(s);
+    free(s->range_buffer);
+    s->range_buffer = range_buffer;
+    s->range_blocks = range_blocks;
+    s->free_blocks = talloc_realloc(s, s->free_blocks, int, range_blocks);
+    s->num_free_blocks = 0;
+    for (int n = 0; n < range_blocks; n++)
+        s->free_blocks[s->num_free_blocks++] = n;
+
     s->buffer_size = buffer_size;
     s->back_size = buffer_size / 2;
     s->buffer = buffer;
@@ -357,6 +751,8 @@ static int resize_cache(struct priv *s, int64_t size)
     if (s->seek_limit > s->buffer_size - FILL_LIMIT)
         s->seek_limit = s->buffer_size - FILL_LIMIT;
 
+    unblock_lockfree(s);
+
     return STREAM_OK;
 }
 
@@ -405,6 +801,32 @@ static int cache_get_cached_control(stream_t *cache, int cmd, void *arg)
     case STREAM_CTRL_GET_CACHE_IDLE:
         *(int *)arg = s->idle;
         return STREAM_OK;
+    case STREAM_CTRL_GET_CACHE_SPEED:
+        if (s->speed <= 0)
+            return STREAM_UNSUPPORTED;
+        *(int64_t *)arg = s->speed;
+        return STREAM_OK;
+    case STREAM_CTRL_GET_CACHE_STATS: {
+        struct stream_cache_stats *stats = arg;
+        *stats = s->stats;
+        stats->served_bytes = atomic_get64(&s->stats.served_bytes);
+        return STREAM_OK;
+    }
+    case STREAM_CTRL_GET_CACHE_RANGES: {
+        struct stream_cache_ranges *res = arg;
+        *res = (struct stream_cache_ranges){0};
+        stream_ranges_add(NULL, &res->ranges, &res->num_ranges,
+                          s->min_filepos, s->max_filepos);
+        for (int n = 0; n < s->num_ranges; n++) {
+            stream_ranges_add(NULL, &res->ranges, &res->num_ranges,
+                              s->ranges[n]->start, s->ranges[n]->end);
+        }
+        for (int n = 0; n < s->num_file_ranges; n++) {
+            stream_ranges_add(NULL, &res->ranges, &res->num_ranges,
+                              s->file_ranges[n].start, s->file_ranges[n].end);
+        }
+        return STREAM_OK;
+    }
     case STREAM_CTRL_GET_TIME_LENGTH:
         *(double *)arg = s->stream_time_length;
         return s->stream_time_length ? STREAM_OK : STREAM_UNSUPPORTED;
@@ -498,9 +920,18 @@ static void cache_execute_control(struct priv *s)
                "returned error, this is not allowed!\n");
     } else if (pos_changed || (ok && control_needs_flush(s->control))) {
         MP_VERBOSE(s, "Dropping cache due to control()\n");
+        s->stats.drops_control++;
+        MP_STATS(s, "cache drop control");
+        block_lockfree(s);
         s->read_filepos = stream_tell(s->stream);
         s->control_flush = true;
         cache_drop_contents(s);
+        unblock_lockfree(s);
+        ranges_drop_all(s);
+        if (s->file) {
+            cache_file_drop(s->file);
+            update_file_ranges(s);
+        }
     }
 
     update_cached_controls(s);
@@ -537,23 +968,70 @@ static void *cache_thread(void *arg)
     return NULL;
 }
 
+// Copy data from the buffer at read_filepos without locking the mutex. This
+// is possible because the cache thread never overwrites data after
+// read_filepos, and publishes new data by incrementing max_filepos only after
+// writing it to the buffer (like misc/ring.c). The offset can change under our
+// feet only in steps of buffer_size, so the wrapped buffer position is stable.
+// Returns 0 if nothing could be read this way.
+// Runs in the reader thread (the only thread changing read_filepos).
+static int read_lockfree(struct priv *s, unsigned char *dst, int len)
+{
+    int readb = 0;
+    mp_atomic_add_and_fetch(&s->lockfree_readers, 1);
+    if (!mp_atomic_add_and_fetch(&s->lockfree_blocked, 0)) {
+        int64_t pos = s->read_filepos;
+        int64_t max = atomic_get64(&s->max_filepos);
+        if (pos >= atomic_get64(&s->min_filepos) && pos < max) {
+            readb = MPMIN(len, max - pos);
+            int64_t bpos = (pos - atomic_get64(&s->offset)) % s->buffer_size;
+            if (bpos < 0)
+                bpos += s->buffer_size;
+            int len1 = MPMIN(readb, s->buffer_size - bpos);
+            memcpy(dst, &s->buffer[bpos], len1);
+            memcpy(dst + len1, s->buffer, readb - len1);
+            // The data must have been copied before the cache thread can
+            // overwrite it due to the new read_filepos.
+            mp_memory_barrier();
+            atomic_add64(&s->read_filepos, readb);
+            atomic_add64(&s->stats.served_bytes, readb);
+        }
+    }
+    mp_atomic_add_and_fetch(&s->lockfree_readers, -1);
+    return readb;
+}
+
 static int cache_fill_buffer(struct stream *cache, char *buffer, int max_len)
 {
     struct priv *s = cache->priv;
     assert(s->cache_thread_running);
 
+    int readb = read_lockfree(s, buffer, max_len);
+    if (readb > 0) {
+        // The cache thread might be waiting for free space. Checking this
+        // without lock is racy, but at worst delays the wakeup a bit.
+        if (s->idle && !s->eof &&
+            cache_free_space(s) >= MPMAX(s->read_chunk, FILL_LIMIT))
+        {
+            pthread_mutex_lock(&s->mutex);
+            pthread_cond_signal(&s->wakeup);
+            pthread_mutex_unlock(&s->mutex);
+        }
+        return readb;
+    }
+
     pthread_mutex_lock(&s->mutex);
 
     if (cache->pos != s->read_filepos)
         MP_ERR(s, "!!! read_filepos differs !!! report this bug...\n");
 
-    int readb = 0;
     if (max_len > 0) {
         double retry_time = 0;
         int64_t retry = s->reads - 1; // try at least 1 read on EOF
         while (1) {
             readb = read_buffer(s, buffer, max_len, s->read_filepos);
-            s->read_filepos += readb;
+            atomic_add64(&s->read_filepos, readb);
+            atomic_add64(&s->stats.served_bytes, readb);
             if (readb > 0)
                 break;
             if (s->eof && s->read_filepos >= s->max_filepos && s->reads >= retry)
@@ -563,8 +1041,10 @@ static int cache_fill_buffer(struct stream *cache, char *buffer, int max_len)
         }
     }
 
-    // wakeup the cache thread, possibly make it read more data ahead
-    pthread_cond_signal(&s->wakeup);
+    // Wakeup the cache thread, possibly make it read more data ahead. If it's
+    // idle because the buffer is full, wait until a full read fits again.
+    if (!s->idle || s->eof || cache_free_space(s) >= MPMAX(s->read_chunk, FILL_LIMIT))
+        pthread_cond_signal(&s->wakeup);
     pthread_mutex_unlock(&s->mutex);
     return readb;
 }
@@ -613,6 +1093,8 @@ static int cache_control(stream_t *cache, int cmd, void *arg)
 
     MP_VERBOSE(s, "blocking for STREAM_CTRL %d\n", cmd);
 
+    MP_STATS(s, "start control");
+    double start = mp_time_sec();
     s->control = cmd;
     s->control_arg = arg;
     double retry = 0;
@@ -620,10 +1102,16 @@ static int cache_control(stream_t *cache, int cmd, void *arg)
         if (cache_wakeup_and_wait(s, &retry) == CACHE_INTERRUPTED) {
             s->eof = 1;
             r = STREAM_UNSUPPORTED;
+            MP_STATS(s, "end control");
             goto done;
         }
     }
     r = s->control_res;
+    double time = mp_time_sec() - start;
+    s->stats.controls++;
+    s->stats.control_time += time;
+    s->stats.control_time_max = MPMAX(s->stats.control_time_max, time);
+    MP_STATS(s, "end control");
     if (s->control_flush) {
         cache->pos = s->read_filepos;
         cache->eof = 0;
@@ -648,8 +1136,14 @@ static void cache_uninit(stream_t *cache)
     }
     pthread_mutex_destroy(&s->mutex);
     pthread_cond_destroy(&s->wakeup);
+    // Data that is still only in memory would be lost for the next session.
+    // (Stashed ranges were written when they were created.)
+    if (s->file_persistent)
+        spill_to_file(s, s->min_filepos, s->max_filepos);
     free(s->buffer);
     free(s->bm);
+    free(s->range_buffer);
+    cache_file_close(s->file);
     talloc_free(s);
 }
 
@@ -665,6 +1159,14 @@ int stream_cache_init(stream_t *cache, stream_t *stream, int64_t size,
     s->log = cache->log;
 
     s->seek_limit = seek_limit;
+    s->read_chunk = stream->read_chunk;
+    s->seekable = (stream->flags & MP_STREAM_SEEK) == MP_STREAM_SEEK &&
+                  stream->end_pos > 0;
+
+    // Ranges are read back without the underlying stream, which works only
+    // if the stream position can be restored with a seek.
+    if (s->seekable && cache->opts)
+        s->max_ranges = cache->opts->stream_cache_max_ranges;
 
     if (resize_cache(s, size) != STREAM_OK) {
         MP_ERR(s, "Failed to allocate cache buffer.\n");
@@ -675,6 +1177,32 @@ int stream_cache_init(stream_t *cache, stream_t *stream, int64_t size,
     MP_INFO(cache, "Cache size set to %" PRId64 " KiB\n",
             s->buffer_size / 1024);
 
+    // Like ranges, the cache file needs seeking to resume reading the stream.
+    struct MPOpts *opts = cache->opts;
+    if (s->seekable && opts && opts->stream_cache_dir &&
+        opts->stream_cache_dir[0] && stream->streaming && stream->url)
+    {
+        // The size is checked too, because it's the only validator that
+        // is available for all stream types.
+        char *dir = mp_get_user_path(NULL, cache->global, opts->stream_cache_dir);
+        s->file = cache_file_open_persistent(s, s->log, dir, stream->url,
+                                             stream->mime_type,
+                                             opts->stream_cache_file_size * 1024LL,
+                                             opts->stream_cache_dir_size * 1024LL * 1024,
+                                             stream->end_pos);
+        s->file_persistent = !!s->file;
+        talloc_free(dir);
+    }
+    if (!s->file && s->seekable && opts && opts->stream_cache_file &&
+        opts->stream_cache_file[0])
+    {
+        s->file = cache_file_open(s, s->log, opts->stream_cache_file,
+                                  opts->stream_cache_file_size * 1024LL,
+                                  stream->end_pos);
+    }
+    if (s->file)
+        update_file_ranges(s);
+
     pthread_mutex_init(&s->mutex, NULL);
     pthread_cond_init(&s->wakeup, NULL);
 
@@ -690,9 +1218,6 @@ int stream_cache_init(stream_t *cache, stream_t *stream, int64_t size,
     if (min > s->buffer_size - FILL_LIMIT)
         min = s->buffer_size - FILL_LIMIT;
 
-    s->seekable = (stream->flags & MP_STREAM_SEEK) == MP_STREAM_SEEK &&
-                  stream->end_pos > 0;
-
     if (pthread_create(&s->cache_thread, NULL, cache_thread, s) != 0) {
         MP_ERR(s, "Starting cache process/thread failed: %s.\n",
                strerror(errno));
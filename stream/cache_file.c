@@ -0,0 +1,483 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include <libavutil/md5.h>
+
+#include "config.h"
+
+#include "talloc.h"
+#include "osdep/io.h"
+#include "common/common.h"
+#include "common/msg.h"
+#include "bstr/bstr.h"
+#include "options/path.h"
+
+#include "cache_file.h"
+
+#define INDEX_HEADER "# mpv cache index v1"
+
+struct cache_file {
+    struct mp_log *log;
+    FILE *file;
+    int fd;
+    int64_t size_limit;
+    struct stream_range *ranges;    // cached parts of the file (sorted)
+    int num_ranges;
+    int64_t cached;                 // sum of all range sizes
+    bool write_error;               // don't try to write again after failure
+
+    // Persistent cache only
+    char *dir;
+    char *key;                      // base filename of the entry
+    char *url;
+    char *validator;
+    int64_t stream_size;
+    int64_t dir_size_limit;
+};
+
+void stream_ranges_add(void *talloc_ctx, struct stream_range **ranges,
+                       int *num_ranges, int64_t start, int64_t end)
+{
+    if (start >= end)
+        return;
+    int n = 0;
+    while (n < *num_ranges && (*ranges)[n].end < start)
+        n++;
+    while (n < *num_ranges && (*ranges)[n].start <= end) {
+        start = MPMIN(start, (*ranges)[n].start);
+        end = MPMAX(end, (*ranges)[n].end);
+        MP_TARRAY_REMOVE_AT(*ranges, *num_ranges, n);
+    }
+    MP_TARRAY_INSERT_AT(talloc_ctx, *ranges, *num_ranges, n,
+                        (struct stream_range){start, end});
+}
+
+static bool write_at(struct cache_file *cf, int64_t pos, char *data,
+                     int64_t len)
+{
+    if (lseek(cf->fd, pos, SEEK_SET) != pos)
+        return false;
+    while (len > 0) {
+        ssize_t r = write(cf->fd, data, MPMIN(len, 1 << 30));
+        if (r <= 0)
+            return false;
+        data += r;
+        len -= r;
+    }
+    return true;
+}
+
+static void update_cached(struct cache_file *cf)
+{
+    cf->cached = 0;
+    for (int n = 0; n < cf->num_ranges; n++)
+        cf->cached += cf->ranges[n].end - cf->ranges[n].start;
+}
+
+// Tell the OS that the given part of the file isn't needed anymore.
+static void discard_data(struct cache_file *cf, int64_t start, int64_t end)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+    fallocate(cf->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              start, end - start);
+#endif
+}
+
+// Remove data from the ranges furthest away from keep_pos until the file
+// respects the size limit.
+static void enforce_limit(struct cache_file *cf, int64_t keep_pos)
+{
+    while (cf->cached > cf->size_limit && cf->num_ranges) {
+        int far = 0;
+        int64_t far_dist = -1;
+        for (int n = 0; n < cf->num_ranges; n++) {
+            struct stream_range *r = &cf->ranges[n];
+            int64_t dist = MPMAX(keep_pos - r->start, r->end - keep_pos);
+            if (dist > far_dist) {
+                far = n;
+                far_dist = dist;
+            }
+        }
+        struct stream_range *r = &cf->ranges[far];
+        int64_t excess = cf->cached - cf->size_limit;
+        if (keep_pos - r->start > r->end - keep_pos) {
+            int64_t cut = MPMIN(excess, r->end - r->start);
+            discard_data(cf, r->start, r->start + cut);
+            r->start += cut;
+        } else {
+            int64_t cut = MPMIN(excess, r->end - r->start);
+            discard_data(cf, r->end - cut, r->end);
+            r->end -= cut;
+        }
+        if (r->start >= r->end)
+            MP_TARRAY_REMOVE_AT(cf->ranges, cf->num_ranges, far);
+        update_cached(cf);
+    }
+}
+
+void cache_file_write(struct cache_file *cf, int64_t pos, void *data,
+                      int64_t len, int64_t keep_pos)
+{
+    if (cf->write_error)
+        return;
+    int64_t end = pos + len;
+    int n = 0;
+    while (pos < end) {
+        // Skip parts that are already in the file.
+        while (n < cf->num_ranges && cf->ranges[n].end <= pos)
+            n++;
+        if (n < cf->num_ranges && cf->ranges[n].start <= pos) {
+            int64_t skip = MPMIN(cf->ranges[n].end, end) - pos;
+            data = (char *)data + skip;
+            pos += skip;
+            continue;
+        }
+        int64_t gap_end = end;
+        if (n < cf->num_ranges)
+            gap_end = MPMIN(gap_end, cf->ranges[n].start);
+        if (!write_at(cf, pos, data, gap_end - pos)) {
+            MP_ERR(cf, "Error writing cache file: %s\n", strerror(errno));
+            cf->write_error = true;
+            break;
+        }
+        stream_ranges_add(cf, &cf->ranges, &cf->num_ranges, pos, gap_end);
+        data = (char *)data + (gap_end - pos);
+        pos = gap_end;
+    }
+    update_cached(cf);
+    enforce_limit(cf, keep_pos);
+}
+
+int64_t cache_file_available(struct cache_file *cf, int64_t pos)
+{
+    for (int n = 0; n < cf->num_ranges; n++) {
+        struct stream_range *r = &cf->ranges[n];
+        if (pos >= r->start && pos < r->end)
+            return r->end - pos;
+    }
+    return 0;
+}
+
+int64_t cache_file_read(struct cache_file *cf, int64_t pos, void *dst,
+                        int64_t len)
+{
+    len = MPMIN(len, cache_file_available(cf, pos));
+    if (len <= 0 || lseek(cf->fd, pos, SEEK_SET) != pos)
+        return 0;
+    int64_t total = 0;
+    while (total < len) {
+        ssize_t r = read(cf->fd, (char *)dst + total, MPMIN(len - total, 1 << 30));
+        if (r <= 0) {
+            MP_ERR(cf, "Error reading cache file: %s\n", strerror(errno));
+            break;
+        }
+        total += r;
+    }
+    return total;
+}
+
+void cache_file_drop(struct cache_file *cf)
+{
+    for (int n = 0; n < cf->num_ranges; n++)
+        discard_data(cf, cf->ranges[n].start, cf->ranges[n].end);
+    cf->num_ranges = 0;
+    cf->cached = 0;
+}
+
+const struct stream_range *cache_file_get_ranges(struct cache_file *cf,
+                                                 int *num_ranges)
+{
+    *num_ranges = cf->num_ranges;
+    return cf->ranges;
+}
+
+static struct cache_file *create(void *talloc_ctx, struct mp_log *log,
+                                 int64_t size_limit, int64_t stream_size)
+{
+    struct cache_file *cf = talloc_zero(talloc_ctx, struct cache_file);
+    cf->log = log;
+    cf->size_limit = size_limit;
+    cf->stream_size = stream_size;
+    return cf;
+}
+
+// Preallocate the whole file. Since nothing is written yet, this doesn't use
+// disk space on filesystems supporting sparse files.
+static void init_file(struct cache_file *cf)
+{
+    cf->fd = fileno(cf->file);
+    if (cf->stream_size > 0 && ftruncate(cf->fd, cf->stream_size) != 0)
+        MP_WARN(cf, "Could not resize cache file: %s\n", strerror(errno));
+}
+
+struct cache_file *cache_file_open(void *talloc_ctx, struct mp_log *log,
+                                   const char *path, int64_t size_limit,
+                                   int64_t stream_size)
+{
+    struct cache_file *cf = create(talloc_ctx, log, size_limit, stream_size);
+
+    if (strcmp(path, "TMP") == 0) {
+        cf->file = tmpfile();
+    } else {
+        cf->file = fopen(path, "wb+");
+    }
+    if (!cf->file) {
+        MP_ERR(cf, "can't open cache file '%s': %s\n", path, strerror(errno));
+        talloc_free(cf);
+        return NULL;
+    }
+    init_file(cf);
+
+    MP_VERBOSE(cf, "Using cache file '%s' (up to %"PRId64" KiB).\n", path,
+               size_limit / 1024);
+    return cf;
+}
+
+struct index {
+    char *url;
+    char *validator;
+    int64_t stream_size;
+    struct stream_range *ranges;
+    int num_ranges;
+    bool clean;     // written by cache_file_close()
+};
+
+// Parse an index file as written by write_index(). Returns false if the file
+// can't be read, or is not an index file.
+static bool read_index(void *talloc_ctx, const char *path, struct index *idx)
+{
+    *idx = (struct index){0};
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+    char line[4096];
+    bool ok = fgets(line, sizeof(line), f) &&
+              bstr_equals0(bstr_strip(bstr0(line)), INDEX_HEADER);
+    while (ok && fgets(line, sizeof(line), f)) {
+        bstr l = bstr_strip(bstr0(line));
+        bstr val;
+        int64_t start, end;
+        if (bstr_split_tok(l, "=", &l, &val)) {
+            if (bstr_equals0(l, "url")) {
+                idx->url = bstrdup0(talloc_ctx, val);
+            } else if (bstr_equals0(l, "validator")) {
+                idx->validator = bstrdup0(talloc_ctx, val);
+            } else if (bstr_equals0(l, "size")) {
+                idx->stream_size = bstrtoll(val, NULL, 10);
+            } else if (bstr_equals0(l, "clean")) {
+                idx->clean = bstr_equals0(val, "yes");
+            } else if (bstr_equals0(l, "range") &&
+                       sscanf(val.start, "%"SCNd64"-%"SCNd64, &start, &end) == 2)
+            {
+                stream_ranges_add(talloc_ctx, &idx->ranges, &idx->num_ranges,
+                                  start, end);
+            }
+        }
+    }
+    fclose(f);
+    return ok && idx->url;
+}
+
+// Write the index to a temporary file first, so that a crash doesn't leave
+// behind a broken index. clean must be set only if the ranges can't change
+// anymore, i.e. when closing. While the cache is in use, data is discarded to
+// enforce the size limit, and an index left behind by a crash can't be
+// trusted.
+static void write_index(struct cache_file *cf, bool clean)
+{
+    void *tmp = talloc_new(NULL);
+    char *path = talloc_asprintf(tmp, "%s/%s.idx", cf->dir, cf->key);
+    char *tmp_path = talloc_asprintf(tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) {
+        MP_ERR(cf, "Can't write cache index '%s': %s\n", tmp_path,
+               strerror(errno));
+        goto done;
+    }
+    fprintf(f, "%s\n", INDEX_HEADER);
+    fprintf(f, "url=%s\n", cf->url);
+    fprintf(f, "size=%"PRId64"\n", cf->stream_size);
+    fprintf(f, "validator=%s\n", cf->validator);
+    fprintf(f, "clean=%s\n", clean ? "yes" : "no");
+    for (int n = 0; n < cf->num_ranges; n++) {
+        fprintf(f, "range=%"PRId64"-%"PRId64"\n", cf->ranges[n].start,
+                cf->ranges[n].end);
+    }
+    bool ok = !ferror(f);
+    ok &= fclose(f) == 0;
+    // On Windows, rename() doesn't replace existing files.
+    unlink(path);
+    if (!ok || rename(tmp_path, path) != 0) {
+        MP_ERR(cf, "Can't write cache index '%s'.\n", path);
+        unlink(tmp_path);
+    }
+done:
+    talloc_free(tmp);
+}
+
+static void remove_entry(const char *dir, const char *key)
+{
+    char *path = talloc_asprintf(NULL, "%s/%s.idx", dir, key);
+    unlink(path);
+    talloc_free(path);
+    path = talloc_asprintf(NULL, "%s/%s.data", dir, key);
+    unlink(path);
+    talloc_free(path);
+}
+
+struct entry {
+    char *key;
+    int64_t size;
+    int64_t mtime;
+};
+
+static int compare_entry(const void *a, const void *b)
+{
+    const struct entry *e1 = a, *e2 = b;
+    return e1->mtime > e2->mtime ? 1 : (e1->mtime < e2->mtime ? -1 : 0);
+}
+
+// Remove least recently used entries until the cache directory is within the
+// size limit. The entry of cf itself is never removed.
+static void evict_entries(struct cache_file *cf)
+{
+    void *tmp = talloc_new(NULL);
+    DIR *d = opendir(cf->dir);
+    if (!d)
+        goto done;
+    struct entry *entries = NULL;
+    int num_entries = 0;
+    int64_t total = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        bstr name = bstr0(de->d_name);
+        if (!bstr_endswith0(name, ".idx"))
+            continue;
+        bstr key = bstr_splice(name, 0, -4);
+        char *path = talloc_asprintf(tmp, "%s/%s", cf->dir, de->d_name);
+        struct stat st;
+        struct index idx;
+        if (stat(path, &st) != 0 || !read_index(tmp, path, &idx))
+            continue;
+        struct entry e = {.key = bstrdup0(tmp, key), .mtime = st.st_mtime};
+        for (int n = 0; n < idx.num_ranges; n++)
+            e.size += idx.ranges[n].end - idx.ranges[n].start;
+        total += e.size;
+        MP_TARRAY_APPEND(tmp, entries, num_entries, e);
+    }
+    closedir(d);
+
+    qsort(entries, num_entries, sizeof(entries[0]), compare_entry);
+    for (int n = 0; n < num_entries && total > cf->dir_size_limit; n++) {
+        if (strcmp(entries[n].key, cf->key) == 0)
+            continue;
+        MP_VERBOSE(cf, "Removing cache entry %s.\n", entries[n].key);
+        remove_entry(cf->dir, entries[n].key);
+        total -= entries[n].size;
+    }
+done:
+    talloc_free(tmp);
+}
+
+struct cache_file *cache_file_open_persistent(void *talloc_ctx,
+                                              struct mp_log *log,
+                                              const char *dir,
+                                              const char *url,
+                                              const char *validator,
+                                              int64_t size_limit,
+                                              int64_t dir_size_limit,
+                                              int64_t stream_size)
+{
+    struct cache_file *cf = create(talloc_ctx, log, size_limit, stream_size);
+    cf->dir = talloc_strdup(cf, dir);
+    cf->url = talloc_strdup(cf, url);
+    cf->validator = talloc_strdup(cf, validator ? validator : "");
+    cf->dir_size_limit = dir_size_limit;
+
+    uint8_t md5[16];
+    av_md5_sum(md5, url, strlen(url));
+    cf->key = talloc_strdup(cf, "");
+    for (int i = 0; i < 16; i++)
+        cf->key = talloc_asprintf_append(cf->key, "%02X", md5[i]);
+
+    if (!mp_path_isdir(dir))
+        mkdir(dir, 0700);
+
+    char *data_path = talloc_asprintf(cf, "%s/%s.data", dir, cf->key);
+    char *index_path = talloc_asprintf(cf, "%s/%s.idx", dir, cf->key);
+
+    // Reuse the data only if the stream still looks the same.
+    struct index idx;
+    if (read_index(cf, index_path, &idx)) {
+        if (strcmp(idx.url, url) == 0 && idx.stream_size == stream_size &&
+            strcmp(idx.validator ? idx.validator : "", cf->validator) == 0)
+        {
+            cf->file = fopen(data_path, "rb+");
+            if (!idx.clean) {
+                MP_WARN(cf, "Cache entry was not closed properly, discarding "
+                        "cached data.\n");
+                idx.num_ranges = 0;
+            }
+        } else {
+            MP_VERBOSE(cf, "Stream changed, discarding cached data.\n");
+        }
+    }
+    if (cf->file) {
+        cf->ranges = talloc_steal(cf, idx.ranges);
+        cf->num_ranges = idx.num_ranges;
+        update_cached(cf);
+    } else {
+        cf->file = fopen(data_path, "wb+");
+    }
+    if (!cf->file) {
+        MP_ERR(cf, "can't open cache file '%s': %s\n", data_path,
+               strerror(errno));
+        talloc_free(cf);
+        return NULL;
+    }
+    init_file(cf);
+    // Mark the entry as recently used (for eviction), and as in use.
+    write_index(cf, false);
+
+    MP_VERBOSE(cf, "Using cache entry '%s' with %"PRId64" KiB of data.\n",
+               data_path, cf->cached / 1024);
+    return cf;
+}
+
+void cache_file_close(struct cache_file *cf)
+{
+    if (!cf)
+        return;
+    fclose(cf->file);
+    if (cf->dir) {
+        write_index(cf, true);
+        evict_entries(cf);
+    }
+    talloc_free(cf);
+}
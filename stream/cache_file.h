@@ -0,0 +1,81 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_CACHE_FILE_H
+#define MP_CACHE_FILE_H
+
+#include <stdint.h>
+
+#include "stream.h"
+
+struct mp_log;
+
+// On-disk cache tier used by stream/cache.c. Data is stored in a (sparse) file
+// at the same position as in the stream, and the cached parts are tracked as
+// list of byte ranges. Not thread-safe; the caller has to synchronize access.
+struct cache_file;
+
+// path: filename, or "TMP" for an anonymous temporary file
+// size_limit: max. number of bytes kept in the file
+// stream_size: size of the stream, or <= 0 if unknown
+struct cache_file *cache_file_open(void *talloc_ctx, struct mp_log *log,
+                                   const char *path, int64_t size_limit,
+                                   int64_t stream_size);
+
+// Like cache_file_open(), but use (and keep) the entry for the given URL in
+// the directory dir. If an entry exists, and url, validator and stream_size
+// match, the data cached by previous sessions is reused. On close, least
+// recently used entries are removed until the directory holds at most
+// dir_size_limit bytes of cached data.
+// validator: opaque string identifying the stream contents (may be NULL)
+struct cache_file *cache_file_open_persistent(void *talloc_ctx,
+                                              struct mp_log *log,
+                                              const char *dir,
+                                              const char *url,
+                                              const char *validator,
+                                              int64_t size_limit,
+                                              int64_t dir_size_limit,
+                                              int64_t stream_size);
+
+void cache_file_close(struct cache_file *cf);
+
+// Write data at the given stream position. Parts which are already cached
+// are not written again. If the size limit is exceeded, the data furthest
+// away from keep_pos is discarded.
+void cache_file_write(struct cache_file *cf, int64_t pos, void *data,
+                      int64_t len, int64_t keep_pos);
+
+// Return the number of bytes that can be read from the file at pos.
+int64_t cache_file_available(struct cache_file *cf, int64_t pos);
+
+// Read at most len bytes at pos. Returns the number of bytes read.
+int64_t cache_file_read(struct cache_file *cf, int64_t pos, void *dst,
+                        int64_t len);
+
+// Forget all cached data.
+void cache_file_drop(struct cache_file *cf);
+
+// Return the sorted list of ranges that are stored in the file.
+const struct stream_range *cache_file_get_ranges(struct cache_file *cf,
+                                                 int *num_ranges);
+
+// Add [start, end) to a sorted list of non-overlapping ranges. Overlapping
+// and adjacent entries are merged.
+void stream_ranges_add(void *talloc_ctx, struct stream_range **ranges,
+                       int *num_ranges, int64_t start, int64_t end);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "talloc.h"
+#include "common/common.h"
+#include "common/msg.h"
+
+#include "file_readahead.h"
+
+// Size of a single read request. Requests are aligned to this size.
+#define BLOCK_SIZE (512 * 1024)
+
+enum block_state {
+    BLOCK_FREE,         // unused
+    BLOCK_QUEUED,       // waiting for a worker to pick it up
+    BLOCK_READING,      // a worker is reading into it
+    BLOCK_DONE,         // data (or error) available
+};
+
+struct block {
+    enum block_state state;
+    int64_t pos;        // file position of data[0], multiple of BLOCK_SIZE
+    int len;            // number of bytes read (if BLOCK_DONE), -1 on error
+    char *data;
+};
+
+struct mp_readahead {
+    struct mp_log *log;
+    int fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // signaled if a block was queued, or on quit
+    pthread_cond_t done;    // signaled if a block was read
+    bool quit;
+
+    pthread_t *threads;
+    int num_threads;
+
+    struct block *blocks;
+    int num_blocks;
+};
+
+#ifndef __MINGW32__
+
+static void *worker_thread(void *arg)
+{
+    struct mp_readahead *ra = arg;
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->quit) {
+        // Serve the request closest to the read position first.
+        struct block *b = NULL;
+        for (int n = 0; n < ra->num_blocks; n++) {
+            struct block *c = &ra->blocks[n];
+            if (c->state == BLOCK_QUEUED && (!b || c->pos < b->pos))
+                b = c;
+        }
+        if (!b) {
+            pthread_cond_wait(&ra->work, &ra->lock);
+            continue;
+        }
+        b->state = BLOCK_READING;
+        int64_t pos = b->pos;
+        pthread_mutex_unlock(&ra->lock);
+
+        int len = 0;
+        while (len < BLOCK_SIZE) {
+            ssize_t r = pread(ra->fd, b->data + len, BLOCK_SIZE - len, pos + len);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0) {
+                MP_ERR(ra, "Error reading file: %s\n", strerror(errno));
+                len = -1;
+                break;
+            }
+            if (r == 0)
+                break;
+            len += r;
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        b->len = len;
+        b->state = BLOCK_DONE;
+        pthread_cond_broadcast(&ra->done);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+static struct block *find_block(struct mp_readahead *ra, int64_t pos)
+{
+    for (int n = 0; n < ra->num_blocks; n++) {
+        struct block *b = &ra->blocks[n];
+        if (b->state != BLOCK_FREE && b->pos == pos)
+            return b;
+    }
+    return NULL;
+}
+
+// Queue reads for the blocks following (and including) the one at pos.
+// Blocks outside of this window are recycled, unless they're being read.
+static void schedule(struct mp_readahead *ra, int64_t pos)
+{
+    int64_t start = pos - pos % BLOCK_SIZE;
+    int64_t end = start + ra->num_blocks * (int64_t)BLOCK_SIZE;
+    bool queued = false;
+    for (int64_t bpos = start; bpos < end; bpos += BLOCK_SIZE) {
+        if (find_block(ra, bpos))
+            continue;
+        struct block *b = NULL;
+        for (int n = 0; n < ra->num_blocks; n++) {
+            struct block *c = &ra->blocks[n];
+            if (c->state == BLOCK_FREE ||
+                (c->state != BLOCK_READING && (c->pos < start || c->pos >= end)))
+            {
+                b = c;
+                break;
+            }
+        }
+        if (!b)
+            break;
+        *b = (struct block){
+            .state = BLOCK_QUEUED,
+            .pos = bpos,
+            .data = b->data,
+        };
+        queued = true;
+    }
+    if (queued)
+        pthread_cond_broadcast(&ra->work);
+}
+
+int mp_readahead_read(struct mp_readahead *ra, int64_t pos, char *buf, int len)
+{
+    int res = 0;
+    pthread_mutex_lock(&ra->lock);
+    struct block *b;
+    while (1) {
+        schedule(ra, pos);
+        b = find_block(ra, pos - pos % BLOCK_SIZE);
+        if (b && b->state == BLOCK_DONE)
+            break;
+        // Either the block is being read, or all blocks are still busy with
+        // reads for a previous position (after a seek).
+        pthread_cond_wait(&ra->done, &ra->lock);
+    }
+    // Copy from this block and following blocks that are already available.
+    while (b && b->state == BLOCK_DONE && res < len) {
+        if (b->len < 0) {
+            b->state = BLOCK_FREE;
+            if (!res)
+                res = -1;
+            break;
+        }
+        int64_t avail = b->pos + b->len - pos;
+        if (avail <= 0) {
+            // EOF. Free the block so that data appended to the file in the
+            // meantime is picked up by the next read.
+            b->state = BLOCK_FREE;
+            break;
+        }
+        int copy = MPMIN(avail, len - res);
+        memcpy(buf + res, b->data + (pos - b->pos), copy);
+        res += copy;
+        pos += copy;
+        if (b->len < BLOCK_SIZE) {
+            if (pos == b->pos + b->len)
+                b->state = BLOCK_FREE; // see EOF case above
+            break;
+        }
+        b = find_block(ra, pos - pos % BLOCK_SIZE);
+    }
+    // Make sure the next blocks are requested as soon as possible.
+    schedule(ra, pos);
+    pthread_mutex_unlock(&ra->lock);
+    return res;
+}
+
+struct mp_readahead *mp_readahead_create(void *talloc_ctx, struct mp_log *log,
+                                         int fd, int num_requests)
+{
+    struct mp_readahead *ra = talloc_zero(talloc_ctx, struct mp_readahead);
+    ra->log = log;
+    ra->fd = fd;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->work, NULL);
+    pthread_cond_init(&ra->done, NULL);
+
+    ra->num_blocks = num_requests;
+    ra->blocks = talloc_zero_array(ra, struct block, ra->num_blocks);
+    for (int n = 0; n < ra->num_blocks; n++)
+        ra->blocks[n].data = talloc_size(ra->blocks, BLOCK_SIZE);
+
+    ra->threads = talloc_array(ra, pthread_t, num_requests);
+    for (int n = 0; n < num_requests; n++) {
+        if (pthread_create(&ra->threads[n], NULL, worker_thread, ra))
+            break;
+        ra->num_threads++;
+    }
+    if (!ra->num_threads) {
+        MP_ERR(ra, "Failed to create read-ahead threads.\n");
+        mp_readahead_destroy(ra);
+        return NULL;
+    }
+    MP_VERBOSE(ra, "Reading ahead with %d requests of %d KiB.\n",
+               ra->num_blocks, BLOCK_SIZE / 1024);
+    return ra;
+}
+
+void mp_readahead_destroy(struct mp_readahead *ra)
+{
+    if (!ra)
+        return;
+    pthread_mutex_lock(&ra->lock);
+    ra->quit = true;
+    pthread_cond_broadcast(&ra->work);
+    pthread_mutex_unlock(&ra->lock);
+    for (int n = 0; n < ra->num_threads; n++)
+        pthread_join(ra->threads[n], NULL);
+    pthread_cond_destroy(&ra->done);
+    pthread_cond_destroy(&ra->work);
+    pthread_mutex_destroy(&ra->lock);
+    talloc_free(ra);
+}
+
+#else
+
+// No pread() on MinGW.
+struct mp_readahead *mp_readahead_create(void *talloc_ctx, struct mp_log *log,
+                                         int fd, int num_requests)
+{
+    return NULL;
+}
+
+void mp_readahead_destroy(struct mp_readahead *ra)
+{
+}
+
+int mp_readahead_read(struct mp_readahead *ra, int64_t pos, char *buf, int len)
+{
+    return -1;
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_FILE_READAHEAD_H
+#define MP_FILE_READAHEAD_H
+
+#include <stdint.h>
+
+struct mp_log;
+
+// Asynchronous read-ahead for file descriptors. A pool of worker threads
+// keeps a number of aligned block reads in flight ahead of the position that
+// was last read, so that storage with high latency or high parallelism (such
+// as network filesystems) is not limited to one request at a time.
+struct mp_readahead;
+
+// num_requests: number of blocks read ahead (and number of worker threads)
+// Returns NULL if not supported on this platform, or on failure.
+struct mp_readahead *mp_readahead_create(void *talloc_ctx, struct mp_log *log,
+                                         int fd, int num_requests);
+void mp_readahead_destroy(struct mp_readahead *ra);
+
+// Read up to len bytes at pos. Blocks until at least 1 byte is available.
+// Returns the number of bytes read, 0 on EOF, and -1 on error.
+int mp_readahead_read(struct mp_readahead *ra, int64_t pos, char *buf, int len);
+
+#endif
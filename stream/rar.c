@@ -28,21 +28,159 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include <libavutil/intreadwrite.h>
 
 #include "talloc.h"
 #include "common/common.h"
+#include "osdep/timer.h"
 #include "stream.h"
 #include "rar.h"
 
+/* The same archive is usually parsed twice in a row: by the stream filter,
+ * which lists the contained files, and again when opening one of them. With
+ * many volumes, walking all the headers is slow, so the last result is kept
+ * for a short time. */
+#define PARSE_CACHE_TIME 30.0
+
+static pthread_mutex_t parse_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct parse_cache {
+    char *url;
+    int64_t size;       /* size of the first volume */
+    double time;
+    int count;
+    rar_file_t **files;
+} parse_cache;
+
 static const uint8_t rar_marker[] = {
     0x52, 0x61, 0x72, 0x21, 0x1a, 0x07, 0x00
 };
 static const int rar_marker_size = sizeof(rar_marker);
 
+/* Cancelled prefetches are detached and clean up after themselves. They are
+ * counted, so that RarUninit() can wait until none of them uses the global
+ * context anymore. */
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_wakeup = PTHREAD_COND_INITIALIZER;
+static int prefetch_detached;
+
+struct rar_prefetch {
+    pthread_t thread;
+    struct mpv_global *global;
+    char *mrl;
+    uint64_t offset;
+    // protected by prefetch_lock
+    bool cancel;
+    bool done;
+    stream_t *s;        // opened volume (NULL on failure)
+};
+
+static bool PrefetchCancelled(struct rar_prefetch *pf)
+{
+    pthread_mutex_lock(&prefetch_lock);
+    bool cancel = pf->cancel;
+    pthread_mutex_unlock(&prefetch_lock);
+    return cancel;
+}
+
+static void *PrefetchThread(void *arg)
+{
+    struct rar_prefetch *pf = arg;
+    stream_t *s = NULL;
+    if (!PrefetchCancelled(pf))
+        s = stream_create(pf->mrl, STREAM_READ | STREAM_NO_FILTERS, pf->global);
+    if (s && !PrefetchCancelled(pf))
+        stream_seek(s, pf->offset);
+
+    pthread_mutex_lock(&prefetch_lock);
+    pf->s = s;
+    pf->done = true;
+    bool cancel = pf->cancel;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    if (cancel) {
+        free_stream(s);
+        talloc_free(pf);
+        pthread_mutex_lock(&prefetch_lock);
+        prefetch_detached--;
+        pthread_cond_broadcast(&prefetch_wakeup);
+        pthread_mutex_unlock(&prefetch_lock);
+    }
+    return NULL;
+}
+
+/* Wait for the prefetch thread, and return its stream if it opened mrl */
+static stream_t *PrefetchTake(rar_file_t *file, const char *mrl)
+{
+    struct rar_prefetch *pf = file->prefetch;
+    if (!pf)
+        return NULL;
+    pthread_join(pf->thread, NULL);
+    stream_t *s = pf->s;
+    if (s && strcmp(pf->mrl, mrl)) {
+        free_stream(s);
+        s = NULL;
+    }
+    talloc_free(pf);
+    file->prefetch = NULL;
+    return s;
+}
+
+/* Drop the prefetch without waiting for a volume that is still being opened */
+static void PrefetchCancel(rar_file_t *file)
+{
+    struct rar_prefetch *pf = file->prefetch;
+    if (!pf)
+        return;
+    file->prefetch = NULL;
+
+    pthread_mutex_lock(&prefetch_lock);
+    bool done = pf->done;
+    if (!done) {
+        pf->cancel = true;
+        prefetch_detached++;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    if (done) {
+        pthread_join(pf->thread, NULL);
+        free_stream(pf->s);
+        talloc_free(pf);
+    } else {
+        pthread_detach(pf->thread);
+    }
+}
+
+/* Open the volume of the given chunk in the background, so that reading
+ * doesn't stall when crossing the volume boundary. */
+static void PrefetchStart(rar_file_t *file, int chunk_index)
+{
+    if (chunk_index >= file->chunk_count)
+        return;
+    const rar_file_chunk_t *chunk = file->chunk[chunk_index];
+    if (!strcmp(chunk->mrl, file->current_chunk->mrl))
+        return;
+    if (file->prefetch && !strcmp(file->prefetch->mrl, chunk->mrl))
+        return;
+    PrefetchCancel(file);
+
+    struct rar_prefetch *pf = talloc_ptrtype(NULL, pf);
+    *pf = (struct rar_prefetch){
+        .global = file->global,
+        .mrl = talloc_strdup(pf, chunk->mrl),
+        .offset = chunk->offset,
+    };
+    if (pthread_create(&pf->thread, NULL, PrefetchThread, pf)) {
+        talloc_free(pf);
+        return;
+    }
+    file->prefetch = pf;
+}
+
 void RarFileDelete(rar_file_t *file)
 {
+    PrefetchCancel(file);
     for (int i = 0; i < file->chunk_count; i++) {
         free(file->chunk[i]->mrl);
         free(file->chunk[i]);
@@ -306,7 +444,7 @@ static const rar_pattern_t *FindVolumePattern(const char *location)
     return NULL;
 }
 
-int RarParse(struct stream *s, int *count, rar_file_t ***file)
+static int ParseVolumes(struct stream *s, int *count, rar_file_t ***file)
 {
     *count = 0;
     *file = NULL;
@@ -401,18 +539,109 @@ done:
     return 0;
 }
 
+/* Binary search for the chunk containing position (or the last chunk) */
+static int FindChunk(const rar_file_t *file, uint64_t position)
+{
+    int lo = 0, hi = file->chunk_count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const rar_file_chunk_t *chunk = file->chunk[mid];
+        if (position < chunk->cummulated_size + chunk->size)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Copy the parsed data of the files (not the reading state) */
+static rar_file_t **CopyFiles(rar_file_t **files, int count)
+{
+    rar_file_t **res = talloc_zero_array(NULL, rar_file_t *, count);
+    for (int n = 0; n < count; n++) {
+        const rar_file_t *src = files[n];
+        rar_file_t *dst = calloc(1, sizeof(*dst));
+        if (!dst)
+            abort();
+        dst->name = strdup(src->name);
+        dst->size = src->size;
+        dst->is_complete = src->is_complete;
+        dst->real_size = src->real_size;
+        for (int i = 0; i < src->chunk_count; i++) {
+            rar_file_chunk_t *chunk = malloc(sizeof(*chunk));
+            if (!chunk)
+                abort();
+            *chunk = *src->chunk[i];
+            chunk->mrl = strdup(chunk->mrl);
+            MP_TARRAY_APPEND(NULL, dst->chunk, dst->chunk_count, chunk);
+        }
+        res[n] = dst;
+    }
+    return res;
+}
+
+static void ParseCacheClear(void)
+{
+    for (int n = 0; n < parse_cache.count; n++)
+        RarFileDelete(parse_cache.files[n]);
+    talloc_free(parse_cache.files);
+    talloc_free(parse_cache.url);
+    parse_cache = (struct parse_cache){0};
+}
+
+/* Free the parse cache, and wait for cancelled prefetches to exit */
+void RarUninit(void)
+{
+    pthread_mutex_lock(&parse_cache_lock);
+    ParseCacheClear();
+    pthread_mutex_unlock(&parse_cache_lock);
+
+    pthread_mutex_lock(&prefetch_lock);
+    while (prefetch_detached)
+        pthread_cond_wait(&prefetch_wakeup, &prefetch_lock);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+int RarParse(struct stream *s, int *count, rar_file_t ***file)
+{
+    pthread_mutex_lock(&parse_cache_lock);
+    if (parse_cache.url && mp_time_sec() - parse_cache.time > PARSE_CACHE_TIME)
+        ParseCacheClear();
+    if (parse_cache.url && !strcmp(parse_cache.url, s->url) &&
+        parse_cache.size == s->end_pos)
+    {
+        *count = parse_cache.count;
+        *file = CopyFiles(parse_cache.files, parse_cache.count);
+        pthread_mutex_unlock(&parse_cache_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&parse_cache_lock);
+
+    int r = ParseVolumes(s, count, file);
+    if (r == 0 && s->end_pos > 0) {
+        pthread_mutex_lock(&parse_cache_lock);
+        ParseCacheClear();
+        parse_cache.url = talloc_strdup(NULL, s->url);
+        parse_cache.size = s->end_pos;
+        parse_cache.time = mp_time_sec();
+        parse_cache.count = *count;
+        parse_cache.files = CopyFiles(*file, *count);
+        pthread_mutex_unlock(&parse_cache_lock);
+    }
+    return r;
+}
+
 int  RarSeek(rar_file_t *file, uint64_t position)
 {
     if (position > file->real_size)
         position = file->real_size;
+    if (!file->chunk_count)
+        return 0;
 
     /* Search the chunk */
     const rar_file_chunk_t *old_chunk = file->current_chunk;
-    for (int i = 0; i < file->chunk_count; i++) {
-        file->current_chunk = file->chunk[i];
-        if (position < file->current_chunk->cummulated_size + file->current_chunk->size)
-            break;
-    }
+    int index = FindChunk(file, position);
+    file->current_chunk = file->chunk[index];
     file->i_pos = position;
 
     const uint64_t offset = file->current_chunk->offset +
@@ -421,10 +650,14 @@ int  RarSeek(rar_file_t *file, uint64_t position)
     if (strcmp(old_chunk->mrl, file->current_chunk->mrl)) {
         if (file->s)
             free_stream(file->s);
-        file->s = stream_create(file->current_chunk->mrl,
-                                STREAM_READ | STREAM_NO_FILTERS,
-                                file->global);
+        file->s = PrefetchTake(file, file->current_chunk->mrl);
+        if (!file->s) {
+            file->s = stream_create(file->current_chunk->mrl,
+                                    STREAM_READ | STREAM_NO_FILTERS,
+                                    file->global);
+        }
     }
+    PrefetchStart(file, index + 1);
     return file->s ? stream_seek(file->s, offset) : 0;
 }
 
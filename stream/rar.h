@@ -48,11 +48,13 @@ typedef struct {
     uint64_t i_pos;
     stream_t *s;
     rar_file_chunk_t *current_chunk;
+    struct rar_prefetch *prefetch; // next volume, opened in the background
 } rar_file_t;
 
 int  RarProbe(struct stream *);
 void RarFileDelete(rar_file_t *);
 int  RarParse(struct stream *, int *, rar_file_t ***);
+void RarUninit(void);
 
 int  RarSeek(rar_file_t *file, uint64_t position);
 ssize_t RarRead(rar_file_t *file, void *data, size_t size);
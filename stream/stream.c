@@ -47,9 +47,7 @@
 
 #include "options/m_option.h"
 #include "options/m_config.h"
-
-// Includes additional padding in case sizes get rounded up by sector size.
-#define TOTAL_BUFFER_SIZE (STREAM_MAX_BUFFER_SIZE + STREAM_MAX_SECTOR_SIZE)
+#include "options/options.h"
 
 /// We keep these 2 for the gui atm, but they will be removed.
 char *cdrom_device = NULL;
@@ -240,9 +238,21 @@ static bool parse_url(struct stream *st, struct m_config *config)
 
 static stream_t *new_stream(void)
 {
-    stream_t *s = talloc_size(NULL, sizeof(stream_t) + TOTAL_BUFFER_SIZE);
-    memset(s, 0, sizeof(stream_t));
-    return s;
+    return talloc_zero(NULL, stream_t);
+}
+
+// Make sure the local buffer can hold at least size bytes. The buffer
+// contents are preserved.
+static void stream_reserve_buffer(stream_t *s, int size)
+{
+    assert(size <= STREAM_MAX_BUFFER_SIZE);
+    if (size <= s->buffer_alloc)
+        return;
+    // Grow exponentially, so that probing with increasing sizes is cheap.
+    size = MPMIN(MPMAX(size, s->buffer_alloc * 2), STREAM_MAX_BUFFER_SIZE);
+    s->buffer = talloc_realloc_size(s, s->buffer,
+                                    size + STREAM_MAX_SECTOR_SIZE);
+    s->buffer_alloc = size;
 }
 
 static const char *match_proto(const char *url, const char *proto)
@@ -492,9 +502,10 @@ eof_out:
 static int stream_fill_buffer_by(stream_t *s, int64_t len)
 {
     len = MPMIN(len, s->read_chunk);
-    len = MPMAX(len, STREAM_BUFFER_SIZE);
+    len = MPMIN(MPMAX(len, STREAM_BUFFER_SIZE), STREAM_MAX_BUFFER_SIZE);
     if (s->sector_size)
         len = s->sector_size;
+    stream_reserve_buffer(s, len);
     len = stream_read_unbuffered(s, s->buffer, len);
     s->buf_pos = 0;
     s->buf_len = len;
@@ -503,7 +514,10 @@ static int stream_fill_buffer_by(stream_t *s, int64_t len)
 
 int stream_fill_buffer(stream_t *s)
 {
-    return stream_fill_buffer_by(s, STREAM_BUFFER_SIZE);
+    int size = STREAM_BUFFER_SIZE;
+    if (s->opts)
+        size = MPMAX(size, s->opts->stream_buffer_size * 1024);
+    return stream_fill_buffer_by(s, size);
 }
 
 // Read between 1..buf_size bytes of data, return how much data has been read.
@@ -547,6 +561,8 @@ int stream_read(stream_t *s, char *mem, int total)
 
 // Read ahead at most len bytes without changing the read position. Return a
 // pointer to the internal buffer, starting from the current read position.
+// If the stream provides direct access to its data (see stream.get_view),
+// the returned pointer may point into the stream's memory instead.
 // Can read ahead at most STREAM_MAX_BUFFER_SIZE bytes.
 // The returned buffer becomes invalid on the next stream call, and you must
 // not write to it.
@@ -554,16 +570,27 @@ struct bstr stream_peek(stream_t *s, int len)
 {
     assert(len >= 0);
     assert(len <= STREAM_MAX_BUFFER_SIZE);
+    if (s->buf_pos == s->buf_len && s->get_view) {
+        // Return the underlying memory directly if possible (zero-copy).
+        void *data = NULL;
+        int avail = s->get_view(s, s->pos, &data);
+        if (avail >= len || (avail > 0 && s->pos + avail >= s->end_pos)) {
+            s->eof = 0;
+            return (bstr){.start = data, .len = FFMIN(len, avail)};
+        }
+    }
     if (s->buf_len - s->buf_pos < len) {
         // Move to front to guarantee we really can read up to max size.
         int buf_valid = s->buf_len - s->buf_pos;
-        memmove(s->buffer, &s->buffer[s->buf_pos], buf_valid);
+        if (buf_valid)
+            memmove(s->buffer, &s->buffer[s->buf_pos], buf_valid);
+        stream_reserve_buffer(s, MPMAX(len, STREAM_BUFFER_SIZE));
         // Fill rest of the buffer.
         while (buf_valid < len) {
             int chunk = MPMAX(len - buf_valid, STREAM_BUFFER_SIZE);
             if (s->sector_size)
                 chunk = s->sector_size;
-            assert(buf_valid + chunk <= TOTAL_BUFFER_SIZE);
+            chunk = MPMIN(chunk, s->buffer_alloc + STREAM_MAX_SECTOR_SIZE - buf_valid);
             int read = stream_read_unbuffered(s, &s->buffer[buf_valid], chunk);
             if (read == 0)
                 break; // EOF
@@ -808,7 +835,7 @@ static int stream_enable_cache(stream_t **stream, int64_t size, int64_t min,
     cache->uncached_stream = orig;
     cache->flags |= MP_STREAM_SEEK;
     cache->mode = STREAM_READ;
-    cache->read_chunk = 4 * STREAM_BUFFER_SIZE;
+    cache->read_chunk = 64 * 1024;
 
     cache->url = talloc_strdup(cache, orig->url);
     cache->mime_type = talloc_strdup(cache, orig->mime_type);
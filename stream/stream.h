@@ -43,6 +43,7 @@ enum streamtype {
     STREAMTYPE_AVDEVICE,
 };
 
+// Minimum size of a buffer refill.
 #define STREAM_BUFFER_SIZE 2048
 #define STREAM_MAX_SECTOR_SIZE (8 * 1024)
 
@@ -86,6 +87,9 @@ enum stream_ctrl {
     STREAM_CTRL_SET_CACHE_SIZE,
     STREAM_CTRL_GET_CACHE_FILL,
     STREAM_CTRL_GET_CACHE_IDLE,
+    STREAM_CTRL_GET_CACHE_RANGES,       // struct stream_cache_ranges*
+    STREAM_CTRL_GET_CACHE_SPEED,        // int64_t* (measured bytes/second)
+    STREAM_CTRL_GET_CACHE_STATS,        // struct stream_cache_stats*
     STREAM_CTRL_RESUME_CACHE,
     STREAM_CTRL_RECONNECT,
     // DVD/Bluray, signal general support for GET_CURRENT_TIME etc.
@@ -98,7 +102,8 @@ enum stream_ctrl {
     STREAM_CTRL_GET_BASE_FILENAME,
     STREAM_CTRL_GET_NAV_EVENT,          // struct mp_nav_event**
     STREAM_CTRL_NAV_CMD,                // struct mp_nav_cmd*
-    STREAM_CTRL_GET_DISC_NAME
+    STREAM_CTRL_GET_DISC_NAME,
+    STREAM_CTRL_GET_MTIME,              // int64_t* (modification time)
 };
 
 struct stream_lang_req {
@@ -107,6 +112,36 @@ struct stream_lang_req {
     char name[50];
 };
 
+// Result of STREAM_CTRL_GET_CACHE_RANGES. The ranges array is allocated
+// with talloc, and must be freed by the caller.
+struct stream_cache_ranges {
+    struct stream_range {
+        int64_t start, end;     // byte positions [start, end)
+    } *ranges;
+    int num_ranges;
+};
+
+// Number of bins in stream_cache_stats.read_latency. Bin N counts reads that
+// took less than 4^N ms, the last bin counts all reads that took longer.
+#define STREAM_CACHE_LATENCY_BINS 7
+
+// Result of STREAM_CTRL_GET_CACHE_STATS. The counters are totals since the
+// cache was created. Times are in seconds.
+struct stream_cache_stats {
+    int64_t read_bytes;     // bytes read from the underlying stream
+    int64_t file_bytes;     // bytes read back from the cache file
+    int64_t range_bytes;    // bytes restored from kept ranges
+    int64_t served_bytes;   // bytes returned to the reader
+    int64_t reads;          // read calls on the underlying stream
+    int64_t read_latency[STREAM_CACHE_LATENCY_BINS];
+    int64_t drops_seek;     // cache dropped because of a seek outside of it
+    int64_t drops_control;  // cache dropped because of a STREAM_CTRL
+    double wait_time;       // time the reader was blocked on the cache thread
+    int64_t controls;       // STREAM_CTRLs executed by the cache thread
+    double control_time;    // sum of their round-trip times
+    double control_time_max;
+};
+
 struct stream_dvd_info_req {
     unsigned int palette[16];
     int num_subs;
@@ -134,6 +169,11 @@ typedef struct stream {
     int (*write_buffer)(struct stream *s, char *buffer, int len);
     // Seek
     int (*seek)(struct stream *s, int64_t pos);
+    // Optional. Return a pointer to the data at the given file position
+    // without copying it (e.g. a memory mapping). Returns the number of bytes
+    // that can be accessed at *data (0 on EOF or error). The pointer becomes
+    // invalid on the next call to any other stream function.
+    int (*get_view)(struct stream *s, int64_t pos, void **data);
     // Control
     // Will be later used to let streams like dvd and cdda report
     // their structure (ie tracks, chapters, etc)
@@ -169,8 +209,11 @@ typedef struct stream {
     struct stream *uncached_stream; // underlying stream for cache wrapper
     struct stream *source;
 
-    // Includes additional padding in case sizes get rounded up by sector size.
-    unsigned char buffer[];
+    // Local read buffer. It's allocated on first use, and grows on demand
+    // up to STREAM_MAX_BUFFER_SIZE (stream_peek()). Includes additional
+    // padding in case sizes get rounded up by sector size.
+    unsigned char *buffer;
+    int buffer_alloc; // allocated size of buffer (without padding)
 } stream_t;
 
 int stream_fill_buffer(stream_t *s);
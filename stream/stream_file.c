@@ -29,11 +29,18 @@
 
 #include "osdep/io.h"
 
+#include "common/common.h"
 #include "common/msg.h"
+#include "options/options.h"
 #include "stream.h"
+#include "file_readahead.h"
 #include "options/m_option.h"
 #include "options/path.h"
 
+#if HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #if HAVE_BSD_FSTATFS
 #include <sys/param.h>
 #include <sys/mount.h>
@@ -53,9 +60,25 @@
 #endif
 #endif
 
+// Files up to this size are mapped completely. Larger files are accessed
+// through a sliding window of MMAP_WINDOW_SIZE bytes.
+#define MMAP_MAX_SIZE (sizeof(void *) > 4 ? (16LL << 30) : (256LL << 20))
+#define MMAP_WINDOW_SIZE (64LL << 20)
+
+// Number of read-ahead requests with --stream-readahead=auto on network
+// filesystems.
+#define READAHEAD_AUTO_REQUESTS 8
+
 struct priv {
     int fd;
     bool close;
+    // Memory mapped part of the file (--stream-mmap)
+    void *map;
+    int64_t map_pos;    // file position of map[0]
+    int64_t map_size;
+    int64_t file_size;
+    // Asynchronous read-ahead (--stream-readahead)
+    struct mp_readahead *readahead;
 };
 
 static int fill_buffer(stream_t *s, char *buffer, int max_len)
@@ -65,6 +88,99 @@ static int fill_buffer(stream_t *s, char *buffer, int max_len)
     return (r <= 0) ? -1 : r;
 }
 
+static int fill_buffer_readahead(stream_t *s, char *buffer, int max_len)
+{
+    struct priv *p = s->priv;
+    int r = mp_readahead_read(p->readahead, s->pos, buffer, max_len);
+    return (r <= 0) ? -1 : r;
+}
+
+#if HAVE_SYS_MMAN_H
+static void unmap_window(struct priv *p)
+{
+    if (p->map)
+        munmap(p->map, p->map_size);
+    p->map = NULL;
+    p->map_pos = p->map_size = 0;
+}
+
+// Make sure the mapping contains the byte at pos. Returns false on EOF/error.
+static bool map_window(stream_t *s, int64_t pos)
+{
+    struct priv *p = s->priv;
+    if (p->map && pos >= p->map_pos && pos < p->map_pos + p->map_size)
+        return true;
+
+    if (pos >= p->file_size) {
+        // The file might have been appended to since the last check.
+        struct stat st;
+        if (fstat(p->fd, &st) != 0 || st.st_size <= p->file_size)
+            return false;
+        p->file_size = st.st_size;
+        if (pos >= p->file_size)
+            return false;
+    }
+
+    unmap_window(p);
+
+    int64_t start = 0;
+    int64_t size = p->file_size;
+    if (size > MMAP_MAX_SIZE) {
+        long page_size = sysconf(_SC_PAGESIZE);
+        start = pos - pos % (page_size > 0 ? page_size : 4096);
+        size = MPMIN(p->file_size - start, MMAP_WINDOW_SIZE);
+    }
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, p->fd, start);
+    if (map == MAP_FAILED) {
+        MP_ERR(s, "mmap() failed: %s\n", strerror(errno));
+        return false;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    p->map = map;
+    p->map_pos = start;
+    p->map_size = size;
+    return true;
+}
+
+static int get_view(stream_t *s, int64_t pos, void **data)
+{
+    struct priv *p = s->priv;
+    if (!map_window(s, pos))
+        return 0;
+    *data = (char *)p->map + (pos - p->map_pos);
+    return MPMIN(p->map_pos + p->map_size - pos, INT_MAX);
+}
+
+static int fill_buffer_mmap(stream_t *s, char *buffer, int max_len)
+{
+    void *data;
+    int len = MPMIN(get_view(s, s->pos, &data), max_len);
+    if (len <= 0)
+        return -1;
+    memcpy(buffer, data, len);
+    return len;
+}
+
+static bool init_mmap(stream_t *s)
+{
+    struct priv *p = s->priv;
+    struct stat st;
+    if (fstat(p->fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return false;
+    p->file_size = st.st_size;
+    if (!map_window(s, 0))
+        return false;
+    MP_VERBOSE(s, "Using mmap (%s).\n",
+               p->map_size < p->file_size ? "windowed" : "whole file");
+    return true;
+}
+#else
+static void unmap_window(struct priv *p) {}
+static bool init_mmap(stream_t *s) { return false; }
+#endif
+
 static int write_buffer(stream_t *s, char *buffer, int len)
 {
     struct priv *p = s->priv;
@@ -99,6 +215,16 @@ static int control(stream_t *s, int cmd, void *arg)
             *(uint64_t *)arg = size;
             return 1;
         }
+        break;
+    }
+    case STREAM_CTRL_GET_MTIME: {
+        // Only for files opened by name (not stdin etc.).
+        struct stat st;
+        if (p->close && fstat(p->fd, &st) == 0) {
+            *(int64_t *)arg = st.st_mtime;
+            return 1;
+        }
+        break;
     }
     }
     return STREAM_UNSUPPORTED;
@@ -107,6 +233,8 @@ static int control(stream_t *s, int cmd, void *arg)
 static void s_close(stream_t *s)
 {
     struct priv *p = s->priv;
+    unmap_window(p);
+    mp_readahead_destroy(p->readahead);
     if (p->close && p->fd >= 0)
         close(p->fd);
 }
@@ -293,6 +421,32 @@ static int open_f(stream_t *stream, int mode)
     if (check_stream_network(stream))
         stream->streaming = true;
 
+    // Not for network filesystems: a truncated file would crash us with SIGBUS
+    // instead of returning a read error, and the cache is useful there anyway.
+    if (mode == STREAM_READ && priv->close && !stream->streaming &&
+        stream->opts && stream->opts->stream_mmap && init_mmap(stream))
+    {
+#if HAVE_SYS_MMAN_H
+        stream->fill_buffer = fill_buffer_mmap;
+        stream->get_view = get_view;
+#endif
+        // Reading from the mapping is at least as fast as the cache.
+        stream->allow_caching = false;
+    } else if (mode == STREAM_READ && priv->close && len > 0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        int requests = stream->opts ? stream->opts->stream_readahead : 0;
+        if (requests < 0)
+            requests = stream->streaming ? READAHEAD_AUTO_REQUESTS : 0;
+        if (requests > 0) {
+            priv->readahead = mp_readahead_create(priv, stream->log, fd,
+                                                  requests);
+        }
+        if (priv->readahead)
+            stream->fill_buffer = fill_buffer_readahead;
+    }
+
     return STREAM_OK;
 }
 
@@ -346,35 +346,14 @@ static void multiply_timings(struct packet_list *subs, double factor)
     }
 }
 
-#define MS_TS(f_ts) ((int)((f_ts) * 1000 + 0.5))
-
-// Remove overlaps and fill gaps between adjacent subtitle packets. This is done
-// by adjusting the duration of the earlier packet. If the gaps or overlap are
-// larger than the threshold, or if the durations are close to the threshold,
-// don't change the events.
+// Remove overlaps and fill gaps between adjacent subtitle packets (see
+// demux_packet_fix_timing()).
 // The algorithm is maximally naive and doesn't work if there are multiple
 // overlapping lines. (It's not worth the trouble.)
 static void fix_overlaps_and_gaps(struct packet_list *subs)
 {
-    double threshold = 0.2;     // up to 200 ms overlaps or gaps are removed
-    double keep = threshold * 2;// don't change timings if durations are smaller
-    for (int i = 0; i < subs->num_packets - 1; i++) {
-        struct demux_packet *cur = subs->packets[i];
-        struct demux_packet *next = subs->packets[i + 1];
-        if (cur->pts != MP_NOPTS_VALUE && cur->duration > 0 &&
-            next->pts != MP_NOPTS_VALUE && next->duration > 0)
-        {
-            double end = cur->pts + cur->duration;
-            if (fabs(next->pts - end) <= threshold && cur->duration >= keep &&
-                next->duration >= keep)
-            {
-                // Conceptually: cur->duration = next->pts - cur->pts;
-                // But make sure the rounding and conversion to integers in
-                // sd_ass.c can't produce overlaps.
-                cur->duration = (MS_TS(next->pts) - MS_TS(cur->pts)) / 1000.0;
-            }
-        }
-    }
+    for (int i = 0; i < subs->num_packets - 1; i++)
+        demux_packet_fix_timing(subs->packets[i], subs->packets[i + 1]);
 }
 
 static void add_sub_list(struct dec_sub *sub, int at, struct packet_list *subs)
@@ -418,8 +397,6 @@ bool sub_read_all_packets(struct dec_sub *sub, struct sh_stream *sh)
         return false;
     }
 
-    struct packet_list *subs = talloc_zero(NULL, struct packet_list);
-
     // In some cases, we want to put the packets through a decoder first.
     // Preprocess until sub->sd[preprocess].
     int preprocess = 0;
@@ -433,6 +410,29 @@ bool sub_read_all_packets(struct dec_sub *sub, struct sh_stream *sh)
     if (sub->sd[0]->driver == &sd_lavf_srt)
         preprocess = 1;
 
+    double sub_speed = 1.0;
+
+    if (sub->video_fps && sh->sub->frame_based > 0) {
+        MP_VERBOSE(sub, "Frame based format, dummy FPS: %f, video FPS: %f\n",
+                   sh->sub->frame_based, sub->video_fps);
+        sub_speed *= sh->sub->frame_based / sub->video_fps;
+    }
+
+    if (opts->sub_fps && sub->video_fps)
+        sub_speed *= opts->sub_fps / sub->video_fps;
+
+    sub_speed *= opts->sub_speed;
+
+    // Streamed subtitles are read as playback goes on instead, which works
+    // only if the packets can be used as they are.
+    if (sh->sub->streaming && sub_speed == 1.0 && !preprocess) {
+        MP_VERBOSE(sub, "Not preloading streamed subtitles.\n");
+        pthread_mutex_unlock(&sub->lock);
+        return false;
+    }
+
+    struct packet_list *subs = talloc_zero(NULL, struct packet_list);
+
     for (;;) {
         struct demux_packet *pkt = demux_read_packet(sh);
         if (!pkt)
@@ -458,19 +458,6 @@ bool sub_read_all_packets(struct dec_sub *sub, struct sh_stream *sh)
     if (sub->charset && sub->charset[0] && !mp_charset_is_utf8(sub->charset))
         MP_INFO(sub, "Using subtitle charset: %s\n", sub->charset);
 
-    double sub_speed = 1.0;
-
-    if (sub->video_fps && sh->sub->frame_based > 0) {
-        MP_VERBOSE(sub, "Frame based format, dummy FPS: %f, video FPS: %f\n",
-                   sh->sub->frame_based, sub->video_fps);
-        sub_speed *= sh->sub->frame_based / sub->video_fps;
-    }
-
-    if (opts->sub_fps && sub->video_fps)
-        sub_speed *= opts->sub_fps / sub->video_fps;
-
-    sub_speed *= opts->sub_speed;
-
     if (sub_speed != 1.0)
         multiply_timings(subs, sub_speed);
 
@@ -166,6 +166,7 @@ def build(ctx):
         ( "common/version.c" ),
 
         ## Demuxers
+        ( "demux/benchmark.c" ),
         ( "demux/codec_tags.c" ),
         ( "demux/demux.c" ),
         ( "demux/demux_cue.c" ),
@@ -179,6 +180,7 @@ def build(ctx):
         ( "demux/demux_subreader.c" ),
         ( "demux/ebml.c" ),
         ( "demux/mf.c" ),
+        ( "demux/packet_pool.c" ),
 
         ## Input
         ( "input/cmd_list.c" ),
@@ -228,7 +230,9 @@ def build(ctx):
         ( "stream/ai_sndio.c",                   "sndio" ),
         ( "stream/audio_in.c",                   "audio-input" ),
         ( "stream/cache.c" ),
+        ( "stream/cache_file.c" ),
         ( "stream/cookies.c" ),
+        ( "stream/file_readahead.c" ),
         ( "stream/dvb_tune.c",                   "dvbin" ),
         ( "stream/frequencies.c",                "tv" ),
         ( "stream/rar.c" ),